@@ -0,0 +1,202 @@
+// Module for admission control, which keeps a misbehaving client (or too
+// many clients) from slowing the server down for everyone else.
+
+// Commands are rate limited with token buckets, by class (see admit.h):
+// every connection has a bucket for each class, and there can also be a
+// bucket for each class shared by the whole server. A command takes a
+// token from its connection's bucket and from the server's; if either is
+// empty it is refused with "ERR BUSY" before it touches any airport.
+// Buckets fill up at "rate" tokens a second, up to "burst". The flights
+// on a fleet connection all take their tokens from the fleet connection's
+// buckets, so that spreading commands over more channels doesn't get a
+// client past its limit.
+//
+// There can also be a cap on the number of connections. Once it is
+// reached, the accept loop answers new connections with "ERR BUSY" and
+// closes them straight away, without making a plane or a thread.
+//
+// None of this is on unless it is set up with admit_set_limit and
+// admit_set_max_conns (from the server's command line).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "binproto.h"
+#include "conntab.h"
+#include "vclock.h"
+
+// How fast a bucket fills (tokens a second) and how many it can hold. A
+// rate of 0 means no limit.
+
+typedef struct admit_limit {
+    double rate;
+    double burst;
+} admit_limit;
+
+static char *class_names[ADMIT_NCLASSES] = {"query", "update", "other"};
+
+static admit_limit conn_limits[ADMIT_NCLASSES];
+static admit_limit server_limits[ADMIT_NCLASSES];
+static admit_bucket server_buckets[ADMIT_NCLASSES] = {{-1}, {-1}, {-1}};
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static int max_conns;             // 0 if there is no cap
+static long long busy_commands;   // Commands refused
+static long long busy_conns;      // Connections refused
+
+/************************************************************************
+ * admit_set_limit sets the rate limit for a class of commands from
+ * "spec", which is "class=rate" or "class=rate:burst" (the burst is
+ * twice the rate if it isn't given). The limit is for each connection, or
+ * for the whole server if "global" is true. Returns 0, or -1 if "spec"
+ * isn't valid.
+ */
+int admit_set_limit(int global, char *spec) {
+    char *eq = strchr(spec, '=');
+    if (eq == NULL)
+        return -1;
+    int class;
+    for (class = 0; class < ADMIT_NCLASSES; class++) {
+        if ((strlen(class_names[class]) == (size_t)(eq - spec)) &&
+            (strncmp(spec, class_names[class], eq - spec) == 0))
+            break;
+    }
+    if (class == ADMIT_NCLASSES)
+        return -1;
+
+    char *end;
+    double rate = strtod(eq + 1, &end);
+    double burst = 2 * rate;
+    if (*end == ':')
+        burst = strtod(end + 1, &end);
+    if ((*end != '\0') || (rate < 0) || (burst < 1))
+        return -1;
+
+    admit_limit *limit = global ? &server_limits[class] : &conn_limits[class];
+    limit->rate = rate;
+    limit->burst = burst;
+    return 0;
+}
+
+/************************************************************************
+ * admit_set_max_conns caps the number of connections at "max" (0 for no
+ * cap).
+ */
+void admit_set_max_conns(int max) {
+    max_conns = max;
+}
+
+/************************************************************************
+ * admit_class returns the class of text command "cmd".
+ */
+int admit_class(char *cmd) {
+    if ((strcmp(cmd, "REQPOS") == 0) || (strcmp(cmd, "REQAHEAD") == 0) ||
+        (strcmp(cmd, "REQETA") == 0) || (strcmp(cmd, "STATS") == 0))
+        return ADMIT_QUERY;
+    if ((strcmp(cmd, "REG") == 0) || (strcmp(cmd, "REQTAXI") == 0) ||
+        (strcmp(cmd, "INAIR") == 0))
+        return ADMIT_UPDATE;
+    if (strcmp(cmd, "BYE") == 0)
+        return ADMIT_FREE;
+    return ADMIT_OTHER;
+}
+
+/************************************************************************
+ * admit_class_code returns the class of binary request "code".
+ */
+int admit_class_code(int code) {
+    switch (code) {
+    case BIN_REQPOS: case BIN_REQAHEAD: case BIN_REQETA: case BIN_STATS:
+        return ADMIT_QUERY;
+    case BIN_REG: case BIN_REQTAXI: case BIN_INAIR: return ADMIT_UPDATE;
+    case BIN_BYE: return ADMIT_FREE;
+    default: return ADMIT_OTHER;
+    }
+}
+
+/************************************************************************
+ * take_token takes a token from "bucket", which fills as "limit" says,
+ * at time "now" (ms). Returns 1 if there was one, or 0 if it was empty.
+ */
+static int take_token(admit_bucket *bucket, admit_limit *limit, long long now) {
+    if (bucket->tokens < 0) {
+        bucket->tokens = limit->burst;
+    } else {
+        bucket->tokens += (now - bucket->refilled_ms) * limit->rate / 1000;
+        if (bucket->tokens > limit->burst)
+            bucket->tokens = limit->burst;
+    }
+    bucket->refilled_ms = now;
+    if (bucket->tokens < 1)
+        return 0;
+    bucket->tokens -= 1;
+    return 1;
+}
+
+/************************************************************************
+ * admit_command decides whether "plane" can go ahead with a command of
+ * class "class". If it can't, this answers "ERR BUSY" and returns 0, and
+ * the command must be dropped; otherwise it returns 1. A fleet channel's
+ * command is charged to its fleet connection. Must be called from the
+ * connection's own thread.
+ */
+int admit_command(airplane *plane, int class) {
+    if (class == ADMIT_FREE)
+        return 1;
+    admit_limit *mine = &conn_limits[class];
+    admit_limit *server = &server_limits[class];
+    if ((mine->rate == 0) && (server->rate == 0))
+        return 1;
+
+    long long now = vclock_now_ms();
+    airplane *conn = (plane->fleet_conn != NULL) ? plane->fleet_conn : plane;
+    admit_bucket *bucket = &conn->admit[class];
+    int ok = (mine->rate == 0) || take_token(bucket, mine, now);
+    if (ok && (server->rate > 0)) {
+        pthread_mutex_lock(&server_lock);
+        ok = take_token(&server_buckets[class], server, now);
+        pthread_mutex_unlock(&server_lock);
+        if (!ok && (mine->rate > 0))
+            bucket->tokens += 1;  // Not the connection's fault
+    }
+    if (!ok) {
+        __atomic_add_fetch(&busy_commands, 1, __ATOMIC_RELAXED);
+        send_err(plane, "BUSY");
+    }
+    return ok;
+}
+
+/************************************************************************
+ * admit_full returns true if the server has as many connections as it
+ * is allowed.
+ */
+int admit_full() {
+    return (max_conns > 0) && (conntab_count() >= max_conns);
+}
+
+/************************************************************************
+ * admit_reject turns away the connection on socket "fd", with "ERR BUSY"
+ * (if it can be sent without waiting), and closes it.
+ */
+void admit_reject(int fd) {
+    static const char busy[] = "ERR BUSY\n";
+    send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    __atomic_add_fetch(&busy_conns, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * admit_stats writes the admission statistics (for the STATS command) as
+ * " name=value" pairs.
+ */
+void admit_stats(FILE *out) {
+    fprintf(out, " busy_commands=%lld busy_conns=%lld",
+            __atomic_load_n(&busy_commands, __ATOMIC_RELAXED),
+            __atomic_load_n(&busy_conns, __ATOMIC_RELAXED));
+}
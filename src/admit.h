@@ -0,0 +1,52 @@
+// Prototypes and constants for the admission control module
+
+#ifndef _ADMIT_H
+#define _ADMIT_H
+
+#include <stdio.h>
+
+// Classes of commands, which are rate limited separately. Queries (REQPOS,
+// REQAHEAD, REQETA, STATS) walk the shared queues and lists, updates (REG,
+// REQTAXI, INAIR) change them, and everything else is "other". BYE is
+// never limited (ADMIT_FREE).
+
+#define ADMIT_QUERY 0
+#define ADMIT_UPDATE 1
+#define ADMIT_OTHER 2
+#define ADMIT_NCLASSES 3
+#define ADMIT_FREE -1
+
+// A token bucket. Each connection has one for every class (in its
+// airplane struct, which a fleet connection's channels share), and the
+// server has one for every class that all the connections share.
+// "tokens" is negative until the bucket is first used, when it starts
+// full.
+
+typedef struct admit_bucket {
+    double tokens;
+    long long refilled_ms;      // When tokens were last added
+} admit_bucket;
+
+/************************************************************************
+ * admit_reset sets a connection's buckets (an array of ADMIT_NCLASSES) up
+ * to start full.
+ */
+static inline void admit_reset(admit_bucket *buckets) {
+    for (int i = 0; i < ADMIT_NCLASSES; i++) {
+        buckets[i].tokens = -1;
+        buckets[i].refilled_ms = 0;
+    }
+}
+
+struct airplane;
+
+int admit_set_limit(int global, char *spec);
+void admit_set_max_conns(int max);
+int admit_class(char *cmd);
+int admit_class_code(int code);
+int admit_command(struct airplane *plane, int class);
+int admit_full();
+void admit_reject(int fd);
+void admit_stats(FILE *out);
+
+#endif  // _ADMIT_H
@@ -5,23 +5,28 @@
 #include <unistd.h>
 
 #include "airplane.h"
+#include "prealloc.h"
+#include "wake.h"
 
 /************************************************************************
  * plane_init initializes an airplane structure in the initial PLANE_UNREG
- * state, with given send and receive FILE objects.
+ * state, with given send and receive FILE objects. If there are
+ * preallocated sessions, the plane and its stream buffers come from one.
  */
 
 airplane* airplane_create(int _comm_fd){
-    airplane* new_plane = malloc(sizeof(airplane));
+    session *ses = prealloc_session();
+    airplane* new_plane = (ses != NULL) ? &ses->plane : malloc(sizeof(airplane));
     if (new_plane == NULL) {
         perror("new_airplane");
         exit(1);
     }
+    new_plane->session = ses;
 
     int duplicated_fd = dup(_comm_fd);
     if (duplicated_fd < 0) {
         perror("new_airplane dup");
-        free(new_plane);
+        airplane_free(new_plane);
         return NULL;
     }
 
@@ -30,7 +35,7 @@ airplane* airplane_create(int _comm_fd){
         perror("new_airplane fd_open sender");
         close(duplicated_fd);
         close(_comm_fd);
-        free(new_plane);
+        airplane_free(new_plane);
         return NULL;
     }
 
@@ -39,25 +44,43 @@ airplane* airplane_create(int _comm_fd){
         perror("new_airplane fd_open receiver");
         fclose(sender);
         close(duplicated_fd);
-        free(new_plane);
+        airplane_free(new_plane);
         return NULL;
     }
 
     //this makes the sender and receiver line buffered so that it will send something after
     //  every line instead of at the end
-    setvbuf(sender, NULL, _IOLBF, 0);
-    setvbuf(receiver, NULL, _IOLBF, 0);
+    if (ses != NULL) {
+        setvbuf(sender, ses->send_buf, _IOLBF, PREALLOC_BUFSIZE);
+        setvbuf(receiver, ses->recv_buf, _IOLBF, PREALLOC_BUFSIZE);
+    } else {
+        setvbuf(sender, NULL, _IOLBF, 0);
+        setvbuf(receiver, NULL, _IOLBF, 0);
+    }
 
     airplane_init(new_plane, sender, receiver);
+    new_plane->session = ses;
 
     return new_plane;
 }
 
 void airplane_init(airplane *plane, FILE* fp_send, FILE* fp_recv) {
     plane->state = PLANE_UNREG;
+    plane->category = WAKE_DEFAULT;
     plane->fp_send = fp_send;
     plane->fp_recv = fp_recv;
     plane->id[0] = '\0';
+    plane->airport = NULL;
+    plane->fleet = NULL;
+    plane->fleet_conn = NULL;
+    plane->bin = NULL;
+    plane->shm = NULL;
+    plane->reg_index = -1;
+    plane->queued = NULL;
+    plane->conn_slot = -1;
+    plane->capture_id = 0;
+    admit_reset(plane->admit);
+    plane->session = NULL;
 }
 
 /************************************************************************
@@ -66,6 +89,29 @@ void airplane_init(airplane *plane, FILE* fp_send, FILE* fp_recv) {
  */
 void airplane_destroy(airplane *plane) {
     plane->state = PLANE_DONE;
-    fclose(plane->fp_send);
-    fclose(plane->fp_recv);
+    if (plane->fp_send != NULL)
+        fclose(plane->fp_send);
+    if (plane->fp_recv != NULL)
+        fclose(plane->fp_recv);
+}
+
+/************************************************************************
+ * airplane_free frees a plane that has been destroyed, giving it back to
+ * its session pool if it came from one.
+ */
+void airplane_free(void *data) {
+    airplane *plane = data;
+    if (plane->session != NULL)
+        prealloc_release(plane->session);
+    else
+        free(plane);
+}
+
+/************************************************************************
+ * airplane_detached returns true if the plane has no connection. These
+ * are planes whose state was taken over from another server, and that
+ * haven't reconnected yet.
+ */
+int airplane_detached(airplane *plane) {
+    return (plane->fp_send == NULL);
 }
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <pthread.h>
 
+#include "admit.h"
+
 // The maximum length of a plane id
 
 #define PLANE_MAXID 20
@@ -19,6 +21,15 @@
 #define PLANE_TAXIING 3
 #define PLANE_CLEAR 4
 #define PLANE_INAIR 5
+#define PLANE_OBSERVER 6   // Not a plane: a connection watching the queues
+#define PLANE_FLEET 7      // Not a plane: a connection carrying many planes
+
+struct airport;
+struct fleet;
+struct binconn;
+struct shm_conn;
+struct queue_entry;
+struct session;
 
 // The struct to keep track of all information about an airplane in
 // the system.
@@ -26,9 +37,21 @@
 typedef struct airplane {
     pthread_t tid;
     int state;
+    int category;  // Wake turbulence category (WAKE_* in wake.h)
     FILE* fp_send;
     FILE* fp_recv;
     char id[PLANE_MAXID+1];
+    struct airport *airport;  // Where the plane registered (NULL before REG)
+    struct fleet *fleet;      // Channels, for a fleet connection (else NULL)
+    struct airplane *fleet_conn;  // The fleet connection, for a channel (else NULL)
+    struct binconn *bin;      // Binary protocol state (NULL if using text)
+    struct shm_conn *shm;     // Shared-memory rings (NULL if using a socket)
+    int reg_index;            // Where it is in its airport's list (-1 if not)
+    struct queue_entry *queued;  // Its taxi queue entry (NULL if not queued)
+    int conn_slot;            // Its connection table slot (-1 if none)
+    unsigned int capture_id;  // Its connection number in the capture (0 if none)
+    admit_bucket admit[ADMIT_NCLASSES];  // Rate limits for its commands
+    struct session *session;  // Its preallocated session (NULL if none)
 } airplane;
 
 // Basic initializer and destructor functions
@@ -36,5 +59,7 @@ typedef struct airplane {
 airplane* airplane_create(int _comm_fd);
 void airplane_init(airplane *plane, FILE *fp_send, FILE *fp_recv);
 void airplane_destroy(airplane *plane);
+void airplane_free(void *plane);
+int airplane_detached(airplane *plane);
 
 #endif  // _AIRPLANE_H
@@ -5,50 +5,229 @@
 #include "alist.h"
 #include "airplanelist.h"
 #include "airplane.h"
+#include "prealloc.h"
+#include "trace.h"
 
+/***************************************************************************
+ * list_rdlock and list_wrlock take the list lock for reading or writing
+ * (timing the wait, for the tracer).
+ */
+static void list_rdlock(airplanelist *list) {
+    TRACE_BEGIN(wait);
+    pthread_rwlock_rdlock(&(list->lock));
+    TRACE_END(wait, "airplanelist lock");
+}
+
+static void list_wrlock(airplanelist *list) {
+    TRACE_BEGIN(wait);
+    pthread_rwlock_wrlock(&(list->lock));
+    TRACE_END(wait, "airplanelist lock");
+}
+
+/***************************************************************************
+ * id_hash returns the hash of flight id "id".
+ */
+static unsigned int id_hash(char *id) {
+    unsigned int hash = 2166136261u;
+    for (char *cp = id; *cp != '\0'; cp++)
+        hash = (hash ^ (unsigned char)*cp) * 16777619u;
+    return hash;
+}
+
+/***************************************************************************
+ * hot_alloc allocates "size" bytes starting on a cache line.
+ */
+static void *hot_alloc(size_t size) {
+    void *p = aligned_alloc(REG_ALIGN, (size + REG_ALIGN - 1) / REG_ALIGN * REG_ALIGN);
+    if (p == NULL) {
+        perror("airplanelist");
+        exit(1);
+    }
+    return p;
+}
+
+/***************************************************************************
+ * hot_link puts the plane at "index" (whose hash is already in the hashes
+ * array) into the hash index, and hot_unlink takes it out. Must be called
+ * with the list lock held for writing.
+ */
+static void hot_link(airplanelist *list, int index) {
+    int *head = &list->buckets[list->hashes[index] & (list->hot_capacity - 1)];
+    list->chain[index] = *head;
+    *head = index;
+}
+
+static void hot_unlink(airplanelist *list, int index) {
+    int *link = &list->buckets[list->hashes[index] & (list->hot_capacity - 1)];
+    while (*link != index)
+        link = &list->chain[*link];
+    *link = list->chain[index];
+}
 
-static alist airplanelist;
+/***************************************************************************
+ * hot_set fills in the registry's arrays for "plane", which is at "index".
+ * Must be called with the list lock held for writing.
+ */
+static void hot_set(airplanelist *list, int index, airplane *plane) {
+    list->hashes[index] = id_hash(plane->id);
+    list->detached[index] = airplane_detached(plane);
+    hot_link(list, index);
+}
+
+/***************************************************************************
+ * hot_grow makes the registry's arrays "capacity" (a power of two) long,
+ * rebuilding the hash index. Must be called with the list lock held for
+ * writing.
+ */
+static void hot_grow(airplanelist *list, int capacity) {
+    int in_use = list->planes.in_use;
+    unsigned int *hashes = hot_alloc(capacity * sizeof(unsigned int));
+    unsigned char *detached = hot_alloc(capacity);
+    if (in_use > 0) {
+        memcpy(hashes, list->hashes, in_use * sizeof(unsigned int));
+        memcpy(detached, list->detached, in_use);
+    }
+    free(list->hashes);
+    free(list->detached);
+    free(list->chain);
+    free(list->buckets);
+    list->hashes = hashes;
+    list->detached = detached;
+    list->chain = hot_alloc(capacity * sizeof(int));
+    list->buckets = hot_alloc(capacity * sizeof(int));
+    list->hot_capacity = capacity;
 
-//create a lock for airplane list
-pthread_rwlock_t airplanelist_lock;
+    for (int i = 0; i < capacity; i++)
+        list->buckets[i] = -1;
+    for (int i = 0; i < in_use; i++)
+        hot_link(list, i);
+}
+
+/***************************************************************************
+ * hot_reserve makes the registry's arrays big enough for one more plane,
+ * doubling them if need be. Must be called with the list lock held for
+ * writing.
+ */
+static void hot_reserve(airplanelist *list) {
+    if (list->planes.in_use < list->hot_capacity)
+        return;
+    hot_grow(list, (list->hot_capacity == 0) ? REG_START : list->hot_capacity * 2);
+}
 
-/*void airplane_free(void *plane) {
-    airplane *new_plane = (airplane *)plane;
-    airplane_destroy(new_plane);
-    free(new_plane);
-}*/
+/***************************************************************************
+ * airplane_index returns the index of flight "plane_id" in the list, or -1
+ * if it isn't there. Must be called with the list lock held.
+ */
+static int airplane_index(airplanelist *list, char* plane_id) {
+    if (list->hot_capacity == 0)
+        return -1;
+    unsigned int hash = id_hash(plane_id);
+    for (int i = list->buckets[hash & (list->hot_capacity - 1)]; i >= 0; i = list->chain[i]) {
+        if (list->hashes[i] == hash) {
+            airplane* compare_plane = list->planes.data[i];
+            if (strcmp(plane_id, compare_plane->id) == 0)
+                return i;
+        }
+    }
+    return -1;
+}
+
+/***************************************************************************
+ * list_append adds "plane" to the end of the list. Must be called with the
+ * list lock held for writing.
+ */
+static void list_append(airplanelist *list, airplane *plane) {
+    hot_reserve(list);
+    int index = list->planes.in_use;
+    plane->reg_index = index;
+    alist_add(&list->planes, plane);
+    hot_set(list, index, plane);
+}
+
+/***************************************************************************
+ * list_take takes the plane at "index" out of the list without freeing it,
+ * moving the last plane into its place so that nothing else has to move.
+ * Must be called with the list lock held for writing.
+ */
+static void list_take(airplanelist *list, int index) {
+    int last_index = list->planes.in_use - 1;
+    airplane *plane = list->planes.data[index];
+    airplane *last = list->planes.data[last_index];
+    hot_unlink(list, index);
+    if (index != last_index) {
+        hot_unlink(list, last_index);
+        list->planes.data[index] = last;
+        list->hashes[index] = list->hashes[last_index];
+        list->detached[index] = list->detached[last_index];
+        hot_link(list, index);
+        last->reg_index = index;
+    }
+    list->planes.in_use--;
+    plane->reg_index = -1;
+}
 
 /***************************************************************************
  * airplanelist_init initializes an array list to empty and with the default
  * capacity and initilizes th thread.
  */
-void airplanelist_init(void (*data_free)(void *data)) {
-    alist_init(&airplanelist, free);
+void airplanelist_init(airplanelist *list, void (*data_free)(void *data)) {
+    alist_init(&list->planes, data_free);
+    list->hashes = NULL;
+    list->detached = NULL;
+    list->chain = NULL;
+    list->buckets = NULL;
+    list->hot_capacity = 0;
     //init the lock
-    pthread_rwlock_init(&(airplanelist_lock), NULL);
+    pthread_rwlock_init(&(list->lock), NULL);
+}
+
+/***************************************************************************
+ * airplanelist_reserve makes room in the list for "count" planes, so that
+ * registering that many doesn't have to grow any of its arrays, and locks
+ * the arrays in memory (see prealloc_lock).
+ */
+void airplanelist_reserve(airplanelist *list, int count) {
+    list_wrlock(list);
+    alist_reserve(&list->planes, count);
+    int capacity = (list->hot_capacity == 0) ? REG_START : list->hot_capacity;
+    while (capacity < count)
+        capacity *= 2;
+    if (capacity > list->hot_capacity)
+        hot_grow(list, capacity);
+
+    prealloc_lock(list->planes.data, list->planes.capacity * sizeof(void *));
+    prealloc_lock(list->hashes, capacity * sizeof(unsigned int));
+    prealloc_lock(list->detached, capacity);
+    prealloc_lock(list->chain, capacity * sizeof(int));
+    prealloc_lock(list->buckets, capacity * sizeof(int));
+    pthread_rwlock_unlock(&(list->lock));
 }
 
 /***************************************************************************
  * airplanelist_clear resets the size of the array list to 0 
  * (empties the alist).
  */
-void airplanelist_clear() {
-    alist_clear(&airplanelist);
+void airplanelist_clear(airplanelist *list) {
+    list_wrlock(list);
+    alist_clear(&list->planes);
+    for (int i = 0; i < list->hot_capacity; i++)
+        list->buckets[i] = -1;
+    pthread_rwlock_unlock(&(list->lock));
 }
 
 /***************************************************************************
  * airplanelist_is_empty returns true if and only if the list of airplanes 
  * is empty.
  */
-int airplanelist_is_empty() {
-    return alist_is_empty(&airplanelist);
+int airplanelist_is_empty(airplanelist *list) {
+    return alist_is_empty(&list->planes);
 }
 
 /***************************************************************************
  * airplanelist_size returns the size of the array list
  */
-int airplanelist_size() {
-    int size = alist_size(&airplanelist);
+int airplanelist_size(airplanelist *list) {
+    int size = alist_size(&list->planes);
     return size;
 }
 
@@ -56,20 +235,77 @@ int airplanelist_size() {
  * airplanelist_get returns the value at array index "index", or NULL if 
  * this is an invalid index.
  */
-airplane *airplanelist_get(int index) {
-    pthread_rwlock_wrlock(&(airplanelist_lock));
-    airplane *retval = alist_get(&airplanelist, index);
-    pthread_rwlock_unlock(&(airplanelist_lock));
+airplane *airplanelist_get(airplanelist *list, int index) {
+    list_rdlock(list);
+    airplane *retval = alist_get(&list->planes, index);
+    pthread_rwlock_unlock(&(list->lock));
     return retval;
 }
 
 /***************************************************************************
  * airplanelist_add appends a new value to the end of the array list.
  */
-void airplanelist_add(airplane *val) {
-    pthread_rwlock_wrlock(&(airplanelist_lock));
-    alist_add(&airplanelist, val);
-    pthread_rwlock_unlock(&(airplanelist_lock));
+void airplanelist_add(airplanelist *list, airplane *val) {
+    list_wrlock(list);
+    list_append(list, val);
+    pthread_rwlock_unlock(&(list->lock));
+}
+
+/***************************************************************************
+ * airplanelist_register gives "plane" the flight id "plane_id" and adds it
+ * to the list, unless another plane in the list already has that id. The
+ * check and the add happen under one lock, so two planes can't register
+ * the same id at once. Returns 1 if the plane was registered, and 0 if the
+ * id is taken.
+ *
+ * If the plane with that id is detached (its state came from another
+ * server and it hasn't reconnected), "plane" takes its place instead,
+ * picking up its state, wake category and place in the taxi queue, and
+ * the detached plane is freed. That returns 2 (and the caller must point
+ * the queue entry at the new plane, see airport_register).
+ */
+int airplanelist_register(airplanelist *list, airplane* plane, char* plane_id) {
+    list_wrlock(list);
+    int index = airplane_index(list, plane_id);
+    if (index >= 0) {
+        airplane* old_plane = list->planes.data[index];
+        if (!airplane_detached(old_plane)) {
+            pthread_rwlock_unlock(&(list->lock));
+            return 0;
+        }
+        strcpy(plane->id, plane_id);
+        plane->state = old_plane->state;
+        plane->category = old_plane->category;
+        plane->queued = old_plane->queued;
+        plane->reg_index = index;
+        list->planes.data[index] = plane;
+        list->detached[index] = airplane_detached(plane);
+        pthread_rwlock_unlock(&(list->lock));
+        airplane_free(old_plane);
+        return 2;
+    }
+    strcpy(plane->id, plane_id);
+    list_append(list, plane);
+    pthread_rwlock_unlock(&(list->lock));
+    return 1;
+}
+
+/***************************************************************************
+ * airplanelist_take_detached takes one detached plane out of the list and
+ * returns it (without freeing it), or returns NULL if there aren't any.
+ */
+airplane* airplanelist_take_detached(airplanelist *list) {
+    list_wrlock(list);
+    airplane* plane = NULL;
+    unsigned char *found = (list->planes.in_use == 0) ? NULL :
+                           memchr(list->detached, 1, list->planes.in_use);
+    if (found != NULL) {
+        int index = found - list->detached;
+        plane = list->planes.data[index];
+        list_take(list, index);
+    }
+    pthread_rwlock_unlock(&(list->lock));
+    return plane;
 }
 
 /***************************************************************************
@@ -77,93 +313,89 @@ void airplanelist_add(airplane *val) {
  * index/position doesn't exist in the list, then nothing happens (the
  * request is ignored).
  */
-void airplanelist_set(int index, airplane* newval) {
-    pthread_rwlock_wrlock(&(airplanelist_lock));
-    alist_set(&airplanelist, index, newval);
-    pthread_rwlock_unlock(&(airplanelist_lock));
+void airplanelist_set(airplanelist *list, int index, airplane* newval) {
+    list_wrlock(list);
+    if ((index >= 0) && (index < list->planes.in_use)) {
+        hot_unlink(list, index);
+        alist_set(&list->planes, index, newval);
+        newval->reg_index = index;
+        hot_set(list, index, newval);
+    }
+    pthread_rwlock_unlock(&(list->lock));
 }
 
 /***************************************************************************
- * airplanelist_remove take the element at index "index" out of the list
- * (decreasing list size by 1). If the index/position doesn't exist in
- * the list, then nothing happens.
+ * airplanelist_remove takes airplane "myairplane" out of the list
+ * (decreasing list size by 1), and destroys and frees it. The plane knows
+ * where it is in the list, so this doesn't have to search for it.
  */
-void airplanelist_remove(airplane* myairplane) {
-    
-    int index = -1;
-    for (size_t i = 0; i < airplanelist.in_use - 1; i++) {
-        airplane* comapare_airplane = airplanelist_get(i);
-        char* airplane_id = comapare_airplane->id;
-        if (strcmp(airplane_id, myairplane->id) == 0) {
-            index = i;
-        }
-    }
-    pthread_rwlock_wrlock(&(airplanelist_lock));
-    alist_remove(&airplanelist, index);
-    pthread_rwlock_unlock(&(airplanelist_lock));
+void airplanelist_remove(airplanelist *list, airplane* myairplane) {
+    // Close files first, since the list's free function releases the struct
     airplane_destroy(myairplane);
+
+    list_wrlock(list);
+    int index = myairplane->reg_index;
+    int listed = (index >= 0) && (index < list->planes.in_use) &&
+                 (list->planes.data[index] == myairplane);
+    if (listed) {
+        list_take(list, index);
+    }
+    pthread_rwlock_unlock(&(list->lock));
+    if (listed) {
+        list->planes.dfree(myairplane);
+    } else {
+        airplane_free(myairplane);
+    }
 }
 
 /***************************************************************************
  * airplanelist_destroy destroys the current array list, freeing up all memory
  * and resources.
  */
-void airplanelist_destroy() {
-    alist_destroy(&airplanelist);
-    pthread_rwlock_destroy(&airplanelist_lock);
+void airplanelist_destroy(airplanelist *list) {
+    alist_destroy(&list->planes);
+    free(list->hashes);
+    free(list->detached);
+    free(list->chain);
+    free(list->buckets);
+    pthread_rwlock_destroy(&list->lock);
 }
 
 /***************************************************************************
- * airplanelist_print prints out list of airplanes in the order they were
- * registered. Used for debugging the program.
+ * airplanelist_print prints out the list of airplanes (which isn't in the
+ * order they registered, since a plane that leaves is replaced by the
+ * last one). Used for debugging the program.
  */
-void airplanelist_print() {
+void airplanelist_print(airplanelist *list) {
     printf("Current Airplane List\n");
-    //pthread_rwlock_wrlock(&(airplanelist_lock));
-    for (size_t i = 0; i < airplanelist.in_use; i++) {
-        airplane* new_airplane = airplanelist_get(i);
+    list_rdlock(list);
+    for (int i = 0; i < list->planes.in_use; i++) {
+        airplane* new_airplane = list->planes.data[i];
         
-        printf("%ld. %s\n", (i+1), new_airplane->id);
+        printf("%d. %s\n", (i+1), new_airplane->id);
     }
-    //pthread_rwlock_unlock(&(airplanelist_lock));
+    pthread_rwlock_unlock(&(list->lock));
 }
 
 /***************************************************************************
  * airplane_exist will return true the airplane id that is trying to be 
  * registered already exist in the list of airplanes
  */
-int airplane_exist(char* plane_id) {
-    int already_exist = 0;
-    //pthread_rwlock_rdlock(&(airplanelist_lock));
-    for (size_t i = 0; i < airplanelist.in_use; i++) {
-        airplane* compare_plane = airplanelist_get(i);
-        char* compare_id = compare_plane->id;
-        int compared_value = strcmp(plane_id, compare_id);
-        if (compared_value == 0 && (compare_plane->state != PLANE_UNREG)) {
-            already_exist = 1;
-            //pthread_rwlock_unlock(&(airplanelist_lock));
-            return already_exist;
-        }
-        
-    }
-    //pthread_rwlock_unlock(&(airplanelist_lock));
+int airplane_exist(airplanelist *list, char* plane_id) {
+    list_rdlock(list);
+    int already_exist = (airplane_index(list, plane_id) >= 0);
+    pthread_rwlock_unlock(&(list->lock));
     return already_exist;
-    
 }
 
-airplane* queue_to_airplanelist(char* next_plane_id) {
-    airplane* compare_plane;
-    for (size_t i = 0; i < airplanelist_size(); i++) {
-        compare_plane = airplanelist_get(i);
-        char* compare_id = compare_plane->id;
-        int compared_value = strcmp(next_plane_id, compare_id);
-
-        if (compared_value == 0) {
-            return compare_plane; 
-        }
-        
-    }
-
-    perror("Plane Could Not Be Found");
-    return compare_plane;
-}
\ No newline at end of file
+/***************************************************************************
+ * airplanelist_find returns the registered airplane with flight id
+ * "plane_id", or NULL if there isn't one.
+ */
+airplane* airplanelist_find(airplanelist *list, char* plane_id) {
+    list_rdlock(list);
+    int index = airplane_index(list, plane_id);
+    airplane* plane = (index < 0) ? NULL : list->planes.data[index];
+    pthread_rwlock_unlock(&(list->lock));
+    return plane;
+}
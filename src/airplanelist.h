@@ -8,20 +8,49 @@
 
 #define DEF_CAPACITY 10
 
+// Planes the registry's own arrays start with (a power of two, since the
+// hash index uses one bucket per element), and the alignment of the
+// arrays (a cache line)
 
+#define REG_START 64
+#define REG_ALIGN 64
 
-void airplanelist_init(void (*data_free)(void *data));
-void airplanelist_clear();
-int airplanelist_is_empty();
-int airplanelist_size();
-airplane *airplanelist_get(int index);
-void airplanelist_add(airplane* val);
-void airplanelist_set(int index, airplane* newval);
-void airplanelist_remove(airplane* airplane);
-void airplanelist_destroy();
+// A list of registered airplanes. Every airport has its own, so flight ids
+// only need to be unique within an airport.
+//
+// The fields that lookups and scans look at are kept in arrays of their
+// own, next to (not inside) the airplane structs, so that a search reads
+// consecutive cache lines instead of following a pointer to every plane
+// and pulling in its thread id and I/O handles. Element i of each array is
+// about the plane in planes.data[i]. "buckets" and "chain" make a hash
+// index on flight id, so a lookup only compares the planes whose ids hash
+// to the same bucket.
+
+typedef struct airplanelist {
+    alist planes;
+    unsigned int *hashes;       // Hash of each plane's flight id
+    unsigned char *detached;    // Whether each plane is detached
+    int *chain;                 // Next plane in the same bucket (-1 = none)
+    int *buckets;               // First plane in each bucket (-1 = none)
+    int hot_capacity;           // Size of the arrays above
+    pthread_rwlock_t lock;
+} airplanelist;
+
+void airplanelist_init(airplanelist *list, void (*data_free)(void *data));
+void airplanelist_reserve(airplanelist *list, int count);
+void airplanelist_clear(airplanelist *list);
+int airplanelist_is_empty(airplanelist *list);
+int airplanelist_size(airplanelist *list);
+airplane *airplanelist_get(airplanelist *list, int index);
+void airplanelist_add(airplanelist *list, airplane* val);
+int airplanelist_register(airplanelist *list, airplane* plane, char* plane_id);
+airplane* airplanelist_take_detached(airplanelist *list);
+void airplanelist_set(airplanelist *list, int index, airplane* newval);
+void airplanelist_remove(airplanelist *list, airplane* airplane);
+void airplanelist_destroy(airplanelist *list);
 void destroy_airplane(void *a);
-void airplanelist_print();
-int airplane_exist(char* plane_id);
-airplane* queue_to_airplanelist(char* next_plane_id);
+void airplanelist_print(airplanelist *list);
+int airplane_exist(airplanelist *list, char* plane_id);
+airplane* airplanelist_find(airplanelist *list, char* plane_id);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,321 @@
+// Module to keep track of the airports served by this ground control
+// server.
+
+// Each airport has its own airplane list, taxi queue and runway thread, so
+// one server process can handle many airports. Airports are created the
+// first time a plane registers at them, and each new airport's runway
+// thread is pinned to the next core (round-robin over the runway threads'
+// cores, see topology.c), so busy airports don't fight over the same core.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "airport.h"
+#include "alist.h"
+#include "logger.h"
+#include "observe.h"
+#include "prealloc.h"
+#include "publish.h"
+#include "repl.h"
+#include "topology.h"
+#include "wake.h"
+
+static alist airports;
+static pthread_rwlock_t airports_lock;
+static int runways_enabled;
+
+/***************************************************************************
+ * airport_free frees an airport structure (when the airport list is
+ * destroyed).
+ */
+static void airport_free(void *item) {
+    airport *ap = item;
+    queue_destroy(&ap->queue);
+    airplanelist_destroy(&ap->planes);
+    free(ap);
+}
+
+/***************************************************************************
+ * airports_init initializes the (empty) list of airports. If
+ * "start_runways" is false then airports are created without runway
+ * threads, and whoever is driving the server (the simulator) has to run
+ * the runway schedulers itself.
+ */
+void airports_init(int start_runways) {
+    alist_init(&airports, airport_free);
+    pthread_rwlock_init(&airports_lock, NULL);
+    runways_enabled = start_runways;
+}
+
+/***************************************************************************
+ * airport_valid_code returns true if "code" can be used as an airport
+ * code: AIRPORT_MINCODE to AIRPORT_MAXCODE upper case letters or digits.
+ * (Insisting on upper case keeps "REG aa123 X" from being taken as flight
+ * X at airport aa123.)
+ */
+int airport_valid_code(char *code) {
+    int len = strlen(code);
+    if ((len < AIRPORT_MINCODE) || (len > AIRPORT_MAXCODE))
+        return 0;
+    for (int i = 0; i < len; i++) {
+        if (!isupper(code[i]) && !isdigit(code[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/***************************************************************************
+ * find_locked returns the airport with code "code", or NULL if there
+ * isn't one. Must be called with airports_lock held.
+ */
+static airport *find_locked(char *code) {
+    for (int i = 0; i < airports.in_use; i++) {
+        airport *ap = airports.data[i];
+        if (strcmp(ap->code, code) == 0)
+            return ap;
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * airport_queue_event is the notify function for every airport's queue.
+ * It is called with the queue mutex held, so changes are passed on in the
+ * order they happened.
+ */
+static void airport_queue_event(queue *q, int event, queue_entry *entry, void *arg) {
+    airport *ap = arg;
+    publish_changed(ap);
+    observe_event(ap, event, entry);
+    switch (event) {
+    case QUEUE_EV_ADDED:
+        repl_log("T %s %s %c\n", ap->code, entry->id, wake_letter(entry->category));
+        break;
+    case QUEUE_EV_REMOVED:
+        repl_log("Q %s %s\n", ap->code, entry->id);
+        break;
+    case QUEUE_EV_CLEARED:
+        repl_log("C %s %s\n", ap->code, entry->id);
+        break;
+    case QUEUE_EV_DEPARTED:
+        repl_log("D %s %s %c\n", ap->code, entry->id, wake_letter(entry->category));
+        break;
+    }
+}
+
+/***************************************************************************
+ * airport_start_runway starts the runway thread for a new airport, pinned
+ * to the next core in turn.
+ */
+static void airport_start_runway(airport *ap, int index) {
+    char name[16];
+    snprintf(name, sizeof(name), "runway-%s", ap->code);
+    ap->cpu = topology_cpu(TOPO_RUNWAY, index);
+    queue_start_runway(&ap->queue, index, name);
+}
+
+/***************************************************************************
+ * airport_find returns the airport with code "code", or NULL if there
+ * isn't one yet. Unlike airport_get, it never opens an airport, so it is
+ * the one to use for anything that only looks at airports.
+ */
+airport *airport_find(char *code) {
+    pthread_rwlock_rdlock(&airports_lock);
+    airport *ap = find_locked(code);
+    pthread_rwlock_unlock(&airports_lock);
+    return ap;
+}
+
+/***************************************************************************
+ * airport_get returns the airport with code "code", creating it if this is
+ * the first plane there. Returns NULL if the code is invalid or there are
+ * already AIRPORT_MAX airports.
+ */
+airport *airport_get(char *code) {
+    airport *ap = airport_find(code);
+    if (ap != NULL)
+        return ap;
+
+    if (!airport_valid_code(code))
+        return NULL;
+
+    pthread_rwlock_wrlock(&airports_lock);
+    ap = find_locked(code);  // Someone else may have just created it
+    if ((ap == NULL) && (airports.in_use < AIRPORT_MAX)) {
+        ap = malloc(sizeof(airport));
+        if (ap == NULL) {
+            perror("airport_get");
+            exit(1);
+        }
+        strcpy(ap->code, code);
+        ap->index = airports.in_use;
+        ap->cpu = -1;
+        airplanelist_init(&ap->planes, airplane_free);
+        queue_init(&ap->queue, queue_free);
+        queue_set_notify(&ap->queue, airport_queue_event, ap);
+        if (prealloc_planes() > 0) {
+            airplanelist_reserve(&ap->planes, prealloc_planes());
+            queue_reserve(&ap->queue, prealloc_planes());
+            prealloc_lock(ap, sizeof(airport));
+        }
+        if (runways_enabled)
+            airport_start_runway(ap, airports.in_use);
+        alist_add(&airports, ap);
+        publish_changed(ap);
+        LOG(LOG_INFO, "Opened airport %s (runway on cpu %d)", ap->code, ap->cpu);
+    }
+    pthread_rwlock_unlock(&airports_lock);
+    return ap;
+}
+
+/***************************************************************************
+ * airports_count returns how many airports there are.
+ */
+int airports_count() {
+    return alist_size(&airports);
+}
+
+/***************************************************************************
+ * airports_get returns airport number "index", or NULL if there is no
+ * such airport. Airports are never removed, so the pointer stays valid.
+ */
+airport *airports_get(int index) {
+    pthread_rwlock_rdlock(&airports_lock);
+    airport *ap = alist_get(&airports, index);
+    pthread_rwlock_unlock(&airports_lock);
+    return ap;
+}
+
+/***************************************************************************
+ * airports_start_runways starts the runway threads of all airports, and of
+ * any airports opened from now on. This is for a server that was built up
+ * without runways (a standby taking over).
+ */
+void airports_start_runways() {
+    pthread_rwlock_wrlock(&airports_lock);
+    if (!runways_enabled) {
+        runways_enabled = 1;
+        for (int i = 0; i < airports.in_use; i++)
+            airport_start_runway(airports.data[i], i);
+    }
+    pthread_rwlock_unlock(&airports_lock);
+}
+
+/***************************************************************************
+ * airport_register registers "plane" as flight "plane_id" with wake
+ * category "category" at airport "ap". Returns 0 if that flight id is
+ * already in use, 1 if the plane was registered, or 2 if it took over the
+ * state of a detached plane with the same id (see airplanelist_register).
+ */
+int airport_register(airport *ap, airplane *plane, char *plane_id, int category) {
+    plane->category = category;
+    plane->state = PLANE_ATTERMINAL;
+
+    // Hold the queue while registering, so the runway never sees a queue
+    // entry still pointing at a detached plane this one has replaced
+    pthread_mutex_lock(&ap->queue.mutex);
+    int result = airplanelist_register(&ap->planes, plane, plane_id);
+    if ((result == 2) && (plane->queued != NULL))
+        plane->queued->plane = plane;
+    pthread_mutex_unlock(&ap->queue.mutex);
+    if (result == 0) {
+        plane->state = PLANE_UNREG;
+        return 0;
+    }
+
+    plane->airport = ap;
+    publish_changed(ap);
+    if (result == 1) {
+        repl_log("R %s %s %c\n", ap->code, plane->id, wake_letter(plane->category));
+    }
+    return result;
+}
+
+/***************************************************************************
+ * airport_restore adds a detached plane (one with no connection) for
+ * flight "plane_id" at airport "ap", if there isn't already a plane with
+ * that id. Returns the plane with that id.
+ */
+airplane *airport_restore(airport *ap, char *plane_id, int category) {
+    airplane *plane = airplanelist_find(&ap->planes, plane_id);
+    if (plane != NULL)
+        return plane;
+
+    plane = malloc(sizeof(airplane));
+    if (plane == NULL) {
+        perror("airport_restore");
+        exit(1);
+    }
+    airplane_init(plane, NULL, NULL);
+    if (airport_register(ap, plane, plane_id, category) == 0) {
+        airplane_free(plane);
+        return airplanelist_find(&ap->planes, plane_id);
+    }
+    return plane;
+}
+
+/***************************************************************************
+ * airport_drop_detached removes every detached plane from airport "ap",
+ * for planes that never came back after a takeover. Returns how many
+ * planes were dropped.
+ */
+int airport_drop_detached(airport *ap) {
+    int count = 0;
+    airplane *plane;
+    while ((plane = airplanelist_take_detached(&ap->planes)) != NULL) {
+        queue_leave(&ap->queue, plane);
+        repl_log("U %s %s\n", ap->code, plane->id);
+        airplane_destroy(plane);
+        airplane_free(plane);
+        count++;
+    }
+    if (count > 0)
+        publish_changed(ap);
+    return count;
+}
+
+/***************************************************************************
+ * airport_leave takes a plane that is done out of its airport's queue and
+ * airplane list, then destroys and frees it. Planes that never registered
+ * don't belong to an airport, and are just destroyed.
+ */
+void airport_leave(airplane *plane) {
+    airport *ap = plane->airport;
+    if (ap == NULL) {
+        airplane_destroy(plane);
+        airplane_free(plane);
+        return;
+    }
+
+    // Leave the queue first, so the runway never clears a freed plane.
+    // The plane knows where it is in both, so neither has to be searched.
+    queue_leave(&ap->queue, plane);
+    repl_log("U %s %s\n", ap->code, plane->id);
+    airplanelist_remove(&ap->planes, plane);
+    publish_changed(ap);
+}
+
+/***************************************************************************
+ * airports_print prints every airport's planes and queue. Used for
+ * debugging the program.
+ */
+void airports_print() {
+    for (int i = 0; i < airports_count(); i++) {
+        airport *ap = airports_get(i);
+        printf("Airport %s\n", ap->code);
+        airplanelist_print(&ap->planes);
+        queue_print(&ap->queue);
+    }
+}
+
+/***************************************************************************
+ * airports_destroy frees all airports. Runway threads must not be running.
+ */
+void airports_destroy() {
+    alist_destroy(&airports);
+    pthread_rwlock_destroy(&airports_lock);
+}
@@ -0,0 +1,44 @@
+// Prototypes and types for the airport module
+
+#ifndef _AIRPORT_H
+#define _AIRPORT_H
+
+#include "airplane.h"
+#include "airplanelist.h"
+#include "queue.h"
+
+// Airports are identified by a short alphanumeric code (like KJFK). Planes
+// that don't give one at registration go to the default airport.
+
+#define AIRPORT_MINCODE 3
+#define AIRPORT_MAXCODE 4
+#define AIRPORT_DEFAULT "ZZZZ"
+#define AIRPORT_MAX 256
+
+// Everything that belongs to one airport: its registered planes, its taxi
+// queue and the runway thread that serves that queue. Airports never share
+// any of these, so they never contend with each other.
+
+typedef struct airport {
+    char code[AIRPORT_MAXCODE+1];
+    int index;              // Position in the list of airports
+    int cpu;                // Core the runway thread is pinned to (-1 = any)
+    airplanelist planes;
+    queue queue;
+} airport;
+
+void airports_init(int start_runways);
+int airport_valid_code(char *code);
+airport *airport_find(char *code);
+airport *airport_get(char *code);
+int airports_count();
+airport *airports_get(int index);
+void airports_start_runways();
+int airport_register(airport *ap, airplane *plane, char *plane_id, int category);
+airplane *airport_restore(airport *ap, char *plane_id, int category);
+int airport_drop_detached(airport *ap);
+void airport_leave(airplane *plane);
+void airports_print();
+void airports_destroy();
+
+#endif  // _AIRPORT_H
@@ -14,21 +14,99 @@
 #include "util.h"
 #include "airplane.h"
 #include "airs_protocol.h"
+#include "admit.h"
 #include "airplanelist.h"
+#include "airport.h"
 #include "queue.h"
+#include "binproto.h"
+#include "fleet.h"
+#include "logger.h"
+#include "observe.h"
+#include "shmring.h"
+#include "stats.h"
+#include "trace.h"
+#include "wake.h"
+
+/************************************************************************
+ * no_replies returns true if nothing can be sent to "plane": once an
+ * observer has been told "OK", its socket belongs to the observer fan-out
+ * thread, and a line sent from here could land in the middle of an event.
+ */
+static int no_replies(airplane *plane) {
+    return plane->state == PLANE_OBSERVER;
+}
 
 /************************************************************************
  * Call this response function if a command was accepted
  */
 void send_ok(airplane *plane) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        binproto_send(plane, BIN_OK, 0, NULL, 0);
+        return;
+    }
     fprintf(plane->fp_send, "OK\n");
 }
 
+/************************************************************************
+ * Call this response function to accept a command with a number (like a
+ * queue position) as the answer.
+ */
+void send_ok_int(airplane *plane, int value) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        unsigned char payload[4] = {value >> 24, value >> 16, value >> 8, value};
+        binproto_send(plane, BIN_OK, 0, payload, sizeof(payload));
+        return;
+    }
+    fprintf(plane->fp_send, "OK %d\n", value);
+}
+
+/************************************************************************
+ * Call this response function to accept a command with a list of "count"
+ * flight ids ("ids") as the answer.
+ */
+void send_ok_flights(airplane *plane, char (*ids)[PLANE_MAXID+1], int count) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        binproto_send_flights(plane, ids, count);
+        return;
+    }
+    fprintf(plane->fp_send, "OK ");
+    for (int i = 0; i < count; i++)
+        fprintf(plane->fp_send, (i < count - 1) ? "%s, " : "%s", ids[i]);
+    fprintf(plane->fp_send, "\n");
+}
+
+/************************************************************************
+ * Call this function to send a notice for the pilot.
+ */
+void send_notice(airplane *plane, char *text) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        binproto_send(plane, BIN_NOTICE, 0, text, strlen(text));
+        return;
+    }
+    fprintf(plane->fp_send, "NOTICE %s\n", text);
+}
+
 /************************************************************************
  * Call this response function if a first in the queue
  */
 void send_takeoff(airplane *plane) {
-    fprintf(plane->fp_send, "TAKEOFF\n");
+    if (airplane_detached(plane) || no_replies(plane)) {
+        return;  // A detached plane hears when it reconnects
+    }
+    TRACE_BEGIN(sending);
+    if (plane->bin != NULL)
+        binproto_send(plane, BIN_TAKEOFF, 0, NULL, 0);
+    else
+        fprintf(plane->fp_send, "TAKEOFF\n");
+    TRACE_END(sending, "send takeoff");
 }
 
 /************************************************************************
@@ -36,6 +114,12 @@ void send_takeoff(airplane *plane) {
  * string.
  */
 void send_err(airplane *plane, char *desc) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        binproto_send(plane, BIN_ERR, 0, desc, strlen(desc));
+        return;
+    }
     fprintf(plane->fp_send, "ERR %s\n", desc);
 }
 
@@ -44,6 +128,14 @@ void send_err(airplane *plane, char *desc) {
  * argument (sarg) into an error reply (which is now a format string).
  */
 void send_err_sarg(airplane *plane, char *fmtstring, char *sarg) {
+    if (no_replies(plane))
+        return;
+    if (plane->bin != NULL) {
+        char desc[strlen(fmtstring) + strlen(sarg) + 1];
+        sprintf(desc, fmtstring, sarg);
+        send_err(plane, desc);
+        return;
+    }
     fprintf(plane->fp_send, "ERR ");
     fprintf(plane->fp_send, fmtstring, sarg);
     fprintf(plane->fp_send, "\n");
@@ -63,13 +155,62 @@ static void cmd_reg(airplane *plane, char *rest) {
         return;
     }
 
-    int already_exist = airplane_exist(rest);
-    if (already_exist == 1) {
-        send_err(plane, "Duplicate flight id");
+    // The full form is "REG [airport] flightid [category]". With two words
+    // the second one is a category if it is a category letter, and
+    // otherwise the first one is the airport.
+    char *saveptr;
+    char *words[3];
+    int nwords = 0;
+    char *word = strtok_r(rest, " \t", &saveptr);
+    while ((word != NULL) && (nwords < 3)) {
+        words[nwords++] = word;
+        word = strtok_r(NULL, " \t", &saveptr);
+    }
+    if (word != NULL) {
+        send_err(plane, "REG has too many arguments");
+        return;
+    }
+
+    char *code = AIRPORT_DEFAULT;
+    char *catstr = NULL;
+    if (nwords == 3) {
+        code = words[0];
+        rest = words[1];
+        catstr = words[2];
+    } else if ((nwords == 2) && (wake_parse(words[1]) >= 0)) {
+        rest = words[0];
+        catstr = words[1];
+    } else if (nwords == 2) {
+        code = words[0];
+        rest = words[1];
+    } else {
+        rest = words[0];
+    }
+
+    register_flight(plane, code, rest, catstr);
+}
+
+/************************************************************************
+ * register_flight does the work of the "REG" command, once the airport
+ * "code", flight id "id" and wake category letter "catstr" (NULL for the
+ * default) have been picked out of it.
+ */
+void register_flight(airplane *plane, char *code, char *id, char *catstr) {
+    if (plane->state != PLANE_UNREG) {
+        send_err_sarg(plane, "Already registered as %s", plane->id);
         return;
     }
 
-    char *cp = rest;
+    int category = WAKE_DEFAULT;
+    if (catstr != NULL) {
+        category = wake_parse(catstr);
+        if (category < 0) {
+            send_err(plane, "Invalid wake category -- must be one of L, M, H or J");
+            return;
+        }
+    }
+
+    char *cp = id;
     while (*cp != '\0') {
         if (!isalnum(*cp)) {
             send_err(plane, "Invalid flight id -- only alphanumeric characters allowed");
@@ -78,14 +219,30 @@ static void cmd_reg(airplane *plane, char *rest) {
         cp++;
     }
     
-    if (strlen(rest) > PLANE_MAXID) {
+    if (strlen(id) > PLANE_MAXID) {
         send_err(plane, "Invalid flight id -- too long");
         return;
     }
 
-    plane->state = PLANE_ATTERMINAL;
-    strcpy(plane->id, rest);
+    airport *ap = airport_get(code);
+    if (ap == NULL) {
+        send_err_sarg(plane, "Invalid airport %s", code);
+        return;
+    }
+
+    int result = airport_register(ap, plane, id, category);
+    if (result == 0) {
+        send_err(plane, "Duplicate flight id");
+        return;
+    }
+
     send_ok(plane);
+
+    // A plane coming back after a server takeover carries on where it was,
+    // and if it had been cleared it needs to hear that again
+    if ((result == 2) && (plane->state == PLANE_CLEAR)) {
+        send_takeoff(plane);
+    }
 }
 
 /************************************************************************
@@ -97,9 +254,15 @@ static void cmd_reqtaxi(airplane *plane, char *rest) {
         return;
     }
 
+    // A plane is only in the queue once, so asking again is an error
+    if (plane->state != PLANE_ATTERMINAL) {
+        send_err(plane, "REQTAXI can only be used when the plane is at the terminal");
+        return;
+    }
+
     plane->state = PLANE_TAXIING;
     send_ok(plane);
-    queue_reqtaxi(plane);
+    queue_reqtaxi(&plane->airport->queue, plane);
     
     //send_err(plane, "REQTAXI command not yet implemented");
 }
@@ -110,7 +273,7 @@ static void cmd_reqtaxi(airplane *plane, char *rest) {
 void takeoff(airplane *plane) {
     plane->state = PLANE_CLEAR;
     send_takeoff(plane);
-    printf("Clearing flight %s\n", plane->id);
+    LOG(LOG_INFO, "Clearing flight %s", plane->id);
 }
 
 /************************************************************************
@@ -127,9 +290,9 @@ void cmd_reqpos(airplane *plane, char *rest) {
         return;
     }
     
-    int position = queue_position(plane->id);
+    int position = queue_position(&plane->airport->queue, plane->id);
 
-    fprintf(plane->fp_send, "OK %d\n", (position + 1));
+    send_ok_int(plane, position + 1);
     //send_err(plane, "REQPOS command not yet implemented");
 }
 
@@ -147,10 +310,28 @@ static void cmd_reqahead(airplane *plane, char *rest) {
         return;
     }
 
-    queue_getahead(plane);
+    queue_getahead(&plane->airport->queue, plane);
     //send_err(plane, "REQTAXI command not yet implemented");
 }
 
+/************************************************************************
+ * Handle the "REQETA" command, which answers with how long (ms) until the
+ * plane is expected to be cleared for takeoff.
+ */
+static void cmd_reqeta(airplane *plane, char *rest) {
+    if (plane->state == PLANE_UNREG) {
+        send_err(plane, "Unregistered plane -- cannot process request");
+        return;
+    }
+
+    if (plane->state != PLANE_TAXIING) {
+        send_err(plane, "REQETA can only be used when the plane is taxiing");
+        return;
+    }
+
+    send_ok_int(plane, queue_eta(&plane->airport->queue, plane));
+}
+
 /************************************************************************
  * Handle the "INAIR" command.
  */
@@ -165,11 +346,95 @@ static void cmd_inair(airplane *plane, char *rest) {
         return;
     }
 
-    queue_inair(plane);
+    queue_inair(&plane->airport->queue, plane);
 
     //send_err(plane, "INAIR command not yet implemented");
 }
 
+/************************************************************************
+ * Handle the "OBSERVE" command, which turns a connection that hasn't
+ * registered into an observer of the events at one airport (or at all of
+ * them). From then on the server only sends it events, and ignores
+ * anything but "BYE".
+ */
+static void cmd_observe(airplane *plane, char *rest) {
+    if (plane->state != PLANE_UNREG) {
+        send_err(plane, "Only unregistered connections can observe");
+        return;
+    }
+    if (plane->shm != NULL) {
+        send_err(plane, "Not available on a shared-memory connection");
+        return;
+    }
+    if ((rest != NULL) && (strcmp(rest, "*") != 0) && (airport_find(rest) == NULL)) {
+        send_err_sarg(plane, "Unknown airport %s", rest);
+        return;
+    }
+
+    send_ok(plane);
+    fflush(plane->fp_send);
+    plane->state = PLANE_OBSERVER;
+    observe_add(plane, rest);
+}
+
+/************************************************************************
+ * Handle the "FLEET" command, which turns a connection that hasn't
+ * registered into a fleet connection, carrying any number of planes on
+ * channels (see fleet.c).
+ */
+static void cmd_fleet(airplane *plane, char *rest) {
+    if (plane->state != PLANE_UNREG) {
+        send_err(plane, "Only unregistered connections can become fleets");
+        return;
+    }
+    if (plane->shm != NULL) {
+        send_err(plane, "Not available on a shared-memory connection");
+        return;
+    }
+
+    send_ok(plane);
+    fflush(plane->fp_send);
+    fleet_start(plane);
+}
+
+/************************************************************************
+ * Handle the "BINARY" command, which switches a connection that hasn't
+ * registered to the binary protocol (see binproto.c). The "OK" is the last
+ * thing sent as text.
+ */
+static void cmd_binary(airplane *plane, char *rest) {
+    if ((plane->state != PLANE_UNREG) || (plane->bin != NULL)) {
+        send_err(plane, "Only unregistered connections can switch to binary");
+        return;
+    }
+
+    send_ok(plane);
+    fflush(plane->fp_send);
+    binproto_start(plane);
+}
+
+/************************************************************************
+ * Handle the "SHM" command, which switches a connection on the local
+ * socket that hasn't registered to a pair of shared-memory rings (see
+ * shmring.c). The "OK" is the last thing sent on the socket.
+ */
+static void cmd_shm(airplane *plane, char *rest) {
+    if ((plane->state != PLANE_UNREG) || (plane->bin != NULL) || (plane->shm != NULL)) {
+        send_err(plane, "Only unregistered text connections can switch to shared memory");
+        return;
+    }
+    if (shmring_start(plane) < 0)
+        send_err(plane, "Shared memory is only available on the local socket");
+}
+
+/************************************************************************
+ * Handle the "STATS" command, which any client can use (registered or
+ * not) to monitor the server.
+ */
+static void cmd_stats(airplane *plane, char *rest) {
+    stats_send(plane);
+}
+
 /************************************************************************
  * Handle the "BYE" command.
  */
@@ -182,6 +447,11 @@ static void cmd_bye(airplane *plane, char *rest) {
  * optionally arguments) passed in as "command".
  */
 void docommand(airplane *plane, char *command) {
+    if (plane->state == PLANE_FLEET) {  // Every line is for a channel
+        fleet_command(plane, command);
+        return;
+    }
+
     char *saveptr;
     char *cmd = strtok_r(command, " \t\r\n", &saveptr);
     if (cmd == NULL) {  // Empty line (no command) -- just ignore line
@@ -194,7 +464,13 @@ void docommand(airplane *plane, char *command) {
         args = trim(args);
     }
 
-    if (strcmp(cmd, "REG") == 0) {
+    if ((plane->state != PLANE_OBSERVER) && !admit_command(plane, admit_class(cmd))) {
+        return;  // Over its rate limit, and told so
+    }
+
+    if ((plane->state == PLANE_OBSERVER) && (strcmp(cmd, "BYE") != 0)) {
+        return;  // Observers only get events
+    } else if (strcmp(cmd, "REG") == 0) {
         cmd_reg(plane, args);
     } else if (strcmp(cmd, "REQTAXI") == 0) {
         cmd_reqtaxi(plane, args);
@@ -202,11 +478,42 @@ void docommand(airplane *plane, char *command) {
         cmd_reqpos(plane, args);
     } else if (strcmp(cmd, "REQAHEAD") == 0) {
         cmd_reqahead(plane, args);
+    } else if (strcmp(cmd, "REQETA") == 0) {
+        cmd_reqeta(plane, args);
     } else if (strcmp(cmd, "INAIR") == 0) {
         cmd_inair(plane, args);
+    } else if (strcmp(cmd, "FLEET") == 0) {
+        cmd_fleet(plane, args);
+    } else if (strcmp(cmd, "OBSERVE") == 0) {
+        cmd_observe(plane, args);
+    } else if (strcmp(cmd, "BINARY") == 0) {
+        cmd_binary(plane, args);
+    } else if (strcmp(cmd, "SHM") == 0) {
+        cmd_shm(plane, args);
+    } else if (strcmp(cmd, "STATS") == 0) {
+        cmd_stats(plane, args);
     } else if (strcmp(cmd, "BYE") == 0) {
         cmd_bye(plane, args);
     } else {
         send_err(plane, "Unknown command");
     }
-}
\ No newline at end of file
+}
+
+/************************************************************************
+ * Performs command "code" (one of the BIN_* request codes, except REG,
+ * which has arguments) for a connection using the binary protocol. The
+ * commands are the same as the ones docommand performs, and go through
+ * the same state changes.
+ */
+void docommand_code(airplane *plane, int code) {
+    switch (code) {
+    case BIN_REQTAXI: cmd_reqtaxi(plane, NULL); break;
+    case BIN_REQPOS: cmd_reqpos(plane, NULL); break;
+    case BIN_REQAHEAD: cmd_reqahead(plane, NULL); break;
+    case BIN_REQETA: cmd_reqeta(plane, NULL); break;
+    case BIN_INAIR: cmd_inair(plane, NULL); break;
+    case BIN_STATS: cmd_stats(plane, NULL); break;
+    case BIN_BYE: cmd_bye(plane, NULL); break;
+    default: send_err(plane, "Unknown command"); break;
+    }
+}
@@ -6,10 +6,15 @@
 #include "airplane.h"
 
 void send_ok(airplane *plane);
+void send_ok_int(airplane *plane, int value);
+void send_ok_flights(airplane *plane, char (*ids)[PLANE_MAXID+1], int count);
+void send_notice(airplane *plane, char *text);
 void send_takeoff(airplane *plane);
 void send_err(airplane *plane, char *desc);
 void send_err_sarg(airplane *plane, char *fmtstring, char *sarg);
 
+void register_flight(airplane *plane, char *code, char *id, char *catstr);
 void docommand(airplane *plane, char *command);
+void docommand_code(airplane *plane, int code);
 
 #endif  // _AIRS_COMMANDS_H
\ No newline at end of file
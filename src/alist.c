@@ -87,6 +87,24 @@ void alist_add(alist *a, void *val) {
     pthread_rwlock_unlock(&(a->lock));
 }
 
+/***************************************************************************
+ * alist_reserve makes room for at least "capacity" items, so that adding
+ * that many doesn't have to grow the array.
+ */
+void alist_reserve(alist *a, int capacity) {
+    pthread_rwlock_wrlock(&(a->lock));
+    if (capacity > a->capacity) {
+        void *newdata = realloc(a->data, capacity*sizeof(void *));
+        if (newdata == NULL) {
+            perror("alist_reserve");
+            exit(1);
+        }
+        a->capacity = capacity;
+        a->data = newdata;
+    }
+    pthread_rwlock_unlock(&(a->lock));
+}
+
 /***************************************************************************
  * alist_set sets the index "index" item to value "val". If the
  * index/position doesn't exist in the list, then nothing happens (the
@@ -23,6 +23,7 @@ int alist_is_empty(alist *a);
 int alist_size(alist *a);
 void *alist_get(alist *a, int index);
 void alist_add(alist *a, void *val);
+void alist_reserve(alist *a, int capacity);
 void alist_set(alist *a, int index, void *newval);
 void alist_remove(alist *a, int index);
 void alist_destroy(alist *a);
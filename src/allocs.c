@@ -0,0 +1,98 @@
+// Module for the allocation counter, a test hook that counts the heap
+// allocations made while requests are being handled (see allocs.h).
+
+// With ATC_ALLOCS defined, this defines malloc, calloc, realloc and the
+// aligned allocators itself, so they are used instead of the C library's
+// everywhere in the program (the C library calls them too, for its own
+// buffers). Each one counts the call if the calling thread is between
+// ALLOCS_BEGIN and ALLOCS_END, and passes it on to glibc's allocator.
+// Frees aren't counted: giving memory back doesn't fault in pages or take
+// the allocator's slow paths the way asking for it can. This doesn't mix
+// with the address sanitizer, which has its own malloc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "allocs.h"
+
+#ifdef ATC_ALLOCS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static __thread int counting;       // In a request
+static long long requests;          // Requests counted
+static long long request_allocs;    // Allocations made during them
+
+static void count() {
+    if (counting)
+        __atomic_add_fetch(&request_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    count();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    count();
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+#endif
+
+/************************************************************************
+ * allocs_begin starts counting the calling thread's allocations, as part
+ * of a request, and allocs_end stops.
+ */
+void allocs_begin() {
+#ifdef ATC_ALLOCS
+    __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+    counting = 1;
+#endif
+}
+
+void allocs_end() {
+#ifdef ATC_ALLOCS
+    counting = 0;
+#endif
+}
+
+/************************************************************************
+ * allocs_stats writes the allocation counts (for the STATS command) as
+ * " name=value" pairs, if the counter is compiled in.
+ */
+void allocs_stats(FILE *out) {
+#ifdef ATC_ALLOCS
+    fprintf(out, " requests=%lld request_allocs=%lld",
+            __atomic_load_n(&requests, __ATOMIC_RELAXED),
+            __atomic_load_n(&request_allocs, __ATOMIC_RELAXED));
+#endif
+}
@@ -0,0 +1,31 @@
+// Prototypes and macros for the allocation counter
+
+#ifndef _ALLOCS_H
+#define _ALLOCS_H
+
+#include <stdio.h>
+
+// The allocation counter is a test hook, only compiled in with ATC_ALLOCS
+// defined ("make ALLOCS=1"). It replaces malloc and friends with versions
+// that count the calls a thread makes between ALLOCS_BEGIN() and
+// ALLOCS_END(), which bracket the handling of a command and a runway
+// clearance, so STATS can show whether the request path touches the heap.
+// Without ATC_ALLOCS the macros compile to nothing.
+
+#ifdef ATC_ALLOCS
+
+#define ALLOCS_BEGIN() allocs_begin()
+#define ALLOCS_END() allocs_end()
+
+#else
+
+#define ALLOCS_BEGIN()
+#define ALLOCS_END()
+
+#endif
+
+void allocs_begin();
+void allocs_end();
+void allocs_stats(FILE *out);
+
+#endif  // _ALLOCS_H
@@ -0,0 +1,1133 @@
+// Program to measure how the server scales, for "make perf".
+
+// For every combination of connection count (-c), queue depth (-q) and
+// command mix (-m), this starts a fresh server (the program given as the
+// last argument) on a loopback port, connects that many planes to it,
+// registers them and has them all request to taxi, and then keeps each
+// one busy sending commands for a while (-d), with one command at a time
+// on each connection (and, with -z, a pause between them). It records the
+// commands per second, the percentiles of the time each took to be
+// answered, and from /proc the server's CPU time, context switches,
+// thread count and memory (RSS) over that time, and writes one row per
+// run to prefix.csv as it goes and them all to prefix.json at the end.
+//
+// The planes are spread over as many airports as it takes to give each
+// taxi queue the depth asked for (up to AIRPORT_MAX airports; beyond that
+// the queues get deeper, and the report gives the depth they really had).
+// Depths that come out the same for a connection count are only run once.
+// The runways keep clearing planes meanwhile: a plane told TAKEOFF flies
+// (INAIR), reconnects as a new flight and taxis again at the back of the
+// queue, so the depth stays the same. That isn't counted as a command.
+//
+// A mix is a name or a list of weights like "pos=4+eta=4+ahead=2", out of
+// the commands REQPOS (pos), REQAHEAD (ahead), REQETA (eta), STATS (stats)
+// and churn, which is a plane leaving (BYE) and a new one connecting,
+// registering and taxiing in its place, timed from the BYE to the reply
+// to REQTAXI. The named mixes are in "mixes" below.
+//
+// With -b, every run is done against a second build of the server as
+// well, one straight after the other, and the two are compared at the
+// end. "-C old.csv new.csv" compares two reports written earlier.
+//
+// The server is sent nothing but the commands, so its other options
+// (from -a) decide how it runs: "-a '-l warn -P 60000'" for example.
+// Its output goes to prefix-server.log.
+//
+// Usage: atc_perf [-c conns,...] [-q depths,...] [-m mixes,...] [-d secs]
+//                 [-w warmup_secs] [-z think_ms] [-j threads] [-p port]
+//                 [-a server_args] [-b base_server] [-o prefix] server
+//        atc_perf -C old.csv new.csv
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "airport.h"
+
+// How many connections each run sets up at once (all of them if there is
+// room in the server's listen backlog), how long the server gets to start
+// listening, and how long the connections get to be set up (plus 1 ms a
+// connection)
+
+#define PERF_CONNECTING 128
+#define PERF_STARTUP_MS 5000
+#define PERF_SETUP_MS 30000
+
+// Connections come from this many loopback addresses (127.0.0.1 and up),
+// so that there are enough ports to go round
+
+#define PERF_SOURCES 64
+
+// The commands a connection can be sent (the first PERF_NCMDS make up the
+// mixes), and the steps of flying and of getting going
+
+#define CMD_POS 0
+#define CMD_AHEAD 1
+#define CMD_ETA 2
+#define CMD_STATS 3
+#define CMD_CHURN 4
+#define PERF_NCMDS 5
+#define CMD_SETUP 5      // Registering and taxiing, the first time
+#define CMD_INAIR 6      // Flying after a TAKEOFF
+#define CMD_RETAXI 7     // Registering and taxiing after flying
+
+static char *cmd_names[PERF_NCMDS] = {"pos", "ahead", "eta", "stats", "churn"};
+static char *cmd_lines[PERF_NCMDS] = {"REQPOS\n", "REQAHEAD\n", "REQETA\n", "STATS\n", "BYE\n"};
+
+// The named mixes
+
+static struct {
+    char *name;
+    char *weights;
+} mixes[] = {
+    {"pos", "pos=1"},
+    {"ahead", "ahead=1"},
+    {"eta", "eta=1"},
+    {"read", "pos=4+eta=4+ahead=2"},
+    {"churn", "pos=1+churn=1"},
+    {"stats", "stats=1"},
+};
+
+// Where a connection is
+
+#define CONN_CONNECTING 0  // Waiting for the connection to be made
+#define CONN_WAITING 1     // Waiting for replies
+#define CONN_READY 2       // Set up, and waiting for the runs to start
+#define CONN_THINKING 3    // Waiting to send its next command
+#define CONN_FAILED 4
+
+// The phases of a run
+
+#define PHASE_SETUP 0
+#define PHASE_LOAD 1       // Sending commands, but not counting them yet
+#define PHASE_MEASURE 2
+#define PHASE_STOP 3       // Not sending any more
+#define PHASE_DONE 4
+
+// A connection, which is always the same plane as far as the run is
+// concerned, under a new flight id every time it reconnects
+
+typedef struct perf_conn {
+    int fd;
+    int index;                  // Which plane it is, overall
+    int gen;                    // How many times it has reconnected
+    int state;
+    int cmd;                    // What it is waiting on
+    int replies;                // Replies still to come
+    int cleared;                // Told TAKEOFF, and hasn't flown yet
+    int setup_done;
+    long long sent_us;          // When its command was sent
+    long long due_us;           // When it is due to send the next one
+    char head[8];               // The start of the line being read
+    int headlen;
+    struct perf_conn *next;     // Next thinking connection
+} perf_conn;
+
+// A thread driving some of the connections, and what it measured
+
+typedef struct perf_worker {
+    pthread_t tid;
+    int epfd;
+    perf_conn *conns;
+    int nconns;
+    int next_setup;             // Next connection to set up
+    int connecting;             // Connections being set up
+    int max_connecting;
+    perf_conn *think_head;      // Thinking connections, in the order due
+    perf_conn *think_tail;
+    unsigned int seed;
+    long long *lat_us;          // How long each measured command took
+    long nlat, lat_size;
+    long ready;                 // Connections set up
+    long failed;                // Connections that failed
+    long errors;                // ERR replies while measuring
+    long takeoffs;              // Planes that flew while measuring
+} perf_worker;
+
+// What the server's /proc entries said at some point
+
+typedef struct proc_sample {
+    long long cpu_ms;
+    long long csw_voluntary;
+    long long csw_involuntary;
+    long rss_kb;
+    long peak_rss_kb;
+    int threads;
+} proc_sample;
+
+// How a run went, which is a row of the report
+
+typedef struct perf_run {
+    char build[16];
+    int conns, connected, airports, depth;
+    char mix[64];
+    int think_ms;
+    double secs;
+    long ops;
+    double ops_per_sec;
+    long long p50_us, p90_us, p99_us, p999_us, max_us;
+    long errors, takeoffs, failed;
+    int threads;
+    long rss_kb, peak_rss_kb;
+    long long cpu_ms, csw_voluntary, csw_involuntary;
+} perf_run;
+
+#define PERF_CSV_HEADER "build,conns,connected,airports,depth,mix,think_ms,secs,ops,ops_per_sec," \
+                        "p50_us,p90_us,p99_us,p999_us,max_us,errors,takeoffs,failed,threads," \
+                        "rss_kb,peak_rss_kb,cpu_ms,csw_voluntary,csw_involuntary"
+
+static int port = 18100;        // The next run's port
+static int nairports;           // The current run's airports
+static int weights[PERF_NCMDS]; // The current run's mix
+static int total_weight;
+static long long think_us;
+static int phase;
+
+/************************************************************************
+ * now_us returns the time in microseconds.
+ */
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/************************************************************************
+ * sleep_ms sleeps for "ms" milliseconds.
+ */
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) < 0)
+        ;
+}
+
+/************************************************************************
+ * get_phase and set_phase read and change the phase of the run.
+ */
+static int get_phase() {
+    return __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+}
+
+static void set_phase(int p) {
+    __atomic_store_n(&phase, p, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * parse_mix sets the weights of the current run from "mix", which is a
+ * name from "mixes" or a list of weights. Returns 0, or -1 if it isn't
+ * valid.
+ */
+static int parse_mix(char *mix) {
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        if (strcmp(mix, mixes[i].name) == 0) {
+            mix = mixes[i].weights;
+            break;
+        }
+    }
+
+    memset(weights, 0, sizeof(weights));
+    total_weight = 0;
+    char *s = mix;
+    while (*s != '\0') {
+        size_t len = strcspn(s, "=");
+        int c;
+        for (c = 0; c < PERF_NCMDS; c++) {
+            if ((strlen(cmd_names[c]) == len) && (strncmp(s, cmd_names[c], len) == 0))
+                break;
+        }
+        if ((c == PERF_NCMDS) || (s[len] != '='))
+            return -1;
+        char *end;
+        long w = strtol(s + len + 1, &end, 10);
+        if ((w < 0) || ((*end != '\0') && (*end != '+')))
+            return -1;
+        weights[c] = w;
+        total_weight += w;
+        s = (*end == '+') ? end + 1 : end;
+    }
+    return (total_weight > 0) ? 0 : -1;
+}
+
+/************************************************************************
+ * pick_cmd picks the next command for a connection of worker "w", by the
+ * weights of the mix.
+ */
+static int pick_cmd(perf_worker *w) {
+    int r = rand_r(&w->seed) % total_weight;
+    int c = 0;
+    while (r >= weights[c])
+        r -= weights[c++];
+    return c;
+}
+
+/************************************************************************
+ * record notes that connection "c" of worker "w" finished its command at
+ * time "now", if it counts and the run is being measured.
+ */
+static void record(perf_worker *w, perf_conn *c, long long now) {
+    if ((c->cmd >= PERF_NCMDS) || (get_phase() != PHASE_MEASURE))
+        return;
+    if (w->nlat == w->lat_size) {
+        w->lat_size = (w->lat_size == 0) ? 65536 : 2 * w->lat_size;
+        if ((w->lat_us = realloc(w->lat_us, w->lat_size * sizeof(long long))) == NULL) {
+            perror("record");
+            exit(1);
+        }
+    }
+    w->lat_us[w->nlat++] = now - c->sent_us;
+}
+
+/************************************************************************
+ * conn_fail closes connection "c" of worker "w", which has gone wrong.
+ */
+static void conn_fail(perf_worker *w, perf_conn *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->state = CONN_FAILED;
+    w->failed++;
+    if (!c->setup_done)
+        w->connecting--;
+}
+
+/************************************************************************
+ * conn_connect starts connecting "c" (of worker "w") to the server, as a
+ * new flight.
+ */
+static void conn_connect(perf_worker *w, perf_conn *c) {
+    c->state = CONN_CONNECTING;
+    c->cleared = 0;
+    c->headlen = 0;
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        conn_fail(w, c);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + c->index % PERF_SOURCES);
+    if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        conn_fail(w, c);
+        return;
+    }
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) && (errno != EINPROGRESS)) {
+        conn_fail(w, c);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        conn_fail(w, c);
+}
+
+/************************************************************************
+ * conn_send sends "len" bytes of "data" on "c" (of worker "w"), which
+ * will answer with "replies" replies. Returns 0, or -1 if it failed.
+ */
+static int conn_send(perf_worker *w, perf_conn *c, char *data, int len, int replies) {
+    c->state = CONN_WAITING;
+    c->replies = replies;
+    if (write(c->fd, data, len) != len) {
+        conn_fail(w, c);
+        return -1;
+    }
+    return 0;
+}
+
+/************************************************************************
+ * conn_connected registers the flight of "c" (of worker "w"), whose
+ * connection has been made, and asks to taxi.
+ */
+static void conn_connected(perf_worker *w, perf_conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if ((getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0) ||
+        (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)) {
+        conn_fail(w, c);
+        return;
+    }
+    char line[64];
+    int n = snprintf(line, sizeof(line), "REG P%03d f%dg%d\nREQTAXI\n",
+                     c->index % nairports, c->index, c->gen++);
+    conn_send(w, c, line, n, 2);
+}
+
+/************************************************************************
+ * think_push puts "c" (of worker "w") at the back of the thinking
+ * connections, due "think_us" from "now".
+ */
+static void think_push(perf_worker *w, perf_conn *c, long long now) {
+    c->state = CONN_THINKING;
+    c->due_us = now + think_us;
+    c->next = NULL;
+    if (w->think_tail != NULL)
+        w->think_tail->next = c;
+    else
+        w->think_head = c;
+    w->think_tail = c;
+}
+
+/************************************************************************
+ * conn_start sends connection "c" (of worker "w") its next command, or
+ * has it fly if it has been cleared for takeoff.
+ */
+static void conn_start(perf_worker *w, perf_conn *c) {
+    c->sent_us = now_us();
+    if (c->cleared) {
+        c->cmd = CMD_INAIR;
+        conn_send(w, c, "INAIR\n", 6, 1);
+        return;
+    }
+    c->cmd = pick_cmd(w);
+    char *line = cmd_lines[c->cmd];
+    if (c->cmd == CMD_CHURN) {
+        // The server closes the connection on BYE, and a new one starts
+        if (write(c->fd, line, strlen(line)) < 0) {
+            conn_fail(w, c);
+            return;
+        }
+        close(c->fd);
+        conn_connect(w, c);
+        return;
+    }
+    conn_send(w, c, line, strlen(line), 1);
+}
+
+/************************************************************************
+ * conn_done moves "c" (of worker "w") on once it has had every reply to
+ * what it sent, at time "now".
+ */
+static void conn_done(perf_worker *w, perf_conn *c, long long now) {
+    int p = get_phase();
+    record(w, c, now);
+    if (c->cmd == CMD_INAIR) {
+        // The plane has gone, and a new one taxis in its place
+        if (p == PHASE_MEASURE)
+            w->takeoffs++;
+        close(c->fd);
+        c->cmd = CMD_RETAXI;
+        conn_connect(w, c);
+        return;
+    }
+    if (!c->setup_done) {
+        c->setup_done = 1;
+        w->connecting--;
+        __atomic_add_fetch(&w->ready, 1, __ATOMIC_RELAXED);
+    }
+    if (c->cleared && (p < PHASE_STOP))
+        conn_start(w, c);
+    else if (p == PHASE_SETUP)
+        c->state = CONN_READY;
+    else
+        think_push(w, c, now);
+}
+
+/************************************************************************
+ * conn_line handles a line (starting with the "len" bytes at "head")
+ * that "c" (of worker "w") has been sent.
+ */
+static void conn_line(perf_worker *w, perf_conn *c, char *head, int len) {
+    if ((len >= 7) && (strncmp(head, "TAKEOFF", 7) == 0)) {
+        c->cleared = 1;
+        if (c->state == CONN_READY)
+            conn_start(w, c);  // Waiting for the runs to start, it can't wait to fly
+        return;
+    }
+    int ok = (len >= 2) && (strncmp(head, "OK", 2) == 0);
+    int err = (len >= 3) && (strncmp(head, "ERR", 3) == 0);
+    if ((!ok && !err) || (c->state != CONN_WAITING))
+        return;  // Not a reply
+    if (err && !c->cleared && (get_phase() == PHASE_MEASURE))
+        w->errors++;  // (A command that crossed with a TAKEOFF isn't one)
+    if (--c->replies == 0)
+        conn_done(w, c, now_us());
+}
+
+/************************************************************************
+ * conn_read reads what the server has sent "c" (of worker "w"), looking
+ * at the start of every line.
+ */
+static void conn_read(perf_worker *w, perf_conn *c) {
+    static __thread char buf[65536];
+    while (c->fd >= 0) {
+        ssize_t got = read(c->fd, buf, sizeof(buf));
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                conn_fail(w, c);
+            return;
+        }
+        if (got == 0) {
+            conn_fail(w, c);
+            return;
+        }
+        char *s = buf;
+        char *end = buf + got;
+        while ((s < end) && (c->fd >= 0)) {
+            char *nl = memchr(s, '\n', end - s);
+            char *stop = (nl != NULL) ? nl : end;
+            while ((c->headlen < (int)sizeof(c->head)) && (s < stop))
+                c->head[c->headlen++] = *s++;
+            if (nl == NULL)
+                break;
+            int len = c->headlen;
+            c->headlen = 0;
+            s = nl + 1;
+            conn_line(w, c, c->head, len);
+        }
+    }
+}
+
+/************************************************************************
+ * worker_run is the thread that drives the connections of worker "arg".
+ */
+static void *worker_run(void *arg) {
+    perf_worker *w = arg;
+    struct epoll_event events[256];
+    int started = 0;
+
+    while (1) {
+        int p = get_phase();
+        if (p == PHASE_DONE)
+            break;
+        while ((w->next_setup < w->nconns) && (w->connecting < w->max_connecting)) {
+            w->connecting++;
+            conn_connect(w, &w->conns[w->next_setup++]);
+        }
+        if ((p >= PHASE_LOAD) && !started) {
+            long long now = now_us();
+            for (int i = 0; i < w->nconns; i++) {
+                if (w->conns[i].state == CONN_READY)
+                    think_push(w, &w->conns[i], now);
+            }
+            started = 1;
+        }
+
+        int timeout = 10;
+        if ((p >= PHASE_LOAD) && (p < PHASE_STOP) && (w->think_head != NULL)) {
+            long long wait = w->think_head->due_us - now_us();
+            timeout = (wait <= 0) ? 0 : (wait + 999) / 1000;
+            if (timeout > 10)
+                timeout = 10;
+        }
+        int n = epoll_wait(w->epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            // (An event can be for a socket the connection has just
+            // closed, to reconnect)
+            perf_conn *c = events[i].data.ptr;
+            if (c->state == CONN_CONNECTING) {
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    conn_connected(w, c);
+            } else if (c->state != CONN_FAILED) {
+                conn_read(w, c);
+            }
+        }
+
+        if ((p >= PHASE_LOAD) && (p < PHASE_STOP)) {
+            long long now = now_us();
+            while ((w->think_head != NULL) && (w->think_head->due_us <= now)) {
+                perf_conn *c = w->think_head;
+                if ((w->think_head = c->next) == NULL)
+                    w->think_tail = NULL;
+                if (c->state == CONN_THINKING)
+                    conn_start(w, c);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) {
+        if (w->conns[i].fd >= 0)
+            close(w->conns[i].fd);
+    }
+    close(w->epfd);
+    return NULL;
+}
+
+/************************************************************************
+ * sample_proc reads the CPU time, context switches (of every thread),
+ * thread count and memory of process "pid" into "s".
+ */
+static void sample_proc(pid_t pid, proc_sample *s) {
+    char path[64];
+    char line[512];
+    memset(s, 0, sizeof(*s));
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        if (fgets(line, sizeof(line), fp) != NULL) {
+            char *s_after = strrchr(line, ')');
+            unsigned long utime, stime;
+            long threads;
+            if ((s_after != NULL) &&
+                (sscanf(s_after + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                        "%*d %*d %*d %*d %ld", &utime, &stime, &threads) == 3)) {
+                s->cpu_ms = (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+                s->threads = threads;
+            }
+        }
+        fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            sscanf(line, "VmRSS: %ld", &s->rss_kb);
+            sscanf(line, "VmHWM: %ld", &s->peak_rss_kb);
+        }
+        fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char task[512];
+        snprintf(task, sizeof(task), "%s/%s/status", path, ent->d_name);
+        if ((fp = fopen(task, "r")) == NULL)
+            continue;  // It has just gone
+        long long n;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "voluntary_ctxt_switches: %lld", &n) == 1)
+                s->csw_voluntary += n;
+            else if (sscanf(line, "nonvoluntary_ctxt_switches: %lld", &n) == 1)
+                s->csw_involuntary += n;
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+}
+
+/************************************************************************
+ * start_server starts the server program "server", with "args" (split at
+ * spaces) after its port option, and its output going to "log". Waits
+ * until it is listening. Returns its process id, or -1 if it didn't
+ * start.
+ */
+static pid_t start_server(char *server, char *args, FILE *log) {
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    char *copy = strdup(args);
+    char *argv[64] = {server, "-p", portstr};
+    int argc = 3;
+    for (char *arg = strtok(copy, " "); (arg != NULL) && (argc < 63); arg = strtok(NULL, " "))
+        argv[argc++] = arg;
+    argv[argc] = NULL;
+
+    fflush(log);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(fileno(log), 1);
+        dup2(fileno(log), 2);
+        execv(server, argv);
+        perror(server);
+        _exit(127);
+    }
+    free(copy);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    long long give_up = now_us() + PERF_STARTUP_MS * 1000LL;
+    while (now_us() < give_up) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ok = (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        close(fd);
+        if (ok)
+            return pid;
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/************************************************************************
+ * compare_ll is the qsort comparison for times.
+ */
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/************************************************************************
+ * run_point does one run against "server" (started with "args", and
+ * called "build" in the report), with "conns" connections spread over
+ * "airports" airports, driven by "nworkers" threads, and fills in "run"
+ * (whose mix and think time are already set). Returns 0, or -1 if the
+ * server didn't start.
+ */
+static int run_point(char *server, char *args, char *build, int conns, int airports,
+                     int nworkers, int warmup_secs, int secs, FILE *log, perf_run *run) {
+    port++;
+    nairports = airports;
+    set_phase(PHASE_SETUP);
+    fprintf(log, "=== %s: %d connections, %d airports, mix %s\n", build, conns, airports, run->mix);
+    pid_t pid = start_server(server, args, log);
+    if (pid < 0) {
+        fprintf(stderr, "%s didn't start (see the server log)\n", server);
+        return -1;
+    }
+
+    perf_worker *workers = calloc(nworkers, sizeof(perf_worker));
+    perf_conn *all = calloc(conns, sizeof(perf_conn));
+    if ((workers == NULL) || (all == NULL)) {
+        perror("run_point");
+        exit(1);
+    }
+    for (int i = 0; i < conns; i++) {
+        all[i].fd = -1;
+        all[i].index = i;
+        all[i].cmd = CMD_SETUP;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        perf_worker *w = &workers[i];
+        int first = (long)conns * i / nworkers;
+        w->conns = all + first;
+        w->nconns = (long)conns * (i + 1) / nworkers - first;
+        w->max_connecting = (PERF_CONNECTING + nworkers - 1) / nworkers;
+        w->seed = i + 1;
+        if ((w->epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        pthread_create(&w->tid, NULL, worker_run, w);
+    }
+
+    // Wait for every connection to be set up (or to fail)
+    long long give_up = now_us() + (PERF_SETUP_MS + conns) * 1000LL;
+    long ready = 0, failed = 0;
+    int died = 0;
+    while (now_us() < give_up) {
+        ready = failed = 0;
+        for (int i = 0; i < nworkers; i++) {
+            ready += __atomic_load_n(&workers[i].ready, __ATOMIC_RELAXED);
+            failed += __atomic_load_n(&workers[i].failed, __ATOMIC_RELAXED);
+        }
+        if ((died = (waitpid(pid, NULL, WNOHANG) == pid)) || (ready + failed >= conns))
+            break;
+        sleep_ms(10);
+    }
+
+    set_phase(PHASE_LOAD);
+    sleep_ms(warmup_secs * 1000L);
+    proc_sample before, after;
+    sample_proc(pid, &before);
+    long long start = now_us();
+    set_phase(PHASE_MEASURE);
+    sleep_ms(secs * 1000L);
+    set_phase(PHASE_STOP);
+    long long took = now_us() - start;
+    sample_proc(pid, &after);
+    set_phase(PHASE_DONE);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    // The connections are closed from this end first, so the server's
+    // port isn't left waiting
+    sleep_ms(100);
+    if (died || (waitpid(pid, NULL, WNOHANG) == pid))
+        fprintf(stderr, "warning: the server exited during the run (see the server log)\n");
+    else if (kill(pid, SIGTERM) == 0)
+        waitpid(pid, NULL, 0);
+
+    long nlat = 0;
+    for (int i = 0; i < nworkers; i++)
+        nlat += workers[i].nlat;
+    long long *lat = malloc((nlat + 1) * sizeof(long long));
+    if (lat == NULL) {
+        perror("run_point");
+        exit(1);
+    }
+    nlat = 0;
+    snprintf(run->build, sizeof(run->build), "%s", build);
+    run->conns = conns;
+    run->connected = ready;
+    run->airports = airports;
+    run->depth = (conns + airports - 1) / airports;
+    run->errors = run->takeoffs = run->failed = 0;
+    for (int i = 0; i < nworkers; i++) {
+        perf_worker *w = &workers[i];
+        memcpy(lat + nlat, w->lat_us, w->nlat * sizeof(long long));
+        nlat += w->nlat;
+        run->errors += w->errors;
+        run->takeoffs += w->takeoffs;
+        run->failed += w->failed;
+        free(w->lat_us);
+    }
+    qsort(lat, nlat, sizeof(long long), compare_ll);
+    run->secs = took / 1e6;
+    run->ops = nlat;
+    run->ops_per_sec = nlat / run->secs;
+    run->p50_us = (nlat > 0) ? lat[(long)(0.5 * (nlat - 1))] : 0;
+    run->p90_us = (nlat > 0) ? lat[(long)(0.9 * (nlat - 1))] : 0;
+    run->p99_us = (nlat > 0) ? lat[(long)(0.99 * (nlat - 1))] : 0;
+    run->p999_us = (nlat > 0) ? lat[(long)(0.999 * (nlat - 1))] : 0;
+    run->max_us = (nlat > 0) ? lat[nlat - 1] : 0;
+    run->threads = after.threads;
+    run->rss_kb = after.rss_kb;
+    run->peak_rss_kb = after.peak_rss_kb;
+    run->cpu_ms = after.cpu_ms - before.cpu_ms;
+    run->csw_voluntary = after.csw_voluntary - before.csw_voluntary;
+    run->csw_involuntary = after.csw_involuntary - before.csw_involuntary;
+
+    free(lat);
+    free(all);
+    free(workers);
+    return 0;
+}
+
+/************************************************************************
+ * write_csv_row writes "run" as a row of the CSV report "out".
+ */
+static void write_csv_row(FILE *out, perf_run *run) {
+    fprintf(out, "%s,%d,%d,%d,%d,%s,%d,%.3f,%ld,%.0f,%lld,%lld,%lld,%lld,%lld,%ld,%ld,%ld,%d,%ld,%ld,%lld,%lld,%lld\n",
+            run->build, run->conns, run->connected, run->airports, run->depth, run->mix,
+            run->think_ms, run->secs, run->ops, run->ops_per_sec, run->p50_us, run->p90_us,
+            run->p99_us, run->p999_us, run->max_us, run->errors, run->takeoffs, run->failed,
+            run->threads, run->rss_kb, run->peak_rss_kb, run->cpu_ms, run->csw_voluntary,
+            run->csw_involuntary);
+    fflush(out);
+}
+
+/************************************************************************
+ * write_json writes the "n" runs in "runs" to the JSON report at "path".
+ */
+static void write_json(char *path, perf_run *runs, int n) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(out, "{\"cpus\": %ld, \"runs\": [", sysconf(_SC_NPROCESSORS_ONLN));
+    for (int i = 0; i < n; i++) {
+        perf_run *r = &runs[i];
+        fprintf(out, "%s\n  {\"build\": \"%s\", \"conns\": %d, \"connected\": %d, \"airports\": %d, "
+                "\"depth\": %d, \"mix\": \"%s\", \"think_ms\": %d, \"secs\": %.3f, \"ops\": %ld, "
+                "\"ops_per_sec\": %.0f, \"p50_us\": %lld, \"p90_us\": %lld, \"p99_us\": %lld, "
+                "\"p999_us\": %lld, \"max_us\": %lld, \"errors\": %ld, \"takeoffs\": %ld, "
+                "\"failed\": %ld, \"threads\": %d, \"rss_kb\": %ld, \"peak_rss_kb\": %ld, "
+                "\"cpu_ms\": %lld, \"csw_voluntary\": %lld, \"csw_involuntary\": %lld}",
+                (i > 0) ? "," : "", r->build, r->conns, r->connected, r->airports, r->depth,
+                r->mix, r->think_ms, r->secs, r->ops, r->ops_per_sec, r->p50_us, r->p90_us,
+                r->p99_us, r->p999_us, r->max_us, r->errors, r->takeoffs, r->failed, r->threads,
+                r->rss_kb, r->peak_rss_kb, r->cpu_ms, r->csw_voluntary, r->csw_involuntary);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
+
+/************************************************************************
+ * read_csv reads the runs from the CSV report at "path". Returns them,
+ * with their number in "*n".
+ */
+static perf_run *read_csv(char *path, int *n) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[1024];
+    if ((fgets(line, sizeof(line), fp) == NULL) || (strncmp(line, PERF_CSV_HEADER, strlen(PERF_CSV_HEADER)) != 0)) {
+        fprintf(stderr, "%s: not an atc_perf report\n", path);
+        exit(1);
+    }
+    int size = 64;
+    perf_run *runs = malloc(size * sizeof(perf_run));
+    *n = 0;
+    while ((runs != NULL) && (fgets(line, sizeof(line), fp) != NULL)) {
+        if (*n == size) {
+            size *= 2;
+            if ((runs = realloc(runs, size * sizeof(perf_run))) == NULL)
+                break;
+        }
+        perf_run *r = &runs[*n];
+        memset(r, 0, sizeof(*r));
+        char *build = strtok(line, ",");
+        char *rest = strtok(NULL, "");
+        if ((build == NULL) || (rest == NULL) ||
+            (sscanf(rest, "%d,%d,%d,%d,%63[^,],%d,%lf,%ld,%lf,%lld,%lld,%lld,%lld,%lld,%ld,%ld,%ld,%d,%ld,%ld,%lld,%lld,%lld",
+                    &r->conns, &r->connected, &r->airports, &r->depth, r->mix, &r->think_ms,
+                    &r->secs, &r->ops, &r->ops_per_sec, &r->p50_us, &r->p90_us, &r->p99_us,
+                    &r->p999_us, &r->max_us, &r->errors, &r->takeoffs, &r->failed, &r->threads,
+                    &r->rss_kb, &r->peak_rss_kb, &r->cpu_ms, &r->csw_voluntary,
+                    &r->csw_involuntary) != 23)) {
+            fprintf(stderr, "%s: bad row skipped\n", path);
+            continue;
+        }
+        snprintf(r->build, sizeof(r->build), "%s", build);
+        (*n)++;
+    }
+    if (runs == NULL) {
+        perror("read_csv");
+        exit(1);
+    }
+    fclose(fp);
+    return runs;
+}
+
+/************************************************************************
+ * change returns the change from "old" to "new" as a percentage.
+ */
+static double change(double old, double new) {
+    return (old == 0) ? 0 : 100 * (new - old) / old;
+}
+
+/************************************************************************
+ * compare prints the runs in "news" (there are "nnew") next to the runs
+ * in "olds" ("nold") with the same connections, airports, mix and think
+ * time.
+ */
+static void compare(perf_run *olds, int nold, perf_run *news, int nnew) {
+    printf("%6s %6s %-20s %19s %8s %17s %8s %15s %8s %17s\n", "conns", "depth", "mix",
+           "ops/s old/new", "change", "p99 us old/new", "change", "peak RSS MB", "change",
+           "csw/op old/new");
+    for (int i = 0; i < nnew; i++) {
+        perf_run *b = &news[i];
+        perf_run *a = NULL;
+        for (int j = 0; (j < nold) && (a == NULL); j++) {
+            perf_run *r = &olds[j];
+            if ((r->conns == b->conns) && (r->airports == b->airports) &&
+                (r->think_ms == b->think_ms) && (strcmp(r->mix, b->mix) == 0))
+                a = r;
+        }
+        if (a == NULL)
+            continue;
+        printf("%6d %6d %-20s %9.0f/%-9.0f %+7.1f%% %8lld/%-8lld %+7.1f%% %7.1f/%-7.1f %+7.1f%% %8.2f/%-8.2f\n",
+               b->conns, b->depth, b->mix, a->ops_per_sec, b->ops_per_sec,
+               change(a->ops_per_sec, b->ops_per_sec), a->p99_us, b->p99_us,
+               change(a->p99_us, b->p99_us), a->peak_rss_kb / 1024.0, b->peak_rss_kb / 1024.0,
+               change(a->peak_rss_kb, b->peak_rss_kb),
+               (a->ops > 0) ? (double)(a->csw_voluntary + a->csw_involuntary) / a->ops : 0,
+               (b->ops > 0) ? (double)(b->csw_voluntary + b->csw_involuntary) / b->ops : 0);
+    }
+}
+
+/************************************************************************
+ * parse_list reads the comma-separated numbers in "spec" into "list"
+ * (which has room for "max"). Returns how many there were, or -1 if they
+ * aren't valid.
+ */
+static int parse_list(char *spec, int *list, int max) {
+    int n = 0;
+    char *end = spec;
+    while (*end != '\0') {
+        long v = strtol(spec, &end, 10);
+        if ((end == spec) || (v <= 0) || (n == max) || ((*end != ',') && (*end != '\0')))
+            return -1;
+        list[n++] = v;
+        spec = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-c conns,...] [-q depths,...] [-m mixes,...] [-d secs]\n"
+            "       [-w warmup_secs] [-z think_ms] [-j threads] [-p port]\n"
+            "       [-a server_args] [-b base_server] [-o prefix] server\n"
+            "       %s -C old.csv new.csv\n", progname, progname);
+    fprintf(stderr, "  -c conns   connection counts to run with (default 10,100,1000,10000,50000)\n");
+    fprintf(stderr, "  -q depths  taxi queue depths to run with (default 16,256,4096)\n");
+    fprintf(stderr, "  -m mixes   command mixes: pos, ahead, eta, read, churn, stats, or\n");
+    fprintf(stderr, "             weights like pos=4+eta=4+ahead=2 (default pos,read,churn)\n");
+    fprintf(stderr, "  -d secs    how long each run is measured (default 5), after\n");
+    fprintf(stderr, "  -w secs    a warmup (default 1)\n");
+    fprintf(stderr, "  -z ms      how long each connection waits between commands (default 0)\n");
+    fprintf(stderr, "  -j threads how many threads drive the connections (default 2)\n");
+    fprintf(stderr, "  -p port    the first port to run servers on (one after another)\n");
+    fprintf(stderr, "  -a args    options for the server (default \"-l warn\")\n");
+    fprintf(stderr, "  -b server  run every point against this build as well, and compare\n");
+    fprintf(stderr, "  -o prefix  write prefix.csv, prefix.json and prefix-server.log\n");
+    fprintf(stderr, "             (default perf)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int conn_counts[32] = {10, 100, 1000, 10000, 50000};
+    int nconn_counts = 5;
+    int depths[32] = {16, 256, 4096};
+    int ndepths = 3;
+    char *mix_list = "pos,read,churn";
+    int secs = 5, warmup_secs = 1, think_ms = 0, nworkers = 2;
+    char *server_args = "-l warn";
+    char *base = NULL;
+    char *prefix = "perf";
+    int comparing = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:q:m:d:w:z:j:p:a:b:o:C")) != -1) {
+        switch (opt) {
+        case 'c':
+            if ((nconn_counts = parse_list(optarg, conn_counts, 32)) < 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((ndepths = parse_list(optarg, depths, 32)) < 0)
+                usage(argv[0]);
+            break;
+        case 'm': mix_list = optarg; break;
+        case 'd': secs = atoi(optarg); break;
+        case 'w': warmup_secs = atoi(optarg); break;
+        case 'z': think_ms = atoi(optarg); break;
+        case 'j': nworkers = atoi(optarg); break;
+        case 'p': port = atoi(optarg) - 1; break;
+        case 'a': server_args = optarg; break;
+        case 'b': base = optarg; break;
+        case 'o': prefix = optarg; break;
+        case 'C': comparing = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (comparing) {
+        if (optind != argc - 2)
+            usage(argv[0]);
+        int nold, nnew;
+        perf_run *olds = read_csv(argv[optind], &nold);
+        perf_run *news = read_csv(argv[optind + 1], &nnew);
+        compare(olds, nold, news, nnew);
+        return 0;
+    }
+    if ((optind != argc - 1) || (secs <= 0) || (warmup_secs < 0) || (think_ms < 0) || (nworkers <= 0))
+        usage(argv[0]);
+    char *server = argv[optind];
+
+    // Check the mixes before anything starts
+    char *mix_copy = strdup(mix_list);
+    char *mix_names[32];
+    int nmixes = 0;
+    for (char *m = strtok(mix_copy, ","); m != NULL; m = strtok(NULL, ",")) {
+        if ((nmixes == 32) || (strlen(m) >= sizeof(((perf_run *)0)->mix)) || (parse_mix(m) < 0))
+            usage(argv[0]);
+        mix_names[nmixes++] = m;
+    }
+
+    // Every connection is a descriptor here and in the server
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    signal(SIGPIPE, SIG_IGN);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s.csv", prefix);
+    FILE *csv = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s-server.log", prefix);
+    FILE *log = fopen(path, "w");
+    if ((csv == NULL) || (log == NULL)) {
+        perror(prefix);
+        exit(1);
+    }
+    fprintf(csv, "%s\n", PERF_CSV_HEADER);
+
+    int size = 64, nruns = 0;
+    perf_run *runs = malloc(size * sizeof(perf_run));
+    if (runs == NULL) {
+        perror("main");
+        exit(1);
+    }
+    char *builds[2] = {"new", "base"};
+    char *servers[2] = {server, base};
+    int nbuilds = (base != NULL) ? 2 : 1;
+
+    for (int c = 0; c < nconn_counts; c++) {
+        int conns = conn_counts[c];
+        if ((rlim_t)conns + 64 > lim.rlim_cur)
+            fprintf(stderr, "warning: %d connections need more descriptors than the limit (%ld)\n",
+                    conns, (long)lim.rlim_cur);
+        int last_airports = 0;
+        for (int d = 0; d < ndepths; d++) {
+            int airports = (conns + depths[d] - 1) / depths[d];
+            if (airports > AIRPORT_MAX)
+                airports = AIRPORT_MAX;
+            if (airports == last_airports)
+                continue;  // The same queues as the last depth
+            last_airports = airports;
+
+            for (int m = 0; m < nmixes; m++) {
+                parse_mix(mix_names[m]);
+                think_us = think_ms * 1000LL;
+                for (int b = nbuilds - 1; b >= 0; b--) {
+                    if (nruns == size) {
+                        size *= 2;
+                        if ((runs = realloc(runs, size * sizeof(perf_run))) == NULL) {
+                            perror("main");
+                            exit(1);
+                        }
+                    }
+                    perf_run *run = &runs[nruns];
+                    memset(run, 0, sizeof(*run));
+                    snprintf(run->mix, sizeof(run->mix), "%s", mix_names[m]);
+                    run->think_ms = think_ms;
+                    if (run_point(servers[b], server_args, builds[b], conns, airports, nworkers,
+                                  warmup_secs, secs, log, run) < 0)
+                        exit(1);
+                    write_csv_row(csv, run);
+                    nruns++;
+                    printf("%-4s %6d conns (%d up) %3d airports depth %5d %-14s %9.0f ops/s  "
+                           "p50 %6lld p99 %7lld p99.9 %7lld us  rss %6ld KB  csw %lld\n",
+                           run->build, run->conns, run->connected, run->airports, run->depth,
+                           run->mix, run->ops_per_sec, run->p50_us, run->p99_us, run->p999_us,
+                           run->rss_kb, run->csw_voluntary + run->csw_involuntary);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    fclose(csv);
+    fclose(log);
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    write_json(path, runs, nruns);
+
+    if ((base != NULL) && (nruns > 0)) {
+        perf_run olds[nruns], news[nruns];
+        int nold = 0, nnew = 0;
+        for (int i = 0; i < nruns; i++) {
+            if (strcmp(runs[i].build, "base") == 0)
+                olds[nold++] = runs[i];
+            else
+                news[nnew++] = runs[i];
+        }
+        printf("\n");
+        compare(olds, nold, news, nnew);
+    }
+    free(mix_copy);
+    free(runs);
+    return 0;
+}
@@ -0,0 +1,518 @@
+// Program to replay traffic captured by a server (gndcontrol -c) against
+// a server, to load it the way real clients did.
+
+// Every connection in the capture gets a connection of its own and a
+// thread to drive it. The thread connects when the connection's first
+// command is due, and sends each of its commands, in order, at the time
+// it arrived in the capture, scaled by the speed (-s): 1 is real time, 10
+// is ten times as fast, and 0 sends every command as soon as the ones
+// before it on the connection have been sent. Replies are read while
+// waiting for the next command to be due, and matched to the commands
+// they answer in order (every command has exactly one "OK" or "ERR"
+// reply, except BYE, empty lines and anything an observer sends; TAKEOFF,
+// NOTICE and EVENT messages are not replies). A connection that closed in
+// the capture is closed once its replies are in.
+//
+// Afterwards it reports how late the commands were sent against the
+// (scaled) schedule, how long the server took to handle each command in
+// the capture, how long each took to be answered in the replay, and the
+// difference between the two, which includes the round trip that the
+// captured times don't. "SHM" commands are skipped: everything is
+// replayed over a socket.
+//
+// Usage: atc_replay [-h host] [-p port] [-L path] [-s speed] capture_file
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "binproto.h"
+#include "net.h"
+
+// How long to wait for outstanding replies once a connection has nothing
+// more to send
+
+#define REPLAY_DRAIN_MS 5000
+
+// A command from the capture
+
+typedef struct command {
+    capture_record rec;
+    char *data;
+} command;
+
+// A connection from the capture, and how its replay went. The results
+// are for each of its commands, in order (-1 where there wasn't one).
+
+typedef struct connection {
+    command **commands;
+    int ncommands;
+    long long *lag_us;          // How late it was sent
+    long long *reply_us;        // How long its reply took
+    pthread_t tid;
+} connection;
+
+// How a connection's replies are read. Replies are text until the reply
+// to BINARY, which starts the binary protocol.
+
+typedef struct replier {
+    int fd;
+    int binary;                 // Reading binary frames
+    int fleet;                  // Replies start with a channel name
+    char buf[BIN_HEADER + BIN_MAXPAYLOAD + 1];
+    size_t used;
+    int *pending;               // Commands waiting for replies, in order
+    long long *sent_us;         // When each command was sent
+    int head, tail;             // Pending commands are head..tail-1
+    int *switches;              // What each command's reply switches to
+} replier;
+
+// What a reply switches the connection's replies to (in "switches")
+
+#define SWITCH_NONE 0
+#define SWITCH_BINARY 1
+#define SWITCH_FLEET 2
+
+static char *host = "localhost";
+static char *port = "8080";
+static char *local_path;
+static double speed = 1;
+static long long start_us;      // When the replay started
+static uint64_t first_at_us;    // When the capture's first command arrived
+static int failed_conns;
+static int skipped;             // SHM commands not replayed
+
+/************************************************************************
+ * now_us returns the time in microseconds.
+ */
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/************************************************************************
+ * sleep_until sleeps until time "when" (us).
+ */
+static void sleep_until(long long when) {
+    long long wait = when - now_us();
+    if (wait > 0) {
+        struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+        while (nanosleep(&ts, &ts) < 0)
+            ;
+    }
+}
+
+/************************************************************************
+ * due_us returns when command "cmd" is due to be sent.
+ */
+static long long due_us(command *cmd) {
+    if (speed == 0)
+        return start_us;
+    return start_us + (long long)((cmd->rec.at_us - first_at_us) / speed);
+}
+
+/************************************************************************
+ * read_capture reads the commands from the capture file at "path", and
+ * sorts them into connections. Returns the connections, with their
+ * number in "*nconns".
+ */
+static connection *read_capture(char *path, int *nconns) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char magic[CAPTURE_MAGIC_LEN];
+    if ((fread(magic, CAPTURE_MAGIC_LEN, 1, fp) != 1) ||
+        (memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        exit(1);
+    }
+
+    int size = 64;
+    connection *conns = calloc(size, sizeof(connection));
+    if (conns == NULL) {
+        perror("read_capture");
+        exit(1);
+    }
+    int n = 0;
+    int ncommands = 0;
+    command *cmd;
+    while (1) {
+        if ((cmd = malloc(sizeof(command))) == NULL) {
+            perror("read_capture");
+            exit(1);
+        }
+        if (fread(&cmd->rec, sizeof(cmd->rec), 1, fp) != 1) {
+            free(cmd);
+            break;
+        }
+        size_t len = CAPTURE_LEN(&cmd->rec);
+        if (((cmd->data = malloc(len + 1)) == NULL) ||
+            (fread(cmd->data, 1, len, fp) != len)) {
+            fprintf(stderr, "%s: cut short\n", path);
+            free(cmd->data);
+            free(cmd);
+            break;
+        }
+        cmd->data[len] = '\0';
+        if ((ncommands++ == 0) || (cmd->rec.at_us < first_at_us))
+            first_at_us = cmd->rec.at_us;
+
+        int id = cmd->rec.conn;
+        if (id >= size) {
+            int newsize = 2 * id;
+            if ((conns = realloc(conns, newsize * sizeof(connection))) == NULL) {
+                perror("read_capture");
+                exit(1);
+            }
+            memset(conns + size, 0, (newsize - size) * sizeof(connection));
+            size = newsize;
+        }
+        connection *conn = &conns[id];
+        if ((conn->ncommands & (conn->ncommands - 1)) == 0) {  // 0 or a power of 2
+            conn->commands = realloc(conn->commands, 2 * (conn->ncommands + 1) * sizeof(command *));
+            if (conn->commands == NULL) {
+                perror("read_capture");
+                exit(1);
+            }
+        }
+        conn->commands[conn->ncommands++] = cmd;
+        if (id >= n)
+            n = id + 1;
+    }
+    fclose(fp);
+    *nconns = n;
+    return conns;
+}
+
+/************************************************************************
+ * word returns the length of the word at the start of "s" (after any
+ * spaces, which are skipped over in "*s").
+ */
+static int word(char **s) {
+    while ((**s == ' ') || (**s == '\t'))
+        (*s)++;
+    return strcspn(*s, " \t\r\n");
+}
+
+/************************************************************************
+ * is_word returns true if the word at "s" (of length "len") is "w".
+ */
+static int is_word(char *s, int len, char *w) {
+    return (len == strlen(w)) && (strncmp(s, w, len) == 0);
+}
+
+/************************************************************************
+ * got_reply matches a reply to the oldest command waiting for one on
+ * "r", and notes how long it took in "reply_us".
+ */
+static void got_reply(replier *r, long long *reply_us) {
+    if (r->head == r->tail)
+        return;  // Not a reply to anything sent here
+    int i = r->head++;
+    reply_us[r->pending[i]] = now_us() - r->sent_us[i];
+    if (r->switches[i] == SWITCH_BINARY)
+        r->binary = 1;
+    else if (r->switches[i] == SWITCH_FLEET)
+        r->fleet = 1;
+}
+
+/************************************************************************
+ * take_replies takes all the complete replies out of the buffer of "r".
+ */
+static void take_replies(replier *r, long long *reply_us) {
+    size_t done = 0;
+    while (done < r->used) {
+        char *start = r->buf + done;
+        size_t avail = r->used - done;
+        if (r->binary) {
+            if (avail < BIN_HEADER)
+                break;
+            unsigned char *header = (unsigned char *)start;
+            size_t len = BIN_HEADER + (header[0] << 8 | header[1]);
+            if (avail < len)
+                break;
+            if ((header[2] == BIN_OK) || (header[2] == BIN_ERR))
+                got_reply(r, reply_us);
+            done += len;
+        } else {
+            char *nl = memchr(start, '\n', avail);
+            if (nl == NULL)
+                break;
+            *nl = '\0';
+            char *s = start;
+            int len = word(&s);
+            if (r->fleet) {  // Skip the channel name
+                s += len;
+                len = word(&s);
+            }
+            if (is_word(s, len, "OK") || is_word(s, len, "ERR"))
+                got_reply(r, reply_us);
+            done = nl + 1 - r->buf;
+        }
+    }
+    memmove(r->buf, r->buf + done, r->used - done);
+    r->used -= done;
+}
+
+/************************************************************************
+ * read_replies waits until time "until" (us), or for the replies to
+ * everything sent if "until" is 0, reading the replies that come in on
+ * "r" meanwhile. Returns 0, or -1 if the connection closed.
+ */
+static int read_replies(replier *r, long long until, long long *reply_us) {
+    long long drain_end = now_us() + REPLAY_DRAIN_MS * 1000LL;
+    while (1) {
+        long long now = now_us();
+        long long wait = (until == 0) ? drain_end - now : until - now;
+        if ((wait <= 0) || ((until == 0) && (r->head == r->tail)))
+            return 0;
+
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+        if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+            continue;
+        ssize_t got = read(r->fd, r->buf + r->used, sizeof(r->buf) - r->used);
+        if (got <= 0) {
+            if ((got < 0) && (errno == EINTR))
+                continue;
+            return -1;
+        }
+        r->used += got;
+        take_replies(r, reply_us);
+    }
+}
+
+/************************************************************************
+ * send_all sends the "len" bytes at "data" on socket "fd". Returns 0, or
+ * -1 if the connection closed.
+ */
+static int send_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = write(fd, data, len);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/************************************************************************
+ * replay_conn is the thread that replays connection "arg".
+ */
+static void *replay_conn(void *arg) {
+    connection *conn = arg;
+    replier *r = calloc(1, sizeof(replier));
+    if ((r == NULL) ||
+        ((r->pending = malloc(conn->ncommands * sizeof(int))) == NULL) ||
+        ((r->sent_us = malloc(conn->ncommands * sizeof(long long))) == NULL) ||
+        ((r->switches = calloc(conn->ncommands, sizeof(int))) == NULL)) {
+        perror("replay_conn");
+        exit(1);
+    }
+
+    sleep_until(due_us(conn->commands[0]));
+    r->fd = (local_path != NULL) ? connect_local(local_path) : connect_to(host, port);
+    if (r->fd < 0) {
+        __atomic_add_fetch(&failed_conns, 1, __ATOMIC_RELAXED);
+        free(r);
+        return NULL;
+    }
+
+    int observer = 0;
+    int binary = 0;
+    int fleet = 0;
+    for (int i = 0; i < conn->ncommands; i++) {
+        command *cmd = conn->commands[i];
+        int kind = CAPTURE_KIND(&cmd->rec);
+        if (kind == CAPTURE_CLOSE)
+            break;
+
+        // Work out whether the command will be answered (and how)
+        int answered = 1;
+        if ((kind == CAPTURE_BINARY) || binary) {
+            unsigned char code = (CAPTURE_LEN(&cmd->rec) > 2) ? cmd->data[2] : 0;
+            answered = (code != BIN_BYE);
+        } else {
+            char *s = cmd->data;
+            int len = word(&s);
+            if (fleet && (len > 0)) {
+                s += len;
+                len = word(&s);
+            }
+            if (is_word(s, len, "SHM")) {
+                __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if ((len == 0) || is_word(s, len, "BYE") || observer) {
+                answered = 0;
+            } else if (!fleet && is_word(s, len, "FLEET")) {
+                r->switches[r->tail] = SWITCH_FLEET;
+                fleet = 1;
+            } else if (!fleet && is_word(s, len, "OBSERVE")) {
+                observer = 1;
+            } else if (!fleet && is_word(s, len, "BINARY")) {
+                r->switches[r->tail] = SWITCH_BINARY;
+                binary = 1;
+            }
+        }
+
+        long long due = due_us(cmd);
+        if (read_replies(r, due, conn->reply_us) < 0)
+            break;
+        long long now = now_us();
+        conn->lag_us[i] = (now > due) ? now - due : 0;
+        if (answered) {
+            r->pending[r->tail] = i;
+            r->sent_us[r->tail++] = now;
+        }
+        if (send_all(r->fd, cmd->data, CAPTURE_LEN(&cmd->rec)) < 0)
+            break;
+    }
+    read_replies(r, 0, conn->reply_us);
+
+    close(r->fd);
+    free(r->pending);
+    free(r->sent_us);
+    free(r->switches);
+    free(r);
+    return NULL;
+}
+
+/************************************************************************
+ * compare_ll is the qsort comparison for times.
+ */
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/************************************************************************
+ * report sorts the "n" times (us) in "times" and prints their
+ * percentiles, as "name".
+ */
+static void report(char *name, long long *times, long n) {
+    if (n == 0) {
+        printf("%-12s (none)\n", name);
+        return;
+    }
+    qsort(times, n, sizeof(long long), compare_ll);
+    printf("%-12s p50 %8lld  p90 %8lld  p99 %8lld  max %8lld us\n", name,
+           times[(long)(0.5 * (n - 1))], times[(long)(0.9 * (n - 1))],
+           times[(long)(0.99 * (n - 1))], times[n - 1]);
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-L path] [-s speed] capture_file\n", progname);
+    fprintf(stderr, "  -s speed  1 for real time (the default), N for N times as fast,\n");
+    fprintf(stderr, "            0 for as fast as possible\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:L:s:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'L': local_path = optarg; break;
+        case 's': speed = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if ((optind != argc - 1) || (speed < 0))
+        usage(argv[0]);
+
+    int nconns;
+    connection *conns = read_capture(argv[optind], &nconns);
+    long total = 0;
+    uint64_t last_at_us = first_at_us;
+    for (int i = 0; i < nconns; i++) {
+        connection *conn = &conns[i];
+        if (conn->ncommands == 0)
+            continue;
+        conn->lag_us = malloc(conn->ncommands * sizeof(long long));
+        conn->reply_us = malloc(conn->ncommands * sizeof(long long));
+        if ((conn->lag_us == NULL) || (conn->reply_us == NULL)) {
+            perror("main");
+            exit(1);
+        }
+        for (int j = 0; j < conn->ncommands; j++) {
+            conn->lag_us[j] = conn->reply_us[j] = -1;
+            if (conn->commands[j]->rec.at_us > last_at_us)
+                last_at_us = conn->commands[j]->rec.at_us;
+        }
+        total += conn->ncommands;
+    }
+
+    start_us = now_us();
+    int started = 0;
+    for (int i = 0; i < nconns; i++) {
+        if (conns[i].ncommands == 0)
+            continue;
+        if (pthread_create(&conns[i].tid, NULL, replay_conn, &conns[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        started++;
+    }
+    for (int i = 0; i < nconns; i++) {
+        if (conns[i].ncommands > 0)
+            pthread_join(conns[i].tid, NULL);
+    }
+    long long took_us = now_us() - start_us;
+
+    // Gather up the results
+    long long *lags = malloc(total * sizeof(long long));
+    long long *captured = malloc(total * sizeof(long long));
+    long long *replies = malloc(total * sizeof(long long));
+    long long *drifts = malloc(total * sizeof(long long));
+    if ((lags == NULL) || (captured == NULL) || (replies == NULL) || (drifts == NULL)) {
+        perror("main");
+        exit(1);
+    }
+    long nsent = 0, nreplies = 0, ncaptured = 0;
+    for (int i = 0; i < nconns; i++) {
+        connection *conn = &conns[i];
+        for (int j = 0; j < conn->ncommands; j++) {
+            command *cmd = conn->commands[j];
+            if (CAPTURE_KIND(&cmd->rec) == CAPTURE_CLOSE)
+                continue;
+            captured[ncaptured++] = cmd->rec.took_us;
+            if (conn->lag_us[j] >= 0)
+                lags[nsent++] = conn->lag_us[j];
+            if (conn->reply_us[j] >= 0) {
+                drifts[nreplies] = conn->reply_us[j] - cmd->rec.took_us;
+                replies[nreplies++] = conn->reply_us[j];
+            }
+        }
+    }
+
+    printf("%d connections (%d failed), %ld commands sent (%d SHM skipped), %ld replies\n",
+           started, failed_conns, nsent, skipped, nreplies);
+    printf("capture took %.3f s, replay took %.3f s", (last_at_us - first_at_us) / 1e6, took_us / 1e6);
+    if (speed == 0)
+        printf(" (as fast as possible)\n");
+    else
+        printf(" (at %gx)\n", speed);
+    report("send lag", lags, nsent);
+    report("captured", captured, ncaptured);
+    report("replay", replies, nreplies);
+    report("drift", drifts, nreplies);
+    return 0;
+}
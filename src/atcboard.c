@@ -0,0 +1,107 @@
+// Departure board reader.
+
+// This maps the shared-memory departure board published by a server
+// started with "-B path" and prints it, once or every "-w ms"
+// milliseconds. It never talks to the server. With "-c count" it instead
+// reads the whole board "count" times as fast as it can and reports the
+// read rate, which shows what a display polling the board costs.
+//
+// Usage: atcboard [-w ms] [-c count] path
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board.h"
+
+static board_airport section;
+
+/************************************************************************
+ * now_ms returns the current time on the server's clock.
+ */
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/************************************************************************
+ * state_name returns a short name for a plane state.
+ */
+static const char *state_name(int state) {
+    switch (state) {
+    case PLANE_ATTERMINAL: return "at terminal";
+    case PLANE_TAXIING: return "taxiing";
+    case PLANE_CLEAR: return "cleared";
+    case PLANE_INAIR: return "in the air";
+    default: return "unknown";
+    }
+}
+
+/************************************************************************
+ * print_board prints every airport on the board.
+ */
+static void print_board(board *b) {
+    long long now = now_ms();
+    for (int i = 0; board_read(b, i, &section) == 0; i++) {
+        printf("%-4s  %d planes, %d queued", section.code, section.nplanes, section.nqueued);
+        if (section.last_category != 0)
+            printf(", last departure (%c) %.1fs ago", section.last_category,
+                   (now - section.last_departure_ms) / 1000.0);
+        printf("\n");
+        int shown = (section.nqueued < BOARD_QUEUE) ? section.nqueued : BOARD_QUEUE;
+        for (int j = 0; j < shown; j++) {
+            printf("  %3d. %-*s (%c) %s\n", j + 1, PLANE_MAXID, section.queue[j].id,
+                   section.queue[j].category, state_name(section.queue[j].state));
+        }
+        if (shown < section.nqueued)
+            printf("  ... and %d more\n", section.nqueued - shown);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int wait_ms = 0;
+    long count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:")) != -1) {
+        switch (opt) {
+        case 'w': wait_ms = atoi(optarg); break;
+        case 'c': count = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-w ms] [-c count] path\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-w ms] [-c count] path\n", argv[0]);
+        exit(1);
+    }
+
+    board *b = board_attach(argv[optind]);
+    if (b == NULL)
+        exit(1);
+
+    if (count > 0) {
+        long long start = now_ms();
+        long sections = 0;
+        for (long n = 0; n < count; n++) {
+            for (int i = 0; board_read(b, i, &section) == 0; i++)
+                sections++;
+        }
+        long long elapsed = now_ms() - start;
+        printf("%ld board reads (%ld airport sections) in %lld ms: %.0f reads/s\n",
+               count, sections, elapsed, elapsed > 0 ? count * 1000.0 / elapsed : 0.0);
+        return 0;
+    }
+
+    while (1) {
+        print_board(b);
+        if (wait_ms <= 0)
+            break;
+        fflush(stdout);
+        usleep(wait_ms * 1000);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,491 @@
+// Deterministic simulator for the ground control server core.
+
+// This drives the real registry, queue, runway scheduler and protocol
+// handlers (docommand) from a single thread, with a virtual clock and
+// in-memory airplanes instead of sockets. Each simulated airplane has
+// FILE handles made with fopencookie, so the server's replies land in a
+// callback here rather than on a network connection. Events (arrivals,
+// takeoffs, position polls, early disconnects, runway timers) are kept
+// in a priority queue ordered by virtual time, so a day of departures
+// runs in well under a second of real time, and a given seed always
+// produces exactly the same run -- the digest printed at the end can be
+// compared across builds to catch scheduler changes. With -A, flights are
+// spread evenly over several airports, each with its own runway.
+//
+// Usage: atcsim [-n flights] [-s seed] [-a mean_arrival_ms] [-r roll_ms]
+//               [-p poll_ms] [-b bye_percent] [-A airports]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "logger.h"
+#include "airs_protocol.h"
+#include "queue.h"
+#include "vclock.h"
+#include "wake.h"
+
+// Event types
+
+#define EV_ARRIVE 0
+#define EV_RUNWAY 1
+#define EV_INAIR 2
+#define EV_POLL 3
+#define EV_BYE 4
+
+// The simulated side of one airplane connection
+
+typedef struct sim_client {
+    airplane *plane;
+    int flight;           // Flight number (index of arrival)
+    int ap_index;         // Which simulated airport it is at
+    long long taxi_ms;    // When REQTAXI was accepted
+    int pending;          // Events still in the event queue for this client
+    int finished;         // Plane has been torn down
+    char line[64];        // Partial reply line from the server
+    int linelen;
+} sim_client;
+
+typedef struct event {
+    long long time;
+    unsigned long seq;    // Tie breaker, so equal times stay in FIFO order
+    int type;
+    sim_client *client;
+    int ap_index;         // Airport for runway events
+} event;
+
+// Simulation parameters
+
+static int nflights = 100000;
+static unsigned int seed = 362;
+static int mean_arrival_ms = 5000;
+static int roll_ms = 500;
+static int poll_ms = 2000;
+static int bye_percent = 2;
+static int nairports = 1;
+
+// The event queue is a binary min-heap on (time, seq)
+
+static event *heap;
+static int heap_size;
+static int heap_capacity;
+static unsigned long next_seq;
+
+// Each airport's runway is run from a timer event, at most one per airport
+
+static airport **sim_airports;
+static long long *runway_at;
+
+// Results
+
+static long long *latencies;
+static int ndeparted;
+static int nbye;
+static int nerrors;
+static long nevents;
+static unsigned long digest = 14695981039346656037UL;
+
+/************************************************************************
+ * event_before is the heap ordering.
+ */
+static int event_before(event *a, event *b) {
+    if (a->time != b->time)
+        return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+/************************************************************************
+ * push_event adds an event to the heap.
+ */
+static void push_event(event ev) {
+    if (heap_size == heap_capacity) {
+        heap_capacity = (heap_capacity == 0) ? 1024 : 2 * heap_capacity;
+        heap = realloc(heap, heap_capacity * sizeof(event));
+        if (heap == NULL) {
+            perror("atcsim schedule");
+            exit(1);
+        }
+    }
+
+    int i = heap_size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!event_before(&ev, &heap[parent]))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = ev;
+}
+
+/************************************************************************
+ * schedule puts a new event of type "type" for "client" at virtual time
+ * "time".
+ */
+static void schedule(long long time, int type, sim_client *client) {
+    event ev = { time, next_seq++, type, client, -1 };
+    if (client != NULL) {
+        ev.ap_index = client->ap_index;
+        client->pending++;
+    }
+    push_event(ev);
+}
+
+/************************************************************************
+ * schedule_runway sets a timer to run airport "ap_index"'s runway
+ * scheduler at virtual time "time", unless there's an earlier one.
+ */
+static void schedule_runway(long long time, int ap_index) {
+    if ((runway_at[ap_index] >= 0) && (runway_at[ap_index] <= time))
+        return;
+    runway_at[ap_index] = time;
+    event ev = { time, next_seq++, EV_RUNWAY, NULL, ap_index };
+    push_event(ev);
+}
+
+/************************************************************************
+ * run_runway runs the runway scheduler of airport "ap_index", and sets a
+ * timer if it has to wait for separation.
+ */
+static void run_runway(int ap_index) {
+    if ((ap_index < 0) || (sim_airports[ap_index] == NULL))
+        return;
+    long long ready = queue_dispatch(&sim_airports[ap_index]->queue);
+    if (ready >= 0)
+        schedule_runway(ready, ap_index);
+}
+
+/************************************************************************
+ * next_event removes the earliest event from the heap into *ev. Returns
+ * false when there are no events left.
+ */
+static int next_event(event *ev) {
+    if (heap_size == 0)
+        return 0;
+
+    *ev = heap[0];
+    event last = heap[--heap_size];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= heap_size)
+            break;
+        if ((child + 1 < heap_size) && event_before(&heap[child+1], &heap[child]))
+            child++;
+        if (!event_before(&heap[child], &last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return 1;
+}
+
+/************************************************************************
+ * uniform returns a random integer in [lo, hi].
+ */
+static int uniform(int lo, int hi) {
+    return lo + rand_r(&seed) % (hi - lo + 1);
+}
+
+/************************************************************************
+ * random_category draws a wake category (same mix as wake_bench).
+ */
+static int random_category() {
+    int r = uniform(0, 99);
+    if (r < 10)
+        return WAKE_LIGHT;
+    if (r < 65)
+        return WAKE_MEDIUM;
+    if (r < 95)
+        return WAKE_HEAVY;
+    return WAKE_SUPER;
+}
+
+/************************************************************************
+ * server_line is called for every complete line the server sends to a
+ * simulated airplane.
+ */
+static void server_line(sim_client *client, char *line) {
+    if (strncmp(line, "ERR", 3) == 0) {
+        nerrors++;
+    } else if (strcmp(line, "TAKEOFF") == 0) {
+        long long now = vclock_now_ms();
+        latencies[ndeparted++] = now - client->taxi_ms;
+        digest = (digest ^ (unsigned long)now) * 1099511628211UL;
+        digest = (digest ^ (unsigned long)client->flight) * 1099511628211UL;
+        schedule(now + uniform(roll_ms / 2, roll_ms + roll_ms / 2), EV_INAIR, client);
+    }
+}
+
+/************************************************************************
+ * stub_write is the fopencookie write function for the sending side of a
+ * simulated connection -- it splits the server's output into lines.
+ */
+static ssize_t stub_write(void *cookie, const char *buf, size_t size) {
+    sim_client *client = cookie;
+    for (size_t i = 0; i < size; i++) {
+        if (buf[i] == '\n') {
+            client->line[client->linelen] = '\0';
+            server_line(client, client->line);
+            client->linelen = 0;
+        } else if (client->linelen < (int)sizeof(client->line) - 1) {
+            client->line[client->linelen++] = buf[i];
+        }
+    }
+    return size;
+}
+
+/************************************************************************
+ * stub_read is the read function for the receiving side, which is never
+ * read from (commands go straight to docommand).
+ */
+static ssize_t stub_read(void *cookie, char *buf, size_t size) {
+    return 0;
+}
+
+/************************************************************************
+ * send_command runs one protocol command for a simulated airplane.
+ */
+static void send_command(sim_client *client, const char *fmt, ...) {
+    char line[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    docommand(client->plane, line);
+}
+
+/************************************************************************
+ * arrive creates the airplane for a new flight, registers it and asks
+ * for taxi, just as a networked airplane would. Returns the index of the
+ * airport it went to.
+ */
+static int arrive(int flight) {
+    sim_client *client = calloc(1, sizeof(sim_client));
+    airplane *plane = calloc(1, sizeof(airplane));
+    if ((client == NULL) || (plane == NULL)) {
+        perror("atcsim arrive");
+        exit(1);
+    }
+
+    cookie_io_functions_t send_funcs = { NULL, stub_write, NULL, NULL };
+    cookie_io_functions_t recv_funcs = { stub_read, NULL, NULL, NULL };
+    FILE *sender = fopencookie(client, "w", send_funcs);
+    FILE *receiver = fopencookie(client, "r", recv_funcs);
+    if ((sender == NULL) || (receiver == NULL)) {
+        perror("atcsim fopencookie");
+        exit(1);
+    }
+    setvbuf(sender, NULL, _IOLBF, 0);
+
+    airplane_init(plane, sender, receiver);
+    client->plane = plane;
+    client->flight = flight;
+    client->ap_index = (nairports > 1) ? uniform(0, nairports - 1) : 0;
+
+    int category = random_category();
+    if (nairports > 1)
+        send_command(client, "REG A%03d SIM%d %c", client->ap_index, flight, wake_letter(category));
+    else
+        send_command(client, "REG SIM%d %c", flight, wake_letter(category));
+    if (plane->airport != NULL)
+        sim_airports[client->ap_index] = plane->airport;
+    send_command(client, "REQTAXI");
+    client->taxi_ms = vclock_now_ms();
+
+    if (poll_ms > 0)
+        schedule(client->taxi_ms + poll_ms, EV_POLL, client);
+    if (uniform(0, 99) < bye_percent)
+        schedule(client->taxi_ms + uniform(0, 60000), EV_BYE, client);
+    return client->ap_index;
+}
+
+/************************************************************************
+ * finish tears a plane down after it is done, the same way the server's
+ * connection handler does when a connection closes.
+ */
+static void finish(sim_client *client) {
+    airport_leave(client->plane);
+    client->plane = NULL;
+    client->finished = 1;
+}
+
+/************************************************************************
+ * run_event performs a single event from the event queue, and returns the
+ * index of the airport it affected (or -1 if none).
+ */
+static int run_event(event *ev, int *arrived) {
+    sim_client *client = ev->client;
+    int ap_index = ev->ap_index;
+    if (client != NULL) {
+        client->pending--;
+        if (client->finished) {
+            if (client->pending == 0)
+                free(client);
+            return -1;
+        }
+    }
+
+    switch (ev->type) {
+    case EV_ARRIVE:
+        ap_index = arrive((*arrived)++);
+        if (*arrived < nflights) {
+            double u = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2.0);
+            schedule(ev->time + (long long)(-mean_arrival_ms * log(u)), EV_ARRIVE, NULL);
+        }
+        break;
+    case EV_RUNWAY:
+        runway_at[ap_index] = -1;
+        break;
+    case EV_INAIR:
+        send_command(client, "INAIR");
+        finish(client);
+        break;
+    case EV_POLL:
+        if (client->plane->state == PLANE_TAXIING) {
+            send_command(client, "REQPOS");
+            schedule(ev->time + poll_ms, EV_POLL, client);
+        }
+        break;
+    case EV_BYE:
+        if (client->plane->state == PLANE_TAXIING) {
+            send_command(client, "BYE");
+            nbye++;
+            finish(client);
+        }
+        break;
+    }
+
+    if ((client != NULL) && client->finished && (client->pending == 0))
+        free(client);
+    return ap_index;
+}
+
+/************************************************************************
+ * compare_ll is the qsort comparison for latencies.
+ */
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/************************************************************************
+ * percentile of the sorted latencies.
+ */
+static long long percentile(double p) {
+    if (ndeparted == 0)
+        return 0;
+    int i = (int)(p * (ndeparted - 1));
+    return latencies[i];
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:a:r:p:b:A:")) != -1) {
+        switch (opt) {
+        case 'n': nflights = atoi(optarg); break;
+        case 's': seed = (unsigned int)atoi(optarg); break;
+        case 'a': mean_arrival_ms = atoi(optarg); break;
+        case 'r': roll_ms = atoi(optarg); break;
+        case 'p': poll_ms = atoi(optarg); break;
+        case 'b': bye_percent = atoi(optarg); break;
+        case 'A': nairports = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n flights] [-s seed] [-a mean_arrival_ms] "
+                    "[-r roll_ms] [-p poll_ms] [-b bye_percent] [-A airports]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if ((nflights <= 0) || (mean_arrival_ms <= 0) || (roll_ms < 0) ||
+        (nairports <= 0) || (nairports > AIRPORT_MAX)) {
+        fprintf(stderr, "%s: flights, arrival time and airports must be positive "
+                "(at most %d airports)\n", argv[0], AIRPORT_MAX);
+        exit(1);
+    }
+
+    // The server logs every clearance, which would swamp the report
+    log_level = LOG_OFF;
+    FILE *report = stdout;
+
+    unsigned int first_seed = seed;
+    latencies = malloc(nflights * sizeof(long long));
+    sim_airports = calloc(nairports, sizeof(airport *));
+    runway_at = malloc(nairports * sizeof(long long));
+    if ((latencies == NULL) || (sim_airports == NULL) || (runway_at == NULL)) {
+        perror("atcsim");
+        exit(1);
+    }
+
+    for (int i = 0; i < nairports; i++)
+        runway_at[i] = -1;
+
+    vclock_use_virtual(0);
+    airports_init(0);
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    int arrived = 0;
+    event ev;
+    schedule(0, EV_ARRIVE, NULL);
+    while (next_event(&ev)) {
+        vclock_set(ev.time);
+        run_runway(run_event(&ev, &arrived));
+        nevents++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    double hours = vclock_now_ms() / 3600000.0;
+
+    qsort(latencies, ndeparted, sizeof(long long), compare_ll);
+    double mean = 0;
+    for (int i = 0; i < ndeparted; i++)
+        mean += latencies[i];
+    if (ndeparted > 0)
+        mean /= ndeparted;
+
+    // How good the ETAs given to flights as they joined the queue were
+    long long eta_checked = 0, eta_err_total = 0, eta_err_max = 0;
+    for (int i = 0; i < nairports; i++) {
+        if (sim_airports[i] == NULL)
+            continue;
+        long long checked, err_total, err_max;
+        queue_eta_stats(&sim_airports[i]->queue, &checked, &err_total, &err_max);
+        eta_checked += checked;
+        eta_err_total += err_total;
+        if (err_max > eta_err_max)
+            eta_err_max = err_max;
+    }
+
+    fprintf(report, "flights:          %d (seed %u), %d airport%s\n", nflights, first_seed,
+            nairports, (nairports == 1) ? "" : "s");
+    fprintf(report, "departed:         %d, left early %d, errors %d\n", ndeparted, nbye, nerrors);
+    fprintf(report, "simulated time:   %.2f hours\n", hours);
+    fprintf(report, "throughput:       %.2f departures/hour\n", (hours > 0) ? ndeparted / hours : 0.0);
+    fprintf(report, "taxi->takeoff ms: mean %.0f, p50 %lld, p90 %lld, p99 %lld, max %lld\n",
+            mean, percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+    fprintf(report, "ETA error ms:     mean %lld, max %lld (%lld cleared)\n",
+            (eta_checked > 0) ? eta_err_total / eta_checked : 0, eta_err_max, eta_checked);
+    fprintf(report, "wall time:        %.3f s (%.0f events/s)\n", wall, (wall > 0) ? nevents / wall : 0.0);
+    fprintf(report, "digest:           %016lx\n", digest);
+    fflush(report);
+
+    airports_destroy();
+    free(latencies);
+    free(sim_airports);
+    free(runway_at);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,331 @@
+// Module for the binary protocol, a compact encoding of the ground control
+// protocol for clients that send a lot of commands.
+
+// A connection that sends "BINARY" (before registering) gets "OK" and then
+// switches to binary frames in both directions. Every frame has a fixed
+// header (see binproto.h): the payload length, a code and one byte of
+// argument. Commands are codes instead of words, so there is nothing to
+// tokenise, and replies are codes and numbers instead of formatted text.
+// Flight ids in replies (the list of flights ahead) are sent as 32-bit
+// handles; the server sends a NAME frame with the flight id the first
+// time it uses a handle on a connection, so each id crosses the wire once.
+//
+// The frames are decoded into calls on the same command handlers the
+// text protocol uses (see docommand_code), so both go through the same
+// state changes and checks, and only the replies are encoded differently
+// (see the send_ functions in airs_protocol.c). As for a fleet connection,
+// the replies to commands that arrive together are sent together, once
+// the connection has no more input waiting.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binproto.h"
+#include "admit.h"
+#include "airs_protocol.h"
+#include "airport.h"
+#include "prealloc.h"
+#include "trace.h"
+#include "util.h"
+
+// Buckets in each connection's table of handles
+
+#define BIN_BUCKETS 1024
+
+// A flight id that has been given a handle on a connection. The handle is
+// its index in the connection's table.
+
+typedef struct handle_entry {
+    char id[PLANE_MAXID+1];
+    int next;               // Next handle in the same bucket (or -1)
+} handle_entry;
+
+typedef struct binconn {
+    int buckets[BIN_BUCKETS];   // First handle in each bucket (or -1)
+    handle_entry *handles;
+    int nhandles;
+    int capacity;
+    unsigned char *payload;     // For replies listing flights
+    int payload_max;            // How many flights it has room for
+} binconn;
+
+// The connection whose command this thread is running right now, if any.
+// Replies to it wait for the end of the batch; anything else (like a
+// runway clearing a flight) is sent straight away.
+
+static __thread airplane *dispatching;
+
+static int nconns;
+
+/************************************************************************
+ * handle_hash returns the bucket for flight id "id".
+ */
+static unsigned int handle_hash(char *id) {
+    unsigned int hash = 2166136261u;
+    for (char *cp = id; *cp != '\0'; cp++)
+        hash = (hash ^ (unsigned char)*cp) * 16777619u;
+    return hash % BIN_BUCKETS;
+}
+
+/************************************************************************
+ * handles_reset forgets every handle on connection "bc", so they can be
+ * given out again.
+ */
+static void handles_reset(binconn *bc) {
+    for (int i = 0; i < BIN_BUCKETS; i++)
+        bc->buckets[i] = -1;
+    bc->nhandles = 0;
+}
+
+/************************************************************************
+ * binproto_start switches "plane" (which has just been sent "OK" to its
+ * BINARY command) to the binary protocol. Its replies go out through a
+ * fully buffered stream from now on, since they are flushed at the end of
+ * every batch rather than at every newline (except on a shared-memory
+ * connection, whose stream is cheap to write to either way).
+ */
+void binproto_start(airplane *plane) {
+    // A preallocated session keeps the state of its last binary connection
+    session *ses = plane->session;
+    binconn *bc = (ses != NULL) ? ses->bin : NULL;
+    if (bc == NULL) {
+        if ((bc = calloc(1, sizeof(binconn))) == NULL) {
+            perror("binproto_start");
+            exit(1);
+        }
+
+        // For a session, make the handle table and reply room as big as
+        // they will get now, rather than as flights are listed
+        if (ses != NULL) {
+            bc->capacity = BIN_HANDLES;
+            bc->payload_max = ses->ahead_max;
+            if (bc->payload_max > BIN_MAXPAYLOAD / 4)
+                bc->payload_max = BIN_MAXPAYLOAD / 4;
+            bc->handles = malloc(bc->capacity * sizeof(handle_entry));
+            bc->payload = malloc(4 * bc->payload_max + 1);
+            if ((bc->handles == NULL) || (bc->payload == NULL)) {
+                perror("binproto_start");
+                exit(1);
+            }
+            ses->bin = bc;
+        }
+    }
+
+    if (plane->shm == NULL) {
+        int fd = dup(fileno(plane->fp_send));
+        FILE *out = (fd < 0) ? NULL : fdopen(fd, "w");
+        if (out == NULL) {
+            perror("binproto_start");
+            exit(1);
+        }
+        fclose(plane->fp_send);
+        plane->fp_send = out;
+
+        // A session's buffer is free again now
+        if (ses != NULL)
+            setvbuf(out, ses->send_buf, _IOFBF, PREALLOC_BUFSIZE);
+        else
+            setvbuf(out, NULL, _IOFBF, BIN_BUFSIZE);
+    }
+
+    handles_reset(bc);
+    plane->bin = bc;
+    __atomic_add_fetch(&nconns, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * binproto_close frees the binary protocol state of "plane", which is
+ * disconnecting (unless its session keeps it).
+ */
+void binproto_close(airplane *plane) {
+    binconn *bc = plane->bin;
+    if (bc == NULL)
+        return;
+    if (plane->session == NULL) {
+        free(bc->handles);
+        free(bc->payload);
+        free(bc);
+    }
+    plane->bin = NULL;
+    __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * binproto_read reads the next frame from "plane" into "*bufptr" (which
+ * is "*size" bytes, and is made larger if needed, like getline does).
+ * Returns the number of bytes read, which is less than the whole frame if
+ * the read failed part way through, or -1 if nothing could be read.
+ */
+ssize_t binproto_read(airplane *plane, char **bufptr, size_t *size) {
+    FILE *in = plane->fp_recv;
+    if (*size < BIN_HEADER) {
+        *bufptr = realloc(*bufptr, BIN_HEADER);
+        if (*bufptr == NULL) {
+            perror("binproto_read");
+            exit(1);
+        }
+        *size = BIN_HEADER;
+    }
+    size_t got = fread(*bufptr, 1, BIN_HEADER, in);
+    if (got < BIN_HEADER)
+        return (got > 0) ? got : -1;
+
+    unsigned char *header = (unsigned char *)*bufptr;
+    size_t len = (header[0] << 8) | header[1];
+    if (*size < BIN_HEADER + len) {
+        *bufptr = realloc(*bufptr, BIN_HEADER + len);
+        if (*bufptr == NULL) {
+            perror("binproto_read");
+            exit(1);
+        }
+        *size = BIN_HEADER + len;
+    }
+    return got + fread(*bufptr + BIN_HEADER, 1, len, in);
+}
+
+/************************************************************************
+ * bin_reg performs a REG frame with payload "payload" of "len" bytes and
+ * argument "arg".
+ */
+static void bin_reg(airplane *plane, char *payload, size_t len, int arg) {
+    if (len <= AIRPORT_MAXCODE) {
+        send_err(plane, "REG missing flightid");
+        return;
+    }
+
+    char code[AIRPORT_MAXCODE+1];
+    memcpy(code, payload, AIRPORT_MAXCODE);
+    code[AIRPORT_MAXCODE] = '\0';
+
+    // One byte too many is kept, so that a long id is reported as such
+    char id[PLANE_MAXID+2];
+    len -= AIRPORT_MAXCODE;
+    if (len > PLANE_MAXID + 1)
+        len = PLANE_MAXID + 1;
+    memcpy(id, payload + AIRPORT_MAXCODE, len);
+    id[len] = '\0';
+
+    char catstr[2] = {arg, '\0'};
+    register_flight(plane, (code[0] == '\0') ? AIRPORT_DEFAULT : code, id,
+                    (arg == 0) ? NULL : catstr);
+}
+
+/************************************************************************
+ * binproto_command performs the frame of "len" bytes at "frame", as read
+ * by binproto_read.
+ */
+void binproto_command(airplane *plane, char *frame, ssize_t len) {
+    unsigned char *header = (unsigned char *)frame;
+    if ((len < BIN_HEADER) || (len != BIN_HEADER + ((header[0] << 8) | header[1])))
+        return;  // Cut short by a disconnect -- just ignore it
+
+    dispatching = plane;
+    if (admit_command(plane, admit_class_code(header[2]))) {
+        if (header[2] == BIN_REG)
+            bin_reg(plane, frame + BIN_HEADER, len - BIN_HEADER, header[3]);
+        else
+            docommand_code(plane, header[2]);
+    }
+    dispatching = NULL;
+
+    // Send the batch once all the input that has arrived is used up
+    char *unread;
+    if (stream_unread(plane->fp_recv, &unread) == 0) {
+        TRACE_BEGIN(writing);
+        fflush(plane->fp_send);
+        TRACE_END(writing, "write");
+    }
+}
+
+/************************************************************************
+ * binproto_send sends a frame with code "code", argument "arg" and "len"
+ * bytes of "payload" to "plane".
+ */
+void binproto_send(airplane *plane, int code, int arg, const void *payload, size_t len) {
+    if (len > BIN_MAXPAYLOAD)
+        len = BIN_MAXPAYLOAD;
+    unsigned char header[BIN_HEADER] = {len >> 8, len, code, arg};
+
+    flockfile(plane->fp_send);
+    fwrite_unlocked(header, 1, BIN_HEADER, plane->fp_send);
+    fwrite_unlocked(payload, 1, len, plane->fp_send);
+    if (dispatching != plane)
+        fflush_unlocked(plane->fp_send);
+    funlockfile(plane->fp_send);
+}
+
+/************************************************************************
+ * handle_get returns the handle for flight "id" on binary connection
+ * "plane", giving it a new one (and sending the NAME frame for it) if it
+ * doesn't have one yet.
+ */
+static int handle_get(airplane *plane, char *id) {
+    binconn *bc = plane->bin;
+    unsigned int bucket = handle_hash(id);
+    for (int h = bc->buckets[bucket]; h >= 0; h = bc->handles[h].next) {
+        if (strcmp(bc->handles[h].id, id) == 0)
+            return h;
+    }
+
+    if (bc->nhandles == bc->capacity) {
+        bc->capacity = (bc->capacity == 0) ? 64 : bc->capacity * 2;
+        bc->handles = realloc(bc->handles, bc->capacity * sizeof(handle_entry));
+        if (bc->handles == NULL) {
+            perror("handle_get");
+            exit(1);
+        }
+    }
+    int h = bc->nhandles++;
+    strcpy(bc->handles[h].id, id);
+    bc->handles[h].next = bc->buckets[bucket];
+    bc->buckets[bucket] = h;
+
+    size_t len = strlen(id);
+    unsigned char payload[4 + PLANE_MAXID] = {h >> 24, h >> 16, h >> 8, h};
+    memcpy(payload + 4, id, len);
+    binproto_send(plane, BIN_NAME, 0, payload, 4 + len);
+    return h;
+}
+
+/************************************************************************
+ * binproto_send_flights sends an OK frame listing the "count" flights in
+ * "ids", as handles.
+ */
+void binproto_send_flights(airplane *plane, char (*ids)[PLANE_MAXID+1], int count) {
+    binconn *bc = plane->bin;
+
+    // Handles are only reused between replies, never within one
+    if ((bc->nhandles > 0) && (bc->nhandles + count > BIN_HANDLES))
+        handles_reset(bc);
+
+    if (count > BIN_MAXPAYLOAD / 4)
+        count = BIN_MAXPAYLOAD / 4;
+    if (count > bc->payload_max) {
+        bc->payload = realloc(bc->payload, 4 * count + 1);
+        if (bc->payload == NULL) {
+            perror("binproto_send_flights");
+            exit(1);
+        }
+        bc->payload_max = count;
+    }
+    unsigned char *payload = bc->payload;
+    for (int i = 0; i < count; i++) {
+        int h = handle_get(plane, ids[i]);
+        payload[4*i] = h >> 24;
+        payload[4*i + 1] = h >> 16;
+        payload[4*i + 2] = h >> 8;
+        payload[4*i + 3] = h;
+    }
+    binproto_send(plane, BIN_OK, 0, payload, 4 * count);
+}
+
+/************************************************************************
+ * binproto_stats writes the binary protocol statistics (for the STATS
+ * command) as " name=value" pairs.
+ */
+void binproto_stats(FILE *out) {
+    fprintf(out, " binary=%d", __atomic_load_n(&nconns, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,63 @@
+// Frame layout and prototypes for the binary protocol module
+
+#ifndef _BINPROTO_H
+#define _BINPROTO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "airplane.h"
+
+// Every frame, in either direction, starts with this fixed header: the
+// payload length (big-endian), a code saying what the frame is, and one
+// byte of argument. The payload follows.
+
+#define BIN_HEADER 4
+#define BIN_MAXPAYLOAD 65535
+
+// Codes of frames sent by a client. REG has the wake category letter (or
+// 0 for the default) as its argument, and as its payload the airport code
+// padded with NULs to AIRPORT_MAXCODE bytes (all NULs for the default
+// airport) followed by the flight id. The others have no payload.
+
+#define BIN_REG 1
+#define BIN_REQTAXI 2
+#define BIN_REQPOS 3
+#define BIN_REQAHEAD 4
+#define BIN_INAIR 5
+#define BIN_STATS 6
+#define BIN_BYE 7
+#define BIN_REQETA 8
+
+// Codes of frames sent by the server. The payload of OK depends on the
+// request: the position (a big-endian 32-bit number) for REQPOS, the
+// milliseconds until the expected clearance (the same way) for REQETA, the
+// handles (32-bit numbers) of the flights ahead for REQAHEAD, the
+// "name=value" text for STATS, and nothing for the rest. ERR and NOTICE
+// carry their text. NAME gives the flight id (the rest of the payload) for
+// a handle (the first 4 bytes), before the first reply that uses it. A
+// handle's flight id only changes with another NAME.
+
+#define BIN_OK 0x80
+#define BIN_ERR 0x81
+#define BIN_TAKEOFF 0x82
+#define BIN_NOTICE 0x83
+#define BIN_NAME 0x84
+
+// Handles given out on each connection before they start being reused
+
+#define BIN_HANDLES 4096
+
+// Output buffer for each binary connection
+
+#define BIN_BUFSIZE 65536
+
+void binproto_start(airplane *plane);
+ssize_t binproto_read(airplane *plane, char **bufptr, size_t *size);
+void binproto_command(airplane *plane, char *frame, ssize_t len);
+void binproto_send(airplane *plane, int code, int arg, const void *payload, size_t len);
+void binproto_send_flights(airplane *plane, char (*ids)[PLANE_MAXID+1], int count);
+void binproto_close(airplane *plane);
+void binproto_stats(FILE *out);
+
+#endif  // _BINPROTO_H
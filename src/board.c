@@ -0,0 +1,144 @@
+// Module for the shared-memory departure board: a file that the server
+// keeps mapped and up to date with every airport's planes and taxi queue,
+// so that displays and dashboards on the same machine can map it too and
+// read the board without talking to the server at all.
+
+// The board has a fixed size, with one fixed-size section per airport.
+// Each section is a "seqlock": the one writer makes the section's sequence
+// number odd, changes the section, and makes it even again. A reader
+// copies the section out and checks that the sequence number was even and
+// didn't change while it was copying, and otherwise tries again. Readers
+// never block the writer or each other, and never make a system call.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+
+/************************************************************************
+ * board_create creates (or replaces) the board file at "path", maps it,
+ * and returns it empty, or returns NULL on failure. The new file is put
+ * in place with a rename, so whoever has the old one mapped (readers, or
+ * a server being replaced by a hot restart) keeps a valid mapping.
+ */
+board *board_create(char *path) {
+    char tmp_path[strlen(path) + 8];
+    sprintf(tmp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    fchmod(fd, 0644);
+    board *b = MAP_FAILED;
+    if ((ftruncate(fd, sizeof(board)) < 0) ||
+        ((b = mmap(NULL, sizeof(board), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+        perror("board_create");
+        close(fd);
+        unlink(tmp_path);
+        return NULL;
+    }
+    close(fd);
+
+    b->version = BOARD_VERSION;
+    b->size = sizeof(board);
+    b->nairports = 0;
+    __atomic_store_n(&b->magic, BOARD_MAGIC, __ATOMIC_RELEASE);
+    if (rename(tmp_path, path) < 0) {
+        perror(path);
+        munmap(b, sizeof(board));
+        unlink(tmp_path);
+        return NULL;
+    }
+    return b;
+}
+
+/************************************************************************
+ * board_attach maps the board file at "path" for reading, and returns it,
+ * or returns NULL if it can't (or it isn't a board this program knows).
+ */
+board *board_attach(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || (st.st_size != sizeof(board))) {
+        fprintf(stderr, "%s: not a departure board\n", path);
+        close(fd);
+        return NULL;
+    }
+    board *b = mmap(NULL, sizeof(board), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (b == MAP_FAILED) {
+        perror("board_attach mmap");
+        return NULL;
+    }
+    if ((__atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != BOARD_MAGIC) ||
+        (b->version != BOARD_VERSION) || (b->size != sizeof(board))) {
+        fprintf(stderr, "%s: not a departure board (or a different version)\n", path);
+        munmap(b, sizeof(board));
+        return NULL;
+    }
+    return b;
+}
+
+/************************************************************************
+ * board_write replaces section "index" of the board with "from" (except
+ * for the sequence number). There must only be one writer.
+ */
+void board_write(board *b, int index, board_airport *from) {
+    board_airport *to = &b->airports[index];
+    unsigned int seq = to->seq;
+    __atomic_store_n(&to->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t fixed = offsetof(board_airport, planes) - offsetof(board_airport, code);
+    memcpy(to->code, from->code, fixed);
+    int nplanes = (from->nplanes < BOARD_PLANES) ? from->nplanes : BOARD_PLANES;
+    int nqueued = (from->nqueued < BOARD_QUEUE) ? from->nqueued : BOARD_QUEUE;
+    memcpy(to->planes, from->planes, nplanes * sizeof(board_plane));
+    memcpy(to->queue, from->queue, nqueued * sizeof(board_plane));
+
+    __atomic_store_n(&to->seq, seq + 2, __ATOMIC_RELEASE);
+    if (index >= b->nairports)
+        __atomic_store_n(&b->nairports, index + 1, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * board_read copies a consistent snapshot of section "index" of the board
+ * into "to" (only the used part of its lists). Returns 0, or -1 if there
+ * is no such airport.
+ */
+int board_read(board *b, int index, board_airport *to) {
+    if ((index < 0) || (index >= __atomic_load_n(&b->nairports, __ATOMIC_ACQUIRE)))
+        return -1;
+
+    board_airport *from = &b->airports[index];
+    size_t fixed = offsetof(board_airport, planes) - offsetof(board_airport, code);
+    unsigned int seq;
+    do {
+        seq = __atomic_load_n(&from->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;  // Being written right now
+        memcpy(to->code, from->code, fixed);
+
+        // The counts may be torn if the writer got in, but then the
+        // sequence check below fails and this is all thrown away
+        int nplanes = (to->nplanes < 0) ? 0 : (to->nplanes < BOARD_PLANES) ? to->nplanes : BOARD_PLANES;
+        int nqueued = (to->nqueued < 0) ? 0 : (to->nqueued < BOARD_QUEUE) ? to->nqueued : BOARD_QUEUE;
+        memcpy(to->planes, from->planes, nplanes * sizeof(board_plane));
+        memcpy(to->queue, from->queue, nqueued * sizeof(board_plane));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&from->seq, __ATOMIC_RELAXED)));
+    to->seq = seq;
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Layout of the shared-memory departure board, and prototypes for the
+// functions that create, write and read it
+
+#ifndef _BOARD_H
+#define _BOARD_H
+
+#include "airplane.h"
+#include "airport.h"
+
+#define BOARD_MAGIC 0x42435441   // "ATCB"
+#define BOARD_VERSION 1
+
+// How many planes and queued flights are shown for each airport. The
+// counts are always the real ones, even when the lists are cut short.
+
+#define BOARD_PLANES 512
+#define BOARD_QUEUE 256
+
+typedef struct board_plane {
+    char id[PLANE_MAXID+1];
+    char category;          // Wake category letter
+    char state;             // PLANE_* state
+} board_plane;
+
+// One airport's part of the board. It is only valid to read while "seq"
+// is even and unchanged from before the read to after it (board_read does
+// this).
+
+typedef struct board_airport {
+    unsigned int seq;
+    char code[AIRPORT_MAXCODE+1];
+    char cleared;           // True if queue[0] holds the runway
+    char last_category;     // Wake category letter of last departure (or 0)
+    long long updated_ms;   // Server clock when this was written
+    long long last_departure_ms;
+    int nplanes;
+    int nqueued;
+    board_plane planes[BOARD_PLANES];
+    board_plane queue[BOARD_QUEUE];   // In takeoff order
+} board_airport;
+
+typedef struct board {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;      // Of the whole board, in bytes
+    int nairports;          // Airports 0..nairports-1 are in use
+    board_airport airports[AIRPORT_MAX];
+} board;
+
+board *board_create(char *path);
+board *board_attach(char *path);
+void board_write(board *b, int index, board_airport *from);
+int board_read(board *b, int index, board_airport *to);
+
+#endif  // _BOARD_H
@@ -0,0 +1,175 @@
+// Module for traffic capture, which records every command the server is
+// sent so that the traffic can be replayed later (see atc_replay.c).
+
+// With capture on, each connection's thread copies a command aside before
+// handling it, and once it has been handled writes a record of it to the
+// capture file: which connection sent it, when it arrived, how long the
+// server took over it, and its bytes (see capture.h). Connections are
+// numbered in the order they first send a command, and a record is also
+// written when one closes. Records go through a stdio buffer under a
+// lock, and a background thread writes the buffer out every
+// CAPTURE_FLUSH_MS so that a quiet server's file is still up to date.
+//
+// Capture is off unless capture_start is called (from the server's
+// command line), and then costs a copy and a short locked write for each
+// command.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "airplane.h"
+#include "topology.h"
+
+static FILE *capture_fp;          // NULL when capture is off
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long started_us;
+static unsigned int last_conn;    // The last connection number given out
+static long long captured;        // Records written
+
+// The command this thread is handling, copied by capture_begin
+
+static __thread char *command_copy;
+static __thread size_t copy_size;
+static __thread capture_record current;
+
+/************************************************************************
+ * now_us returns the time in microseconds (on a clock that only goes
+ * forward).
+ */
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/************************************************************************
+ * capture_flush writes out whatever has been captured.
+ */
+static void capture_flush() {
+    pthread_mutex_lock(&capture_lock);
+    fflush(capture_fp);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/************************************************************************
+ * flusher is the background thread that writes the capture out every
+ * CAPTURE_FLUSH_MS.
+ */
+static void *flusher(void *arg) {
+    while (1) {
+        usleep(CAPTURE_FLUSH_MS * 1000);
+        capture_flush();
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * capture_start starts capturing commands into a new file at "path".
+ * Returns 0, or -1 if the file can't be written.
+ */
+int capture_start(char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, fp) != 1) {
+        perror(path);
+        fclose(fp);
+        return -1;
+    }
+
+    started_us = now_us();
+    capture_fp = fp;
+    atexit(capture_flush);
+
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "capture", flusher, NULL);
+    pthread_detach(tid);
+    return 0;
+}
+
+/************************************************************************
+ * capture_begin notes that "plane" is about to handle "command" ("len"
+ * bytes, a line or a binary frame depending on the connection's
+ * protocol), before handling it can change it.
+ */
+void capture_begin(airplane *plane, char *command, ssize_t len) {
+    if (capture_fp == NULL)
+        return;
+
+    if (len > CAPTURE_MAXLEN)
+        len = CAPTURE_MAXLEN;  // Nobody sends commands this long
+    if ((size_t)len > copy_size) {
+        free(command_copy);
+        copy_size = (len < 256) ? 256 : len;
+        if ((command_copy = malloc(copy_size)) == NULL) {
+            perror("capture_begin");
+            exit(1);
+        }
+    }
+    memcpy(command_copy, command, len);
+    current.at_us = now_us();
+    current.kind_len = ((plane->bin != NULL) ? CAPTURE_BINARY : CAPTURE_TEXT) << 24 | len;
+}
+
+/************************************************************************
+ * write_record writes "rec" (filling in its connection number) and
+ * "len" bytes at "data" to the capture file.
+ */
+static void write_record(airplane *plane, capture_record *rec, char *data, size_t len) {
+    if (plane->capture_id == 0)
+        plane->capture_id = __atomic_add_fetch(&last_conn, 1, __ATOMIC_RELAXED);
+    rec->conn = plane->capture_id;
+
+    pthread_mutex_lock(&capture_lock);
+    fwrite(rec, sizeof(*rec), 1, capture_fp);
+    fwrite(data, 1, len, capture_fp);
+    captured++;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/************************************************************************
+ * capture_end writes the record of the command that "plane" has just
+ * handled (after capture_begin).
+ */
+void capture_end(airplane *plane) {
+    if (capture_fp == NULL)
+        return;
+
+    long long now = now_us();
+    current.took_us = now - current.at_us;
+    current.at_us -= started_us;
+    write_record(plane, &current, command_copy, CAPTURE_LEN(&current));
+}
+
+/************************************************************************
+ * capture_close records that the connection of "plane" has closed (if it
+ * ever sent a command), and frees this thread's copy of its commands.
+ * Must be called from the connection's own thread.
+ */
+void capture_close(airplane *plane) {
+    free(command_copy);
+    command_copy = NULL;
+    copy_size = 0;
+    if ((capture_fp == NULL) || (plane->capture_id == 0))
+        return;
+
+    capture_record rec = { .at_us = now_us() - started_us, .kind_len = CAPTURE_CLOSE << 24 };
+    write_record(plane, &rec, NULL, 0);
+}
+
+/************************************************************************
+ * capture_stats writes the capture statistics (for the STATS command) as
+ * " name=value" pairs.
+ */
+void capture_stats(FILE *out) {
+    pthread_mutex_lock(&capture_lock);
+    fprintf(out, " captured=%lld", captured);
+    pthread_mutex_unlock(&capture_lock);
+}
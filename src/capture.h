@@ -0,0 +1,50 @@
+// Record layout and prototypes for the traffic capture module
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A capture file starts with CAPTURE_MAGIC, followed by a record for each
+// command the server was sent: this header, then the "len" bytes of the
+// command exactly as they arrived. A connection's records are in the order
+// it sent the commands (records of different connections are interleaved
+// in the order the commands finished). Numbers are in the byte order of
+// the machine that wrote the file.
+
+#define CAPTURE_MAGIC "ATCCAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+
+// Kinds of record
+
+#define CAPTURE_TEXT 0      // A line of the text protocol (newline and all)
+#define CAPTURE_BINARY 1    // A binary protocol frame (header and payload)
+#define CAPTURE_CLOSE 2     // The connection closed (no bytes)
+
+typedef struct capture_record {
+    uint64_t at_us;         // When it arrived, from the start of the capture
+    uint32_t took_us;       // How long the server took to handle it
+    uint32_t conn;          // The connection it came on (numbered from 1)
+    uint32_t kind_len;      // The kind in the top 8 bits, the length below
+} capture_record;
+
+#define CAPTURE_KIND(rec) ((rec)->kind_len >> 24)
+#define CAPTURE_LEN(rec) ((rec)->kind_len & 0xffffff)
+#define CAPTURE_MAXLEN 0xffffff
+
+// How often what has been captured is written out (so a server that is
+// killed loses at most this much)
+
+#define CAPTURE_FLUSH_MS 1000
+
+struct airplane;
+
+int capture_start(char *path);
+void capture_begin(struct airplane *plane, char *command, ssize_t len);
+void capture_end(struct airplane *plane);
+void capture_close(struct airplane *plane);
+void capture_stats(FILE *out);
+
+#endif  // _CAPTURE_H
@@ -0,0 +1,164 @@
+// Chunked version of the arraylist, for lists that get big
+
+// alist keeps its items in one array, which it doubles with realloc when
+// it is full, while it holds the list's write lock. That can copy every
+// item (glibc avoids the copy for big arrays by remapping their pages,
+// but not other allocators, or arrays too small to be mapped on their
+// own), and either way moves them, so no pointer into the array stays
+// good. This keeps them in chunks of CLIST_CHUNK items instead. A full
+// list gets one more chunk, and only the directory of chunks (one pointer
+// per CLIST_CHUNK items) is ever copied. Chunks are kept when the list
+// shrinks, to be used again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "clist.h"
+
+/***************************************************************************
+ * clist_grow adds a chunk to the list, growing the directory if it is
+ * full. Must be called with the list's write lock held.
+ */
+static void clist_grow(clist *c) {
+    if (c->nchunks == c->dir_size) {
+        void ***newdir = realloc(c->chunks, 2 * c->dir_size * sizeof(void **));
+        if (newdir == NULL) {
+            perror("clist_add - growing directory");
+            exit(1);
+        }
+        c->chunks = newdir;
+        c->dir_size = 2 * c->dir_size;
+    }
+    if ((c->chunks[c->nchunks] = malloc(CLIST_CHUNK * sizeof(void *))) == NULL) {
+        perror("clist_add - adding chunk");
+        exit(1);
+    }
+    c->nchunks++;
+}
+
+/***************************************************************************
+ * clist_init initializes a chunked list to empty, with no chunks yet.
+ */
+void clist_init(clist *c, void (*data_free)(void *data)) {
+    if ((c->chunks = malloc(CLIST_DIR_START * sizeof(void **))) == NULL) {
+        perror("clist_init");
+        exit(1);
+    }
+
+    pthread_rwlock_init(&(c->lock), NULL);
+    c->nchunks = 0;
+    c->dir_size = CLIST_DIR_START;
+    c->in_use = 0;
+    c->dfree = data_free;
+}
+
+/***************************************************************************
+ * clist_clear resets the size of the list to 0 (keeping its chunks).
+ */
+void clist_clear(clist *c) {
+    pthread_rwlock_wrlock(&(c->lock));
+    for (int i = 0; i < c->in_use; i++)
+        c->dfree(*clist_at(c, i));
+
+    c->in_use = 0;
+    pthread_rwlock_unlock(&(c->lock));
+}
+
+/***************************************************************************
+ * clist_is_empty returns true if and only if the list is empty.
+ */
+int clist_is_empty(clist *c) {
+    return (c->in_use == 0);
+}
+
+/***************************************************************************
+ * clist_size returns the size of the list
+ */
+int clist_size(clist *c) {
+    return c->in_use;
+}
+
+/***************************************************************************
+ * clist_get returns the value at index "index", or NULL if this is an
+ * invalid index.
+ */
+void *clist_get(clist *c, int index) {
+    pthread_rwlock_rdlock(&(c->lock));
+    if ((index < 0) || (index >= c->in_use)) {
+        pthread_rwlock_unlock(&(c->lock));
+        return NULL;
+    }
+
+    void *retval = *clist_at(c, index);
+    pthread_rwlock_unlock(&(c->lock));
+    return retval;
+}
+
+/***************************************************************************
+ * clist_add appends a new value to the end of the list.
+ */
+void clist_add(clist *c, void *val) {
+    pthread_rwlock_wrlock(&(c->lock));
+    if (c->in_use == c->nchunks * CLIST_CHUNK)
+        clist_grow(c);
+
+    *clist_at(c, c->in_use++) = val;
+    pthread_rwlock_unlock(&(c->lock));
+}
+
+/***************************************************************************
+ * clist_set sets the index "index" item to value "val". If the
+ * index/position doesn't exist in the list, then nothing happens (the
+ * request is ignored).
+ */
+void clist_set(clist *c, int index, void *val) {
+    pthread_rwlock_wrlock(&(c->lock));
+    if ((index < 0) || (index >= c->in_use)) {
+        pthread_rwlock_unlock(&(c->lock));
+        return;
+    }
+
+    void **slot = clist_at(c, index);
+    c->dfree(*slot);
+    *slot = val;
+    pthread_rwlock_unlock(&(c->lock));
+}
+
+/***************************************************************************
+ * clist_remove takes the element at index "index" out of the list
+ * (decreasing list size by 1), moving the ones after it down. If the
+ * index/position doesn't exist in the list, then nothing happens.
+ */
+void clist_remove(clist *c, int index) {
+    pthread_rwlock_wrlock(&(c->lock));
+    if ((index < 0) || (index >= c->in_use)) {
+        pthread_rwlock_unlock(&(c->lock));
+        return;
+    }
+
+    c->dfree(*clist_at(c, index));
+    for (int i = index; i < c->in_use - 1; i++)
+        *clist_at(c, i) = *clist_at(c, i + 1);
+
+    c->in_use--;
+    pthread_rwlock_unlock(&(c->lock));
+}
+
+/***************************************************************************
+ * clist_destroy destroys the list, freeing up all memory and resources.
+ */
+void clist_destroy(clist *c) {
+    pthread_rwlock_wrlock(&(c->lock));
+    for (int i = 0; i < c->in_use; i++)
+        c->dfree(*clist_at(c, i));
+
+    for (int i = 0; i < c->nchunks; i++)
+        free(c->chunks[i]);
+    free(c->chunks);
+    c->chunks = NULL;
+    c->nchunks = 0;
+    c->dir_size = 0;
+    c->in_use = 0;
+    pthread_rwlock_unlock(&(c->lock));
+}
@@ -0,0 +1,51 @@
+#ifndef _CLIST_H
+#define _CLIST_H
+
+#include <pthread.h>
+
+// The chunked list type. It has the same functions as alist (with "clist"
+// in place of "alist"), but keeps its items in fixed-size chunks instead
+// of one array, so growing it never moves the items: it just adds a
+// chunk. The address of an item's slot (see clist_at) stays the same
+// until the list shrinks past it, and indexing is still one shift and one
+// mask.
+
+#define CLIST_CHUNK_BITS 10
+#define CLIST_CHUNK (1 << CLIST_CHUNK_BITS)   // Items in each chunk
+
+// Chunk pointers the directory starts with (it doubles when full, which
+// only copies the pointers to the chunks)
+
+#define CLIST_DIR_START 16
+
+typedef struct {
+    void ***chunks;   // Directory of chunks, CLIST_CHUNK items each
+    int nchunks;      // Chunks allocated
+    int dir_size;     // Size of the directory
+    int in_use;       // How many items are in use (items 0..in_use-1)
+    void (*dfree)(void *data); // Data destructor/freer
+    pthread_rwlock_t lock;
+} clist;
+
+/***************************************************************************
+ * clist_at returns the address of the slot for item "index", which must
+ * be less than in_use. This is for code that indexes the list directly
+ * under a lock of its own (the way alist's "data" array gets used).
+ */
+static inline void **clist_at(clist *c, int index) {
+    return &c->chunks[index >> CLIST_CHUNK_BITS][index & (CLIST_CHUNK - 1)];
+}
+
+// Function prototypes
+
+void clist_init(clist *c, void (*data_free)(void *data));
+void clist_clear(clist *c);
+int clist_is_empty(clist *c);
+int clist_size(clist *c);
+void *clist_get(clist *c, int index);
+void clist_add(clist *c, void *val);
+void clist_set(clist *c, int index, void *newval);
+void clist_remove(clist *c, int index);
+void clist_destroy(clist *c);
+
+#endif // _CLIST_H
@@ -0,0 +1,104 @@
+// Module for the connection table, which has a slot for every connection
+// the server is serving.
+
+// A connection's session (the airplane it was accepted as, or taken over
+// as in a hot restart) takes a slot when it is accepted (or when its
+// thread starts, if it was taken over) and gives it back when the thread
+// is done, so the table always holds exactly the connections being
+// served, and a cap on connections (see admit.c) is never overshot. Free
+// slots are kept on a list, so taking and giving one back take constant
+// time, and the number in use is kept atomically so STATS can read it
+// without the table's lock. Where the session's plane is in its airport's
+// registry and taxi queue is kept in the plane itself (see airplane.h),
+// which is what lets it leave both without searching.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "conntab.h"
+
+static pthread_mutex_t conntab_lock = PTHREAD_MUTEX_INITIALIZER;
+static airplane **slots;        // The session in each slot (NULL if free)
+static int *next_free;          // The free slot after each free slot
+static int nslots;
+static int first_free = -1;     // -1 when every slot is taken
+static int nconns;              // Slots in use
+
+/************************************************************************
+ * conntab_grow doubles the number of slots, putting the new ones on the
+ * free list. Must be called with conntab_lock held.
+ */
+static void conntab_grow() {
+    int size = (nslots == 0) ? CONNTAB_START : nslots * 2;
+    slots = realloc(slots, size * sizeof(airplane *));
+    next_free = realloc(next_free, size * sizeof(int));
+    if ((slots == NULL) || (next_free == NULL)) {
+        perror("conntab_grow");
+        exit(1);
+    }
+    for (int i = size - 1; i >= nslots; i--) {
+        slots[i] = NULL;
+        next_free[i] = first_free;
+        first_free = i;
+    }
+    nslots = size;
+}
+
+/************************************************************************
+ * conntab_open gives the session "plane" a slot, and returns it (it is
+ * also kept in plane->conn_slot).
+ */
+int conntab_open(airplane *plane) {
+    pthread_mutex_lock(&conntab_lock);
+    if (first_free < 0)
+        conntab_grow();
+    int slot = first_free;
+    first_free = next_free[slot];
+    slots[slot] = plane;
+    plane->conn_slot = slot;
+    __atomic_add_fetch(&nconns, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&conntab_lock);
+    return slot;
+}
+
+/************************************************************************
+ * conntab_close gives back the slot of session "plane" (if it has one).
+ */
+void conntab_close(airplane *plane) {
+    int slot = plane->conn_slot;
+    if (slot < 0)
+        return;
+    pthread_mutex_lock(&conntab_lock);
+    slots[slot] = NULL;
+    next_free[slot] = first_free;
+    first_free = slot;
+    plane->conn_slot = -1;
+    __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&conntab_lock);
+}
+
+/************************************************************************
+ * conntab_count returns the number of connections being served.
+ */
+int conntab_count() {
+    return __atomic_load_n(&nconns, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * conntab_get returns the session in "slot", or NULL if it is free.
+ */
+airplane *conntab_get(int slot) {
+    pthread_mutex_lock(&conntab_lock);
+    airplane *plane = ((slot >= 0) && (slot < nslots)) ? slots[slot] : NULL;
+    pthread_mutex_unlock(&conntab_lock);
+    return plane;
+}
+
+/************************************************************************
+ * conntab_stats writes the connection statistics (for the STATS command)
+ * as " name=value" pairs.
+ */
+void conntab_stats(FILE *out) {
+    fprintf(out, " connections=%d", conntab_count());
+}
@@ -0,0 +1,20 @@
+// Prototypes for the connection table
+
+#ifndef _CONNTAB_H
+#define _CONNTAB_H
+
+#include <stdio.h>
+
+#include "airplane.h"
+
+// Slots the table starts with (it doubles when they are all taken)
+
+#define CONNTAB_START 64
+
+int conntab_open(airplane *plane);
+void conntab_close(airplane *plane);
+int conntab_count();
+airplane *conntab_get(int slot);
+void conntab_stats(FILE *out);
+
+#endif  // _CONNTAB_H
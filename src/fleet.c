@@ -0,0 +1,344 @@
+// Module for fleet connections, which carry many flights over one socket.
+
+// A connection that sends "FLEET" (before registering) becomes a fleet
+// connection. From then on every line it sends starts with a channel
+// name, and the rest of the line is an ordinary command for that channel:
+//
+//    ua12 REG KORD ua12 H
+//    ua12 REQTAXI
+//
+// Every channel is a separate airplane, going through the same command
+// handlers as a plane on its own connection, and everything the server
+// sends a channel (replies and TAKEOFF alike) comes back on the fleet
+// connection with the channel name in front:
+//
+//    ua12 OK
+//    ua12 TAKEOFF
+//
+// A channel is opened by its first command (up to FLEET_MAXCHANNELS of
+// them), and closed when its plane is done (BYE or INAIR) or the
+// connection closes. Replies to the commands in one batch of input are
+// collected and sent together, once the connection has no more input
+// waiting, so a fleet sending many commands at once costs a few system
+// calls instead of one per command.
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fleet.h"
+#include "airs_protocol.h"
+#include "airport.h"
+#include "util.h"
+#include "wake.h"
+
+// One flight on a fleet connection. Its plane's fp_send is a stream that
+// writes to the fleet connection (see channel_write).
+
+typedef struct channel {
+    char name[FLEET_MAXCHANNEL+1];
+    airplane *plane;
+    struct fleet *fleet;
+    struct channel *next;   // Next in the same bucket
+    char *partial;          // Start of a reply line not finished yet
+    size_t partial_len;
+} channel;
+
+typedef struct fleet {
+    FILE *out;                  // Everything sent on the connection
+    pthread_mutex_t send_lock;  // Protects "out"
+    channel *buckets[FLEET_BUCKETS];
+    int nchannels;
+} fleet;
+
+// The fleet whose commands this thread is running right now, if any.
+// Replies to those wait for the end of the batch; anything else (like a
+// runway clearing a flight) is sent straight away.
+
+static __thread fleet *dispatching;
+
+static int nfleets;
+static int nchannels;
+
+/************************************************************************
+ * channel_hash returns the bucket for channel name "name".
+ */
+static unsigned int channel_hash(char *name) {
+    unsigned int hash = 2166136261u;
+    for (char *cp = name; *cp != '\0'; cp++)
+        hash = (hash ^ (unsigned char)*cp) * 16777619u;
+    return hash % FLEET_BUCKETS;
+}
+
+/************************************************************************
+ * channel_write is the write function for a channel's fp_send. It sends
+ * each complete line on the fleet connection, with the channel name in
+ * front, and keeps any incomplete line until the rest comes.
+ */
+static ssize_t channel_write(void *cookie, const char *buf, size_t size) {
+    channel *ch = cookie;
+    fleet *f = ch->fleet;
+    const char *end = buf + size;
+
+    pthread_mutex_lock(&f->send_lock);
+    while (buf < end) {
+        const char *nl = memchr(buf, '\n', end - buf);
+        if (nl == NULL) {
+            ch->partial = realloc(ch->partial, ch->partial_len + (end - buf));
+            if (ch->partial == NULL) {
+                perror("channel_write");
+                exit(1);
+            }
+            memcpy(ch->partial + ch->partial_len, buf, end - buf);
+            ch->partial_len += end - buf;
+            break;
+        }
+        fputs(ch->name, f->out);
+        putc(' ', f->out);
+        if (ch->partial_len > 0) {
+            fwrite(ch->partial, 1, ch->partial_len, f->out);
+            ch->partial_len = 0;
+        }
+        fwrite(buf, 1, nl + 1 - buf, f->out);
+        buf = nl + 1;
+    }
+    if (dispatching != f)
+        fflush(f->out);
+    pthread_mutex_unlock(&f->send_lock);
+    return size;
+}
+
+/************************************************************************
+ * channel_close is the close function for a channel's fp_send, and frees
+ * the channel.
+ */
+static int channel_close(void *cookie) {
+    channel *ch = cookie;
+    free(ch->partial);
+    free(ch);
+    return 0;
+}
+
+/************************************************************************
+ * channel_find returns the channel called "name" on fleet "f", or NULL if
+ * there isn't one.
+ */
+static channel *channel_find(fleet *f, char *name) {
+    channel *ch = f->buckets[channel_hash(name)];
+    while ((ch != NULL) && (strcmp(ch->name, name) != 0))
+        ch = ch->next;
+    return ch;
+}
+
+/************************************************************************
+ * channel_open opens channel "name" on fleet connection "conn", with an
+ * unregistered plane.
+ */
+static channel *channel_open(airplane *conn, char *name) {
+    fleet *f = conn->fleet;
+    channel *ch = calloc(1, sizeof(channel));
+    airplane *plane = malloc(sizeof(airplane));
+    if ((ch == NULL) || (plane == NULL)) {
+        perror("channel_open");
+        exit(1);
+    }
+    strcpy(ch->name, name);
+    ch->fleet = f;
+    ch->plane = plane;
+
+    cookie_io_functions_t funcs = {NULL, channel_write, NULL, channel_close};
+    FILE *fp = fopencookie(ch, "w", funcs);
+    if (fp == NULL) {
+        perror("channel_open fopencookie");
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOLBF, 0);
+    airplane_init(plane, fp, NULL);
+    plane->tid = conn->tid;
+    plane->fleet_conn = conn;
+
+    unsigned int bucket = channel_hash(name);
+    ch->next = f->buckets[bucket];
+    f->buckets[bucket] = ch;
+    f->nchannels++;
+    __atomic_add_fetch(&nchannels, 1, __ATOMIC_RELAXED);
+    return ch;
+}
+
+/************************************************************************
+ * channel_remove closes channel "ch" of fleet "f": its plane leaves its
+ * airport and is freed, along with the channel.
+ */
+static void channel_remove(fleet *f, channel *ch) {
+    channel **link = &f->buckets[channel_hash(ch->name)];
+    while (*link != ch)
+        link = &(*link)->next;
+    *link = ch->next;
+    f->nchannels--;
+    __atomic_sub_fetch(&nchannels, 1, __ATOMIC_RELAXED);
+    airport_leave(ch->plane);
+}
+
+/************************************************************************
+ * valid_channel returns true if "name" can be used as a channel name.
+ */
+static int valid_channel(char *name) {
+    if (strlen(name) > FLEET_MAXCHANNEL)
+        return 0;
+    for (char *cp = name; *cp != '\0'; cp++) {
+        if (!isalnum(*cp))
+            return 0;
+    }
+    return 1;
+}
+
+/************************************************************************
+ * fleet_send sends a line (formatted like printf) on fleet "f".
+ */
+static void fleet_send(fleet *f, char *fmt, char *arg) {
+    pthread_mutex_lock(&f->send_lock);
+    fprintf(f->out, fmt, arg);
+    pthread_mutex_unlock(&f->send_lock);
+}
+
+/************************************************************************
+ * fleet_start makes "conn" (which has just been sent "OK" to its FLEET
+ * command) a fleet connection.
+ */
+void fleet_start(airplane *conn) {
+    fleet *f = calloc(1, sizeof(fleet));
+    int fd = dup(fileno(conn->fp_send));
+    if ((f == NULL) || (fd < 0) || ((f->out = fdopen(fd, "w")) == NULL)) {
+        perror("fleet_start");
+        exit(1);
+    }
+    setvbuf(f->out, NULL, _IOFBF, FLEET_BUFSIZE);
+    pthread_mutex_init(&f->send_lock, NULL);
+    conn->fleet = f;
+    conn->state = PLANE_FLEET;
+    __atomic_add_fetch(&nfleets, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * fleet_command runs a line of input "line" from fleet connection "conn":
+ * a channel name followed by a command for that channel.
+ */
+void fleet_command(airplane *conn, char *line) {
+    fleet *f = conn->fleet;
+    char *saveptr;
+    char *name = strtok_r(line, " \t\r\n", &saveptr);
+    if (name == NULL)  // Empty line -- just ignore it
+        return;
+    char *command = strtok_r(NULL, "\r\n", &saveptr);
+
+    channel *ch = NULL;
+    if (!valid_channel(name)) {
+        fleet_send(f, "ERR Invalid channel %s\n", name);
+    } else if (command != NULL) {
+        ch = channel_find(f, name);
+        if ((ch == NULL) && (f->nchannels >= FLEET_MAXCHANNELS))
+            fleet_send(f, "%s ERR Too many channels\n", name);
+        else if (ch == NULL)
+            ch = channel_open(conn, name);
+    }
+
+    if (ch != NULL) {
+        // A channel is a plane -- it can't become a fleet or an observer,
+        // or switch protocols
+        size_t len = strcspn(command, " \t");
+        if (((len == 5) && (strncmp(command, "FLEET", 5) == 0)) ||
+            ((len == 7) && (strncmp(command, "OBSERVE", 7) == 0)) ||
+            ((len == 6) && (strncmp(command, "BINARY", 6) == 0))) {
+            send_err(ch->plane, "Not available on a channel");
+        } else {
+            dispatching = f;
+            docommand(ch->plane, command);
+            dispatching = NULL;
+        }
+        if (ch->plane->state == PLANE_DONE)
+            channel_remove(f, ch);
+    }
+
+    // Send the batch once all the input that has arrived is used up
+    char *unread;
+    if (stream_unread(conn->fp_recv, &unread) == 0) {
+        pthread_mutex_lock(&f->send_lock);
+        fflush(f->out);
+        pthread_mutex_unlock(&f->send_lock);
+    }
+}
+
+/************************************************************************
+ * fleet_close closes every channel of fleet connection "conn", which is
+ * disconnecting.
+ */
+void fleet_close(airplane *conn) {
+    fleet *f = conn->fleet;
+    if (f == NULL)
+        return;
+    for (int i = 0; i < FLEET_BUCKETS; i++) {
+        while (f->buckets[i] != NULL)
+            channel_remove(f, f->buckets[i]);
+    }
+    fclose(f->out);
+    pthread_mutex_destroy(&f->send_lock);
+    free(f);
+    conn->fleet = NULL;
+    __atomic_sub_fetch(&nfleets, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * fleet_save sends anything waiting to go out on fleet connection "conn",
+ * and writes its channels to "out", one "name airport flightid" line each
+ * ("-" for the airport and flight id of a channel that isn't registered).
+ * This is for handing the connection to another server.
+ */
+void fleet_save(airplane *conn, FILE *out) {
+    fleet *f = conn->fleet;
+    pthread_mutex_lock(&f->send_lock);
+    fflush(f->out);
+    pthread_mutex_unlock(&f->send_lock);
+
+    for (int i = 0; i < FLEET_BUCKETS; i++) {
+        for (channel *ch = f->buckets[i]; ch != NULL; ch = ch->next) {
+            airplane *plane = ch->plane;
+            if (plane->airport == NULL)
+                fprintf(out, "%s - -\n", ch->name);
+            else
+                fprintf(out, "%s %s %s\n", ch->name, plane->airport->code, plane->id);
+        }
+    }
+}
+
+/************************************************************************
+ * fleet_restore opens a channel on fleet connection "conn" from a line
+ * written by fleet_save, taking over the plane with that flight id if it
+ * was registered.
+ */
+void fleet_restore(airplane *conn, char *line) {
+    char name[FLEET_MAXCHANNEL+1];
+    char code[AIRPORT_MAXCODE+1];
+    char id[PLANE_MAXID+1];
+    if ((sscanf(line, "%20s %4s %20s", name, code, id) != 3) || !valid_channel(name) ||
+        (channel_find(conn->fleet, name) != NULL) ||
+        (conn->fleet->nchannels >= FLEET_MAXCHANNELS))
+        return;
+
+    channel *ch = channel_open(conn, name);
+    airport *ap = (strcmp(code, "-") == 0) ? NULL : airport_get(code);
+    if (ap != NULL)
+        airport_register(ap, ch->plane, id, WAKE_DEFAULT);
+}
+
+/************************************************************************
+ * fleet_stats writes the fleet statistics (for the STATS command) as
+ * " name=value" pairs.
+ */
+void fleet_stats(FILE *out) {
+    fprintf(out, " fleets=%d channels=%d", __atomic_load_n(&nfleets, __ATOMIC_RELAXED),
+            __atomic_load_n(&nchannels, __ATOMIC_RELAXED));
+}
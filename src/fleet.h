@@ -0,0 +1,35 @@
+// Prototypes for the fleet connection module
+
+#ifndef _FLEET_H
+#define _FLEET_H
+
+#include <stdio.h>
+
+#include "airplane.h"
+
+// Channel names are like flight ids: alphanumeric, at most this long
+
+#define FLEET_MAXCHANNEL PLANE_MAXID
+
+// Buckets in each fleet connection's table of channels
+
+#define FLEET_BUCKETS 4096
+
+// Channels a fleet connection can have open at once. A command that
+// would open another is answered "ERR Too many channels".
+
+#define FLEET_MAXCHANNELS 4096
+
+// Output buffer for each fleet connection. Replies are collected here
+// and sent when the connection has no more input waiting.
+
+#define FLEET_BUFSIZE 65536
+
+void fleet_start(airplane *conn);
+void fleet_command(airplane *conn, char *line);
+void fleet_close(airplane *conn);
+void fleet_save(airplane *conn, FILE *out);
+void fleet_restore(airplane *conn, char *line);
+void fleet_stats(FILE *out);
+
+#endif  // _FLEET_H
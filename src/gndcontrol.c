@@ -13,141 +13,323 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 
+#include "admit.h"
 #include "airplane.h"
 #include "airs_protocol.h"
-#include "airplanelist.h"
-#include "queue.h"
-
-struct global_state {
-        int clients_connected;
-} global_state;
-
-int create_listener(char *service) {
-    int sock_fd;
-    if ((sock_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        return -1;
-    }
-
-    // Avoid time delay in reusing port - important for debugging, but
-    // probably not used in a production server.
-
-    int optval = 1;
-    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
-
-    // First, use getaddrinfo() to fill in address struct for later bind
-
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = 0;
-
-    struct addrinfo *result;
-    int rval;
-    if ((rval=getaddrinfo(NULL, service, &hints, &result)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
-        close(sock_fd);
-        return -1;
-    }
-
-    // Assign a name/addr to the socket - just blindly grabs first result
-    // off linked list, but really should be exactly one struct returned.
-
-    int bret = bind(sock_fd, result->ai_addr, result->ai_addrlen);
-    freeaddrinfo(result);
-    result = NULL;  // Not really necessary, but ensures no use-after-free
-
-    if (bret < 0) {
-        perror("bind");
-        close(sock_fd);
-        return -1;
-    }
-
-    // Finally, set up listener connection queue
-    int lret = listen(sock_fd, 128);
-    if (lret < 0) {
-        perror("listen");
-        close(sock_fd);
-        return -1;
-    }
-
-    return sock_fd;
-}
+#include "airport.h"
+#include "allocs.h"
+#include "binproto.h"
+#include "capture.h"
+#include "conntab.h"
+#include "fleet.h"
+#include "handoff.h"
+#include "logger.h"
+#include "net.h"
+#include "observe.h"
+#include "prealloc.h"
+#include "publish.h"
+#include "repl.h"
+#include "topology.h"
+#include "trace.h"
 
 void* handle_conn(void* arg) {
     airplane* myplane = (airplane*) arg;
-    airplanelist_add(myplane);
 
     pthread_detach(myplane->tid);
+    if (myplane->conn_slot < 0)
+        conntab_open(myplane);  // Taken over in a hot restart
 
+    // A preallocated session has a line buffer ready
     char* lineptr = NULL;
     size_t linesize = 0;
+    if (myplane->session != NULL) {
+        lineptr = myplane->session->line;
+        linesize = myplane->session->line_size;
+    }
 
-
-    while (myplane->state != PLANE_DONE) {
-        if (getline(&lineptr, &linesize, myplane->fp_recv) < 0) {
+    TRACE_NAME("airplane");
+    while (1) {
+        ssize_t len;
+        TRACE_BEGIN(reading);
+        if (myplane->bin != NULL)
+            len = binproto_read(myplane, &lineptr, &linesize);
+        else
+            len = getline(&lineptr, &linesize, myplane->fp_recv);
+        TRACE_END(reading, "read");
+        if (!handoff_begin(myplane, len < 0 ? NULL : lineptr, len)) {
+            continue;  // Interrupted by a hot restart that didn't happen
+        }
+        if (len < 0) {
             // Failed getline means the client disconnected
             break;
         }
-        docommand(myplane, lineptr);
+        TRACE_BEGIN(command);
+        capture_begin(myplane, lineptr, len);
+        ALLOCS_BEGIN();
+        if (myplane->bin != NULL)
+            binproto_command(myplane, lineptr, len);
+        else
+            docommand(myplane, lineptr);
+        ALLOCS_END();
+        capture_end(myplane);
+        TRACE_END(command, "command");
+        if (myplane->state == PLANE_DONE) {
+            break;
+        }
+        handoff_end();
     }
-    free(lineptr);
-    if (airplane_exist(myplane->id) == 1) {
-        airplanelist_remove(myplane);
+    if (myplane->session != NULL) {
+        myplane->session->line = lineptr;  // getline may have made a new one
+        myplane->session->line_size = linesize;
+    } else {
+        free(lineptr);
     }
-    if (queue_exist(myplane->id) == 1) {
-        queue_remove(myplane->id);
+    handoff_forget(myplane);
+    observe_remove(myplane);
+    fleet_close(myplane);
+    binproto_close(myplane);
+    capture_close(myplane);
+    conntab_close(myplane);
+    airport_leave(myplane);
+    handoff_end();
+    return NULL;
+}
+
+/************************************************************************
+ * serve accepts airplanes on the "nlisteners" listening sockets in
+ * "listen_fds" (skipping any that are -1), starting a thread for each one,
+ * until a socket fails. The calling thread becomes an I/O thread.
+ */
+static void serve(int *listen_fds, int nlisteners) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    int comm_fd;
+
+    topology_join(TOPO_IO, NULL);
+
+    struct pollfd pfds[nlisteners];
+    for (int i = 0; i < nlisteners; i++) {
+        pfds[i].fd = listen_fds[i];
+        pfds[i].events = POLLIN;
     }
-    
-    
-    global_state.clients_connected--;
-    if (global_state.clients_connected == 0) {
-        airplanelist_clear();
-        queue_clear();
+
+    while (1) {
+        comm_fd = -1;
+        if (poll(pfds, nlisteners, -1) > 0) {
+            for (int i = 0; (i < nlisteners) && (comm_fd < 0); i++) {
+                if (pfds[i].revents != 0) {
+                    client_addr_len = sizeof(client_addr);
+                    comm_fd = accept(pfds[i].fd, (struct sockaddr *)&client_addr, &client_addr_len);
+                }
+            }
+        }
+        if (comm_fd < 0) {
+            if (errno == EINTR) {
+                handoff_pause();
+                continue;
+            }
+            break;
+        }
+        if (admit_full()) {
+            admit_reject(comm_fd);
+            continue;
+        }
+        airplane* new_plane = airplane_create(comm_fd);
+        if (new_plane == NULL) {
+            continue;
+        }
+
+        conntab_open(new_plane);
+        handoff_track(new_plane);
+        int err = topology_create(&new_plane->tid, TOPO_IO, -1, NULL, handle_conn, new_plane);
+        if (err != 0) {
+            LOG(LOG_WARN, "Can't start a thread for a connection: %s", strerror(err));
+            handoff_forget(new_plane);
+            conntab_close(new_plane);
+            airport_leave(new_plane);
+            continue;
+        }
+
+        LOG(LOG_INFO, "Got connection from %s (client %ld)",
+            (client_addr.ss_family == AF_UNIX) ? "local socket" :
+            inet_ntoa(((struct sockaddr_in *)&client_addr)->sin_addr),
+            new_plane->tid);
     }
-    return NULL;
+    airports_destroy();
+}
+
+/************************************************************************
+ * open_listeners opens the TCP listener on "port" and (if "local_path"
+ * isn't NULL) the local one at "local_path" into "listen_fds", unless
+ * they are already open (after a hot restart). Returns 0, or -1 on
+ * failure.
+ */
+static int open_listeners(int *listen_fds, char *port, char *local_path) {
+    if (listen_fds[0] < 0)
+        listen_fds[0] = create_listener(port);
+    if ((local_path != NULL) && (listen_fds[1] < 0))
+        listen_fds[1] = create_local_listener(local_path);
+    return ((listen_fds[0] < 0) || ((local_path != NULL) && (listen_fds[1] < 0))) ? -1 : 0;
 }
 
 /************************************************************************
- * Part 1 main: Only 1 airplane, doing I/O via stdin and stdout.
+ * usage prints the command line options and exits.
+ */
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-p port] [-L path] [-R repl_port] [-S primary_host:repl_port] [-U path] [-B path]\n"
+            "       [-l level] [-T prefix] [-C max] [-r class=rate[:burst]]... [-g class=rate[:burst]]...\n"
+            "       [-c path] [-P planes[:depth]] [-t role=cpus[:priority[:stack_kb]]]...\n",
+            progname);
+    fprintf(stderr, "  -p port   serve airplanes on this port (default 8080)\n");
+    fprintf(stderr, "  -L path   also serve airplanes on the same machine on Unix socket path\n");
+    fprintf(stderr, "            (where they can also use shared-memory rings)\n");
+    fprintf(stderr, "  -R port   act as a primary, streaming changes to standbys on this port\n");
+    fprintf(stderr, "  -S addr   act as a standby of the primary at addr, and take over\n");
+    fprintf(stderr, "            (serving on -p port) when it goes away\n");
+    fprintf(stderr, "  -U path   hot restart: take over from the server at Unix socket path\n");
+    fprintf(stderr, "            (if there is one), and let a new server take over from this\n");
+    fprintf(stderr, "            one the same way (not with -R or -S)\n");
+    fprintf(stderr, "  -B path   publish the departure board in shared memory file path\n");
+    fprintf(stderr, "  -l level  log messages at this level and above: debug, info (the\n");
+    fprintf(stderr, "            default), warn, error or off\n");
+    fprintf(stderr, "  -T prefix on SIGUSR1, write the trace to prefix-pid-n.json (with the\n");
+    fprintf(stderr, "            trace points built in by \"make TRACE=1\")\n");
+    fprintf(stderr, "  -C max    serve at most max connections, answering any more with\n");
+    fprintf(stderr, "            \"ERR BUSY\" and closing them\n");
+    fprintf(stderr, "  -r class=rate[:burst]\n");
+    fprintf(stderr, "            limit each connection to rate commands a second of class\n");
+    fprintf(stderr, "            query, update or other, with bursts of up to burst (twice\n");
+    fprintf(stderr, "            rate by default), answering the rest with \"ERR BUSY\"\n");
+    fprintf(stderr, "  -g class=rate[:burst]\n");
+    fprintf(stderr, "            the same, for all the connections together\n");
+    fprintf(stderr, "  -c path   capture every command the server is sent into file path,\n");
+    fprintf(stderr, "            for atc_replay\n");
+    fprintf(stderr, "  -P planes[:depth]\n");
+    fprintf(stderr, "            make sessions for that many connections, and room for that\n");
+    fprintf(stderr, "            many planes in every airport, up front and locked in memory,\n");
+    fprintf(stderr, "            with room for REQAHEAD replies of up to depth flights\n");
+    fprintf(stderr, "            (default %d)\n", PREALLOC_DEPTH);
+    fprintf(stderr, "  -t role=cpus[:priority[:stack_kb]]\n");
+    fprintf(stderr, "            run the threads of role io (connections), runway or\n");
+    fprintf(stderr, "            background on CPUs cpus (like 0-3,6; runway threads are\n");
+    fprintf(stderr, "            pinned one to a CPU, in turn), with SCHED_FIFO priority\n");
+    fprintf(stderr, "            priority (0 for normal) and stacks of stack_kb KB\n");
+    exit(1);
+}
+
+/************************************************************************
+ * main sets up the airports and the network listener, and then starts a
+ * thread for every airplane that connects.
  */
 int main(int argc, char *argv[]) {
+    char *port = "8080";
+    char *repl_port = NULL;
+    char *primary_addr = NULL;
+    char *handoff_path = NULL;
+    char *board_path = NULL;
+    char *local_path = NULL;
+    char *trace_prefix = "gndcontrol-trace";
+    char *capture_path = NULL;
+    char *prealloc_spec = NULL;
 
-    int sock_fd = create_listener("8080");
-    if (sock_fd < 0) {
-        fprintf(stderr, "Server setup failed.\n");
-        exit(1);
+    int opt;
+    while ((opt = getopt(argc, argv, "p:L:R:S:U:B:l:T:C:r:g:c:P:t:")) != -1) {
+        switch (opt) {
+        case 'p': port = optarg; break;
+        case 'L': local_path = optarg; break;
+        case 'R': repl_port = optarg; break;
+        case 'S': primary_addr = optarg; break;
+        case 'U': handoff_path = optarg; break;
+        case 'B': board_path = optarg; break;
+        case 'l':
+            if ((log_level = logger_parse_level(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'T': trace_prefix = optarg; break;
+        case 'C': admit_set_max_conns(atoi(optarg)); break;
+        case 'r':
+        case 'g':
+            if (admit_set_limit(opt == 'g', optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'c': capture_path = optarg; break;
+        case 'P': prealloc_spec = optarg; break;
+        case 't':
+            if (topology_set(optarg) < 0)
+                usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
     }
+    if ((optind < argc) || ((handoff_path != NULL) && ((repl_port != NULL) || (primary_addr != NULL))))
+        usage(argv[0]);
 
+    // A client that goes away shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    trace_start(trace_prefix);  // Before any other thread starts
+    logger_start(stdout);
+    if ((capture_path != NULL) && (capture_start(capture_path) < 0)) {
+        fprintf(stderr, "Capture setup failed.\n");
+        exit(1);
+    }
+    if ((prealloc_spec != NULL) && (prealloc_start(prealloc_spec) < 0))
+        usage(argv[0]);
+    TRACE_NAME("accept");
 
-    airplanelist_init(free);
-    queue_init(free);
+    // A standby builds up its state without runways, and only starts them
+    // (and listens for airplanes) once it takes over. A hot restart takes
+    // over the state and connections of the running server (if any)
+    // before any runway starts.
+    airports_init((primary_addr == NULL) && (handoff_path == NULL));
+    if ((board_path != NULL) && (publish_start(board_path) < 0)) {
+        fprintf(stderr, "Departure board setup failed.\n");
+        exit(1);
+    }
 
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int comm_fd;
+    // The TCP listener, and the local one if there is one
+    int listen_fds[2] = {-1, -1};
+    int nlisteners = (local_path != NULL) ? 2 : 1;
 
+    if (handoff_path != NULL) {
+        handoff_receive(handoff_path, handle_conn, listen_fds, nlisteners);
+        if (open_listeners(listen_fds, port, local_path) < 0) {
+            fprintf(stderr, "Server setup failed.\n");
+            exit(1);
+        }
+        if (handoff_listen(handoff_path, listen_fds, nlisteners) < 0) {
+            fprintf(stderr, "Hot restart setup failed.\n");
+            exit(1);
+        }
+        airports_start_runways();
+        serve(listen_fds, nlisteners);
+        return 0;
+    }
 
-    
-    while ((comm_fd = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len)) >= 0) {
-        if (comm_fd == -1) continue;
-        airplane* new_plane = airplane_create(comm_fd);
+    if (primary_addr != NULL) {
+        char *colon = strrchr(primary_addr, ':');
+        if (colon == NULL)
+            usage(argv[0]);
+        *colon = '\0';
+        repl_standby(primary_addr, colon + 1);
+    }
 
-        pthread_create(&new_plane->tid, NULL, handle_conn, new_plane);
-        
+    if ((repl_port != NULL) && (repl_start_primary(repl_port) < 0)) {
+        fprintf(stderr, "Replication setup failed.\n");
+        exit(1);
+    }
 
-        printf("Got connection from %s (client %ld)\n", 
-            inet_ntoa(((struct sockaddr_in *)&client_addr)->sin_addr), 
-            new_plane->tid);
-        global_state.clients_connected++;
+    if (open_listeners(listen_fds, port, local_path) < 0) {
+        fprintf(stderr, "Server setup failed.\n");
+        exit(1);
     }
-    airplanelist_destroy();
-    queue_destroy();
+
+    serve(listen_fds, nlisteners);
     return 0;
 }
@@ -0,0 +1,872 @@
+// Module for hot restarts: handing a running server over to a new process
+// (usually a new version of the program) without dropping any airplanes.
+
+// A server started with "-U path" listens for a new server on the Unix
+// socket "path". A new server started with the same "-U path" connects to
+// it, and the old server:
+//
+//   1. waits for the commands in progress to finish, and then stops every
+//      client thread (and the accept loop) before it acts on anything else
+//      it reads, keeping whatever was read but not acted on;
+//   2. holds every runway, so no more flights are cleared;
+//   3. sends the listening sockets, a snapshot of all airports (in the
+//      replication log format), and every airplane's socket along with
+//      its airport, flight id and unread input;
+//   4. exits once the new server says it has everything.
+//
+// The new server rebuilds the airports from the snapshot, gives every
+// socket a thread again, and then carries on serving on the same listeners,
+// so airplanes never notice. If anything goes wrong before the new server
+// has everything, the old server lets its threads and runways carry on.
+//
+// Messages go over a SOCK_SEQPACKET socket, so each one arrives whole,
+// with the descriptors (if any) that were sent with it. The first byte
+// says what the message is:
+//
+//    U                       new server asking to take over
+//    L      (+ descriptor)   a listening socket (TCP first, then local)
+//    S data                  next piece of the snapshot
+//    P data                  next piece of the following airplane's input
+//    F data                  next piece of the following fleet's channels
+//    C airport flightid [bs]  (+ descriptors)
+//                            an airplane ("-" for both if unregistered,
+//                            "+" and what it observes for an observer, or
+//                            "= -" for a fleet connection), with "b" if it
+//                            uses the binary protocol and "s" if it uses
+//                            shared-memory rings (whose descriptors come
+//                            after the socket's)
+//    E                       end of the state
+//    D                       new server has everything (the old one exits)
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "handoff.h"
+#include "airport.h"
+#include "alist.h"
+#include "binproto.h"
+#include "fleet.h"
+#include "logger.h"
+#include "observe.h"
+#include "repl.h"
+#include "shmring.h"
+#include "topology.h"
+#include "util.h"
+#include "wake.h"
+
+// Input that was read from an airplane's socket but not yet acted on. A
+// stream made with pending_open returns this before reading the socket.
+
+typedef struct pending_stream {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t pos;
+} pending_stream;
+
+// What the hot restart needs to know about each connected airplane
+
+typedef struct client {
+    airplane *plane;
+    int parked;               // Stopped for a hot restart
+    char *pending;            // Read but not acted on (while parked)
+    size_t pending_len;
+    pending_stream *stream;   // The plane's input, if made by pending_open
+} client;
+
+static int enabled;           // True once this server can be handed over
+static alist clients;
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_changed = PTHREAD_COND_INITIALIZER;
+static int handing_off;       // True while stopping threads to hand over
+static int active;            // Threads acting on something they read
+static int main_parked;       // Accept loop stopped for the hand over
+static pthread_t main_tid;
+static int listener_fds[HANDOFF_MAXLISTENERS];
+static int nlisteners;
+static int control_fd;
+
+/************************************************************************
+ * pending_read, pending_close and pending_open make a stream that reads
+ * "len" bytes from "buf" (which it frees when closed) before reading from
+ * socket "fd".
+ */
+static ssize_t pending_read(void *cookie, char *buf, size_t size) {
+    pending_stream *ps = cookie;
+    if (ps->pos < ps->len) {
+        size_t n = ps->len - ps->pos;
+        if (n > size)
+            n = size;
+        memcpy(buf, ps->buf + ps->pos, n);
+        ps->pos += n;
+        return n;
+    }
+    return read(ps->fd, buf, size);
+}
+
+static int pending_close(void *cookie) {
+    pending_stream *ps = cookie;
+    int result = close(ps->fd);
+    free(ps->buf);
+    free(ps);
+    return result;
+}
+
+static FILE *pending_open(int fd, char *buf, size_t len, pending_stream **stream) {
+    pending_stream *ps = malloc(sizeof(pending_stream));
+    if (ps == NULL) {
+        perror("pending_open");
+        exit(1);
+    }
+    ps->fd = fd;
+    ps->buf = buf;
+    ps->len = len;
+    ps->pos = 0;
+
+    cookie_io_functions_t funcs = {pending_read, NULL, NULL, pending_close};
+    FILE *fp = fopencookie(ps, "r", funcs);
+    if (fp == NULL) {
+        perror("pending_open fopencookie");
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOLBF, 0);
+    *stream = ps;
+    return fp;
+}
+
+/************************************************************************
+ * client_free frees a client record (for the clients list).
+ */
+static void client_free(void *data) {
+    client *c = data;
+    free(c->pending);
+    free(c);
+}
+
+/************************************************************************
+ * client_index returns the position of "plane" in the clients list (-1 if
+ * it isn't tracked), and client_find returns its record (or NULL). Must
+ * be called with handoff_lock held.
+ */
+static int client_index(airplane *plane) {
+    for (int i = 0; i < clients.in_use; i++) {
+        if (((client *)clients.data[i])->plane == plane)
+            return i;
+    }
+    return -1;
+}
+
+static client *client_find(airplane *plane) {
+    int index = client_index(plane);
+    return (index < 0) ? NULL : clients.data[index];
+}
+
+/************************************************************************
+ * client_save adds the "len" bytes at "data" to what client "c" has read
+ * but not acted on.
+ */
+static void client_save(client *c, char *data, size_t len) {
+    if (len == 0)
+        return;
+    c->pending = realloc(c->pending, c->pending_len + len);
+    if (c->pending == NULL) {
+        perror("client_save");
+        exit(1);
+    }
+    memcpy(c->pending + c->pending_len, data, len);
+    c->pending_len += len;
+}
+
+/************************************************************************
+ * client_save_input saves everything client "c" has read but not acted
+ * on: "len" bytes of "line" (if len > 0), then what is still in its input
+ * stream's buffer, then what its pending stream (or ring connection)
+ * hasn't handed out yet.
+ */
+static void client_save_input(client *c, char *line, ssize_t len) {
+    FILE *fp = c->plane->fp_recv;
+    if (len > 0)
+        client_save(c, line, len);
+    char *unread;
+    size_t unread_len = stream_unread(fp, &unread);
+    client_save(c, unread, unread_len);
+    if (c->stream != NULL)
+        client_save(c, c->stream->buf + c->stream->pos, c->stream->len - c->stream->pos);
+    if (c->plane->shm != NULL) {
+        char *data;
+        size_t rest = shmring_pending(c->plane, &data);
+        client_save(c, data, rest);
+    }
+    clearerr(fp);
+}
+
+/************************************************************************
+ * client_reopen gives client "c" a new input stream that starts with the
+ * input it saved, after a hot restart that didn't happen.
+ */
+static void client_reopen(client *c) {
+    if (c->pending_len == 0)
+        return;
+    airplane *plane = c->plane;
+    if (plane->shm != NULL) {
+        shmring_reopen(plane, c->pending, c->pending_len);
+        c->pending = NULL;
+        c->pending_len = 0;
+        return;
+    }
+    int fd = dup((c->stream != NULL) ? c->stream->fd : fileno(plane->fp_recv));
+    if (fd < 0) {
+        perror("client_reopen dup");
+        exit(1);
+    }
+    fclose(plane->fp_recv);
+    plane->fp_recv = pending_open(fd, c->pending, c->pending_len, &c->stream);
+    c->pending = NULL;
+    c->pending_len = 0;
+}
+
+/************************************************************************
+ * handoff_wakeup is the handler for the signal that interrupts threads
+ * blocked reading, so they can stop for a hot restart.
+ */
+static void handoff_wakeup(int sig) {
+}
+
+/************************************************************************
+ * handoff_init gets the module ready to track airplanes.
+ */
+static void handoff_init() {
+    if (enabled)
+        return;
+    alist_init(&clients, client_free);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handoff_wakeup;   // No SA_RESTART, so reads are interrupted
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    enabled = 1;
+}
+
+/************************************************************************
+ * handoff_track starts tracking a newly connected airplane, before its
+ * thread is started.
+ */
+void handoff_track(airplane *plane) {
+    if (!enabled)
+        return;
+    client *c = calloc(1, sizeof(client));
+    if (c == NULL) {
+        perror("handoff_track");
+        exit(1);
+    }
+    c->plane = plane;
+    pthread_mutex_lock(&handoff_lock);
+    alist_add(&clients, c);
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * handoff_forget stops tracking an airplane that is disconnecting. Must
+ * be called between handoff_begin and handoff_end.
+ */
+void handoff_forget(airplane *plane) {
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&handoff_lock);
+    alist_remove(&clients, client_index(plane));
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * handoff_begin is called by an airplane's thread after every getline
+ * (with what it returned), before acting on it. Normally it returns 1,
+ * and the thread must call handoff_end once it is done acting on the
+ * line (or on the disconnect). If a hot restart is underway, the thread
+ * stops here and keeps what it read for the new server. If the hot
+ * restart then fails (or the read was interrupted for nothing), the
+ * input is put back and it returns 0, and the thread should read again.
+ */
+int handoff_begin(airplane *plane, char *line, ssize_t len) {
+    if (!enabled)
+        return 1;
+    int interrupted = ferror(plane->fp_recv) && (errno == EINTR);
+
+    pthread_mutex_lock(&handoff_lock);
+    if (!handing_off && !interrupted) {
+        active++;
+        pthread_mutex_unlock(&handoff_lock);
+        return 1;
+    }
+
+    client *c = client_find(plane);
+    client_save_input(c, line, len);
+    if (handing_off) {
+        c->parked = 1;
+        pthread_cond_broadcast(&handoff_changed);
+        while (handing_off)
+            pthread_cond_wait(&handoff_changed, &handoff_lock);
+        c->parked = 0;
+    }
+    client_reopen(c);
+    pthread_mutex_unlock(&handoff_lock);
+    return 0;
+}
+
+/************************************************************************
+ * handoff_end is called when a thread is done acting on what it read.
+ */
+void handoff_end() {
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&handoff_lock);
+    active--;
+    if (active == 0)
+        pthread_cond_broadcast(&handoff_changed);
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * handoff_pause is called by the accept loop when accept is interrupted,
+ * and stops it for as long as a hot restart is underway.
+ */
+void handoff_pause() {
+    pthread_mutex_lock(&handoff_lock);
+    if (handing_off) {
+        main_parked = 1;
+        pthread_cond_broadcast(&handoff_changed);
+        while (handing_off)
+            pthread_cond_wait(&handoff_changed, &handoff_lock);
+        main_parked = 0;
+    }
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * send_msg sends a message of type "type" with "len" bytes of "data" and
+ * the "npass" descriptors in "pass_fds". Returns 0, or -1 on failure.
+ */
+static int send_msg(int fd, char type, char *data, size_t len, int *pass_fds, int npass) {
+    struct iovec iov[2] = {{&type, 1}, {data, len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+    } control;
+    if (npass > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(npass * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(npass * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), pass_fds, npass * sizeof(int));
+    }
+    return (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+/************************************************************************
+ * send_chunks sends "len" bytes of "data" as messages of type "type", at
+ * most HANDOFF_CHUNK bytes at a time.
+ */
+static int send_chunks(int fd, char type, char *data, size_t len) {
+    for (size_t off = 0; off < len; off += HANDOFF_CHUNK) {
+        size_t n = (len - off < HANDOFF_CHUNK) ? len - off : HANDOFF_CHUNK;
+        if (send_msg(fd, type, data + off, n, NULL, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/************************************************************************
+ * recv_msg receives one message (of at most "size" bytes) into "buf", and
+ * the descriptors sent with it into "pass_fds" (which has room for
+ * HANDOFF_MAXFDS, and is filled out with -1). Returns the message length,
+ * or -1 on failure or end of file.
+ */
+static ssize_t recv_msg(int fd, char *buf, size_t size, int *pass_fds) {
+    struct iovec iov = {buf, size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+    } control;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    for (int i = 0; i < HANDOFF_MAXFDS; i++)
+        pass_fds[i] = -1;
+    ssize_t len = recvmsg(fd, &msg, 0);
+    if (len <= 0)
+        return -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(pass_fds, CMSG_DATA(cmsg), ((n < HANDOFF_MAXFDS) ? n : HANDOFF_MAXFDS) * sizeof(int));
+        }
+    }
+    return len;
+}
+
+/************************************************************************
+ * handoff_quiesce stops every airplane thread and the accept loop, once
+ * nothing is acting on what it read.
+ */
+static void handoff_quiesce() {
+    pthread_mutex_lock(&handoff_lock);
+    handing_off = 1;
+    while (active > 0)
+        pthread_cond_wait(&handoff_changed, &handoff_lock);
+
+    // Threads blocked reading are interrupted with a signal. A thread can
+    // miss the signal just before it starts reading, so keep at it. The
+    // accept loop goes first, so every thread it started is tracked.
+    while (1) {
+        int waiting = 0;
+        if (!main_parked) {
+            pthread_kill(main_tid, SIGUSR2);
+            waiting = 1;
+        } else {
+            for (int i = 0; i < clients.in_use; i++) {
+                client *c = clients.data[i];
+                if (!c->parked) {
+                    pthread_kill(c->plane->tid, SIGUSR2);
+                    waiting = 1;
+                }
+            }
+        }
+        if (!waiting)
+            break;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&handoff_changed, &handoff_lock, &deadline);
+    }
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * handoff_resume lets everything carry on after a failed hot restart.
+ */
+static void handoff_resume() {
+    pthread_mutex_lock(&handoff_lock);
+    handing_off = 0;
+    pthread_cond_broadcast(&handoff_changed);
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/************************************************************************
+ * handoff_send sends everything to the new server on "fd", and waits for
+ * it to say it has it all. Returns 0, or -1 on failure.
+ */
+static int handoff_send(int fd) {
+    for (int i = 0; i < nlisteners; i++) {
+        if (send_msg(fd, 'L', NULL, 0, &listener_fds[i], 1) < 0)
+            return -1;
+    }
+
+    char *snap;
+    size_t snap_len;
+    FILE *mem = open_memstream(&snap, &snap_len);
+    repl_snapshot(mem);
+    fclose(mem);
+    int result = send_chunks(fd, 'S', snap, snap_len);
+    free(snap);
+    if (result < 0)
+        return -1;
+
+    for (int i = 0; i < clients.in_use; i++) {
+        client *c = clients.data[i];
+        airplane *plane = c->plane;
+        fflush(plane->fp_send);
+        if (send_chunks(fd, 'P', c->pending, c->pending_len) < 0)
+            return -1;
+
+        char header[AIRPORT_MAXCODE + PLANE_MAXID + 6];
+        if (plane->state == PLANE_FLEET) {
+            char *channels;
+            size_t channels_len;
+            FILE *mem = open_memstream(&channels, &channels_len);
+            fleet_save(plane, mem);
+            fclose(mem);
+            result = send_chunks(fd, 'F', channels, channels_len);
+            free(channels);
+            if (result < 0)
+                return -1;
+            strcpy(header, "= -");
+        } else if (plane->state == PLANE_OBSERVER) {
+            observe_finish(plane);
+            strcpy(header, "+ ");
+            observe_filter(plane, header + 2);
+        } else if (plane->airport == NULL)
+            strcpy(header, "- -");
+        else
+            sprintf(header, "%s %s", plane->airport->code, plane->id);
+        if ((plane->bin != NULL) || (plane->shm != NULL))
+            strcat(header, " ");
+        if (plane->bin != NULL)
+            strcat(header, "b");
+        if (plane->shm != NULL)
+            strcat(header, "s");
+
+        int fds[HANDOFF_MAXFDS];
+        int nfds = 1;
+        if (plane->shm != NULL)
+            nfds = shmring_fds(plane, fds);
+        else
+            fds[0] = fileno(plane->fp_send);
+        if (send_msg(fd, 'C', header, strlen(header), fds, nfds) < 0)
+            return -1;
+    }
+
+    if (send_msg(fd, 'E', NULL, 0, NULL, 0) < 0)
+        return -1;
+    char reply;
+    int pass_fds[HANDOFF_MAXFDS];
+    if ((recv_msg(fd, &reply, 1, pass_fds) != 1) || (reply != 'D'))
+        return -1;
+    return 0;
+}
+
+/************************************************************************
+ * handoff_serve is the thread waiting for a new server to hand over to.
+ */
+static void *handoff_serve(void *arg) {
+    while (1) {
+        int fd = accept(control_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        char hello;
+        int pass_fds[HANDOFF_MAXFDS];
+        if ((recv_msg(fd, &hello, 1, pass_fds) != 1) || (hello != 'U')) {
+            close(fd);
+            continue;
+        }
+
+        LOG(LOG_INFO, "Handing over to a new server");
+        handoff_quiesce();
+        for (int i = 0; i < airports_count(); i++)
+            queue_hold(&airports_get(i)->queue, 1);
+
+        pthread_mutex_lock(&handoff_lock);
+        int result = handoff_send(fd);
+        int count = clients.in_use;
+        pthread_mutex_unlock(&handoff_lock);
+
+        if (result == 0) {
+            LOG(LOG_INFO, "Handed over %d connections -- exiting", count);
+            logger_flush();
+            _exit(0);
+        }
+
+        LOG(LOG_WARN, "Hot restart failed -- carrying on");
+        for (int i = 0; i < airports_count(); i++)
+            queue_hold(&airports_get(i)->queue, 0);
+        handoff_resume();
+        close(fd);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * control_address fills in the address of the Unix socket at "path".
+ * Returns 0, or -1 if the path is too long.
+ */
+static int control_address(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/************************************************************************
+ * handoff_listen lets this server be handed over to a new one that
+ * connects to "path", passing on the "nfds" listening sockets in
+ * "listen_fds" (at most HANDOFF_MAXLISTENERS). It must be called from the
+ * thread running the accept loop. Returns 0, or -1 on failure.
+ */
+int handoff_listen(char *path, int *listen_fds, int nfds) {
+    struct sockaddr_un addr;
+    if (control_address(&addr, path) < 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("handoff socket");
+        return -1;
+    }
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0)) {
+        perror("handoff bind");
+        close(fd);
+        return -1;
+    }
+
+    handoff_init();
+    control_fd = fd;
+    memcpy(listener_fds, listen_fds, nfds * sizeof(int));
+    nlisteners = nfds;
+    main_tid = pthread_self();
+
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "handoff", handoff_serve, NULL);
+    pthread_detach(tid);
+    return 0;
+}
+
+// An airplane received from the old server
+
+typedef struct incoming {
+    int fd;
+    int ring_fds[SHM_NFDS];   // A ring connection's descriptors (or -1)
+    char header[AIRPORT_MAXCODE + PLANE_MAXID + 6];
+    char *pending;
+    size_t pending_len;
+    char *channels;         // A fleet's channels (from fleet_save)
+    size_t channels_len;
+} incoming;
+
+/************************************************************************
+ * incoming_free closes and frees an airplane that never got started.
+ */
+static void incoming_free(void *data) {
+    incoming *in = data;
+    if (in->fd >= 0)
+        close(in->fd);
+    for (int i = 0; i < SHM_NFDS; i++) {
+        if (in->ring_fds[i] >= 0)
+            close(in->ring_fds[i]);
+    }
+    free(in->pending);
+    free(in->channels);
+    free(in);
+}
+
+/************************************************************************
+ * append adds "len" bytes at "data" to the buffer "*buf" of "*buf_len"
+ * bytes.
+ */
+static void append(char **buf, size_t *buf_len, char *data, size_t len) {
+    *buf = realloc(*buf, *buf_len + len);
+    if (*buf == NULL) {
+        perror("handoff_receive");
+        exit(1);
+    }
+    memcpy(*buf + *buf_len, data, len);
+    *buf_len += len;
+}
+
+/************************************************************************
+ * handoff_start gives an airplane received from the old server its thread
+ * again, running "serve".
+ */
+static void handoff_start(incoming *in, void *(*serve)(void *)) {
+    airplane *plane = airplane_create(in->fd);
+    if (plane == NULL)
+        return;
+    in->fd = -1;
+
+    client *c = calloc(1, sizeof(client));
+    if (c == NULL) {
+        perror("handoff_start");
+        exit(1);
+    }
+    c->plane = plane;
+
+    char code[AIRPORT_MAXCODE+1];
+    char id[PLANE_MAXID+1];
+    char mode[3] = "";
+    sscanf(in->header, "%4s %20s %2s", code, id, mode);
+    if (strchr(mode, 's') != NULL) {
+        shmring_attach(plane, in->ring_fds, in->pending, in->pending_len);
+        for (int i = 0; i < SHM_NFDS; i++)
+            in->ring_fds[i] = -1;
+        in->pending = NULL;
+    } else if (in->pending_len > 0) {
+        int fd = dup(fileno(plane->fp_recv));
+        if (fd < 0) {
+            perror("handoff_start dup");
+            exit(1);
+        }
+        fclose(plane->fp_recv);
+        plane->fp_recv = pending_open(fd, in->pending, in->pending_len, &c->stream);
+        in->pending = NULL;
+    }
+
+    if (strchr(mode, 'b') != NULL)
+        binproto_start(plane);
+    if ((sscanf(in->header, "%4s %20s", code, id) == 2) && (strcmp(code, "=") == 0)) {
+        fleet_start(plane);
+        append(&in->channels, &in->channels_len, "", 1);
+        char *saveptr;
+        for (char *line = strtok_r(in->channels, "\n", &saveptr); line != NULL;
+             line = strtok_r(NULL, "\n", &saveptr))
+            fleet_restore(plane, line);
+    } else if ((sscanf(in->header, "%4s %20s", code, id) == 2) && (strcmp(code, "+") == 0)) {
+        if (strcmp(id, "*") != 0)
+            airport_get(id);  // It was open on the other server
+        plane->state = PLANE_OBSERVER;
+        observe_add(plane, id);
+    } else if ((sscanf(in->header, "%4s %20s", code, id) == 2) && (strcmp(code, "-") != 0)) {
+        airport *ap = airport_get(code);
+        if (ap != NULL)
+            airport_register(ap, plane, id, WAKE_DEFAULT);
+    }
+
+    pthread_mutex_lock(&handoff_lock);
+    alist_add(&clients, c);
+    pthread_mutex_unlock(&handoff_lock);
+    topology_create(&plane->tid, TOPO_IO, -1, NULL, serve, plane);
+}
+
+/************************************************************************
+ * handoff_receive takes over from the server listening for a hot restart
+ * at "path", if there is one: it rebuilds that server's airports (which
+ * must have been set up without runways) and restarts each of its
+ * airplanes with a thread running "serve". The listening sockets it was
+ * handed go into "listen_fds", in order, up to "nfds" of them (the rest
+ * are left alone). Returns 0, or -1 if there is no server to take over
+ * from (or it couldn't hand over, in which case it carries on).
+ */
+int handoff_receive(char *path, void *(*serve)(void *), int *listen_fds, int nfds) {
+    struct sockaddr_un addr;
+    if (control_address(&addr, path) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0)
+        return -1;
+    if ((connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (send_msg(fd, 'U', NULL, 0, NULL, 0) < 0)) {
+        close(fd);
+        return -1;
+    }
+    handoff_init();
+
+    char *buf = malloc(HANDOFF_CHUNK + 1);
+    char *snap;
+    size_t snap_len;
+    FILE *mem = open_memstream(&snap, &snap_len);
+    if ((buf == NULL) || (mem == NULL)) {
+        perror("handoff_receive");
+        exit(1);
+    }
+
+    alist planes;
+    alist_init(&planes, incoming_free);
+    incoming *in = NULL;
+    int received[HANDOFF_MAXLISTENERS];
+    int nreceived = 0;
+    int done = 0;
+    ssize_t len;
+    int pass_fds[HANDOFF_MAXFDS];
+    while (!done && ((len = recv_msg(fd, buf, HANDOFF_CHUNK + 1, pass_fds)) > 0)) {
+        if (in == NULL) {
+            in = calloc(1, sizeof(incoming));
+            if (in == NULL) {
+                perror("handoff_receive");
+                exit(1);
+            }
+            in->fd = -1;
+            for (int i = 0; i < SHM_NFDS; i++)
+                in->ring_fds[i] = -1;
+        }
+        switch (buf[0]) {
+        case 'L':
+            if ((pass_fds[0] >= 0) && (nreceived < HANDOFF_MAXLISTENERS)) {
+                received[nreceived++] = pass_fds[0];
+                pass_fds[0] = -1;
+            }
+            break;
+        case 'S':
+            fwrite(buf + 1, 1, len - 1, mem);
+            break;
+        case 'P':
+            append(&in->pending, &in->pending_len, buf + 1, len - 1);
+            break;
+        case 'F':
+            append(&in->channels, &in->channels_len, buf + 1, len - 1);
+            break;
+        case 'C':
+            if (len - 1 >= sizeof(in->header))
+                len = sizeof(in->header);
+            memcpy(in->header, buf + 1, len - 1);
+            in->fd = pass_fds[0];
+            pass_fds[0] = -1;
+            if (pass_fds[1] >= 0) {
+                memcpy(in->ring_fds, pass_fds + 1, sizeof(in->ring_fds));
+                for (int i = 1; i <= SHM_NFDS; i++)
+                    pass_fds[i] = -1;
+            }
+            alist_add(&planes, in);
+            in = NULL;
+            break;
+        case 'E':
+            done = (nreceived > 0) && (send_msg(fd, 'D', NULL, 0, NULL, 0) == 0);
+            break;
+        }
+        for (int i = 0; i < HANDOFF_MAXFDS; i++) {
+            if (pass_fds[i] >= 0)
+                close(pass_fds[i]);
+        }
+    }
+    close(fd);
+    free(buf);
+    fclose(mem);
+    if (in != NULL)
+        incoming_free(in);
+
+    if (!done) {
+        fprintf(stderr, "Hot restart from %s failed\n", path);
+        for (int i = 0; i < nreceived; i++)
+            close(received[i]);
+        alist_destroy(&planes);
+        free(snap);
+        return -1;
+    }
+
+    char *saveptr;
+    for (char *line = strtok_r(snap, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+        repl_apply(line);
+    free(snap);
+
+    for (int i = 0; i < planes.in_use; i++)
+        handoff_start(planes.data[i], serve);
+    LOG(LOG_INFO, "Took over %d connections from the old server", planes.in_use);
+    alist_destroy(&planes);
+
+    for (int i = 0; i < nreceived; i++) {
+        if (i < nfds)
+            listen_fds[i] = received[i];
+        else
+            close(received[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+// Prototypes for the hot restart module
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <sys/types.h>
+
+#include "airplane.h"
+
+// The largest piece of state sent in one message between the old and new
+// server.
+
+#define HANDOFF_CHUNK 32768
+
+// The most listening sockets handed over, and the most descriptors sent
+// with one message (a ring connection's socket and its SHM_NFDS others).
+
+#define HANDOFF_MAXLISTENERS 2
+#define HANDOFF_MAXFDS 6
+
+int handoff_receive(char *path, void *(*serve)(void *), int *listen_fds, int nfds);
+int handoff_listen(char *path, int *listen_fds, int nfds);
+void handoff_track(airplane *plane);
+void handoff_forget(airplane *plane);
+int handoff_begin(airplane *plane, char *line, ssize_t len);
+void handoff_end();
+void handoff_pause();
+
+#endif  // _HANDOFF_H
@@ -0,0 +1,143 @@
+// Benchmark for the chunked list, against the plain arraylist.
+
+// This adds a large number of items to an alist and to a clist (ten
+// million by default), timing every add. It reports the average add, and
+// separately the adds that had to grow the list (the alist's realloc, or
+// the clist's new chunk), which happen with the write lock held: their
+// total and the longest of them. It then times reading every item back,
+// both through the locked get functions and by indexing directly (alist's
+// data array against clist_at), and checks that the clist's slots stayed
+// where they were as it grew.
+//
+// Usage: list_bench [-n items]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alist.h"
+#include "clist.h"
+
+/************************************************************************
+ * now_ns returns the current time in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/************************************************************************
+ * no_free is the items' destructor (they are just numbers).
+ */
+static void no_free(void *data) {
+}
+
+// Add times, for one list
+
+typedef struct add_times {
+    long long total;
+    long grows;              // Adds that grew the list
+    long long grow_total;
+    long long grow_worst;
+} add_times;
+
+/************************************************************************
+ * count_add adds an add that took "took" ns (and grew the list if "grew")
+ * to "times".
+ */
+static void count_add(add_times *times, long long took, int grew) {
+    times->total += took;
+    if (grew) {
+        times->grows++;
+        times->grow_total += took;
+        if (took > times->grow_worst)
+            times->grow_worst = took;
+    }
+}
+
+/************************************************************************
+ * report_adds prints the add times for list "name".
+ */
+static void report_adds(char *name, long n, add_times *times) {
+    printf("%s add:  %5.1f ns each; %5ld grows, %8.1f us in all, longest %7.1f us\n",
+           name, (double)times->total / n, times->grows, times->grow_total / 1000.0,
+           times->grow_worst / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    long n = 10000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': n = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n items]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (n < 1) {
+        fprintf(stderr, "%s: need at least one item\n", argv[0]);
+        exit(1);
+    }
+    printf("%ld items\n", n);
+
+    alist a;
+    clist c;
+    alist_init(&a, no_free);
+    clist_init(&c, no_free);
+
+    add_times times = { 0 };
+    for (long i = 0; i < n; i++) {
+        int grew = (a.in_use == a.capacity);
+        long long start = now_ns();
+        alist_add(&a, (void *)i);
+        count_add(&times, now_ns() - start, grew);
+    }
+    report_adds("alist", n, &times);
+
+    add_times ctimes = { 0 };
+    void **first = NULL;
+    for (long i = 0; i < n; i++) {
+        int grew = (c.in_use == c.nchunks * CLIST_CHUNK);
+        long long start = now_ns();
+        clist_add(&c, (void *)i);
+        count_add(&ctimes, now_ns() - start, grew);
+        if (i == 0)
+            first = clist_at(&c, 0);
+    }
+    report_adds("clist", n, &ctimes);
+    if (first != clist_at(&c, 0)) {
+        fprintf(stderr, "%s: clist slot moved\n", argv[0]);
+        exit(1);
+    }
+
+    long sum = 0;
+    long long start = now_ns();
+    for (long i = 0; i < n; i++)
+        sum += (long)alist_get(&a, i);
+    long long a_get = now_ns() - start;
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        sum -= (long)clist_get(&c, i);
+    long long c_get = now_ns() - start;
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        sum += (long)a.data[i];
+    long long a_index = now_ns() - start;
+    start = now_ns();
+    for (long i = 0; i < n; i++)
+        sum -= (long)*clist_at(&c, i);
+    long long c_index = now_ns() - start;
+    if (sum != 0) {
+        fprintf(stderr, "%s: lists differ\n", argv[0]);
+        exit(1);
+    }
+    printf("get:        alist %5.2f ns, clist %5.2f ns\n", (double)a_get / n, (double)c_get / n);
+    printf("index:      alist %5.2f ns, clist %5.2f ns\n", (double)a_index / n, (double)c_index / n);
+
+    alist_destroy(&a);
+    clist_destroy(&c);
+    return 0;
+}
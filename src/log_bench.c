@@ -0,0 +1,112 @@
+// Benchmark for the asynchronous logger.
+
+// This has a number of threads each log a stream of messages like the
+// ones the runway and airplane threads log, and reports the average time
+// a thread spends in each LOG call. For comparison it then does the same
+// with printf, which is how the server used to log. The messages (and the
+// printf output) go to /dev/null, so only the cost to the logging threads
+// is measured. Messages are logged in bursts that fit in a thread's ring,
+// with a pause after each for the writer to catch up, since a thread that
+// logs without stopping just fills its ring and has the rest dropped (a
+// half-full ring wakes the writer, so the pause can be short).
+//
+// Usage: log_bench [-t threads] [-n messages]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logger.h"
+
+static long messages = 100000;  // Per thread
+static int use_printf;
+
+/************************************************************************
+ * now_ns returns the current time in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/************************************************************************
+ * run_thread logs the messages for one thread, and returns (as a
+ * pointer-sized integer) the nanoseconds it spent logging.
+ */
+static void *run_thread(void *arg) {
+    long index = (long)arg;
+    char id[16];
+    snprintf(id, sizeof(id), "lb%ld", index);
+
+    long long spent = 0;
+    for (long sent = 0; sent < messages; ) {
+        long long start = now_ns();
+        for (int i = 0; (i < LOG_RING / 2) && (sent < messages); i++, sent++) {
+            if (use_printf)
+                printf("Clearing flight %s (%c) %ld\n", id, 'M', sent);
+            else
+                LOG(LOG_INFO, "Clearing flight %s (%c) %ld", id, 'M', sent);
+        }
+        spent += now_ns() - start;
+        usleep(1000);
+    }
+    return (void *)(long)spent;
+}
+
+/************************************************************************
+ * run_bench runs "nthreads" threads, and returns the average ns per call.
+ */
+static double run_bench(int nthreads) {
+    pthread_t tids[nthreads];
+    for (long i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, run_thread, (void *)i);
+    long long spent = 0;
+    for (int i = 0; i < nthreads; i++) {
+        void *result;
+        pthread_join(tids[i], &result);
+        spent += (long)result;
+    }
+    return (double)spent / ((double)messages * nthreads);
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': messages = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-n messages]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if ((nthreads < 1) || (messages < 1)) {
+        fprintf(stderr, "%s: need at least one thread and one message\n", argv[0]);
+        exit(1);
+    }
+
+    // Keep the real stdout for the report
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if ((report == NULL) || (freopen("/dev/null", "w", stdout) == NULL)) {
+        perror("log_bench stdout");
+        exit(1);
+    }
+    logger_start(stdout);
+
+    fprintf(report, "%d threads, %ld messages each\n", nthreads, messages);
+    double logged = run_bench(nthreads);
+    logger_flush();
+    fprintf(report, "LOG:    %.1f ns per message", logged);
+    logger_stats(report);
+    fprintf(report, "\n");
+
+    use_printf = 1;
+    double printed = run_bench(nthreads);
+    fprintf(report, "printf: %.1f ns per message\n", printed);
+    fclose(report);
+    return 0;
+}
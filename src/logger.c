@@ -0,0 +1,423 @@
+// Module for the asynchronous logger, which keeps the server's threads
+// from formatting and writing log messages themselves.
+
+// LOG (see logger.h) doesn't format anything: it copies the time, the
+// level, the format string's pointer and the arguments (with the text of
+// any string arguments) into a fixed-size record in a ring that belongs to
+// the calling thread, and carries on. Each ring has a single producer (its
+// thread) and a single consumer (the writer), so taking a record needs no
+// lock and no atomic read-modify-write, just the two counters. A thread's
+// ring is made the first time it logs, and freed by the writer once the
+// thread has exited and the ring is empty. A server that has to be ready
+// for a number of threads can make their rings up front (logger_reserve),
+// and then the rings of threads that exit are kept for the threads that
+// come next rather than freed.
+//
+// The writer thread wakes up every LOG_IDLE_MS (or sooner, if a ring is
+// filling up), takes everything in all the rings, sorts it by time, and
+// only then formats and writes the messages. If a ring is full the
+// message is dropped rather than making the thread wait.
+//
+// Even the time is left for the writer to work out: a message is stamped
+// with the time-stamp counter (see tsc.c).
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "logger.h"
+#include "topology.h"
+#include "tsc.h"
+
+// Most records the writer takes from the rings in one go
+
+#define LOG_BATCH 4096
+
+// A message as logged, waiting to be formatted. String arguments are
+// kept as offsets into "strs". The whole record is two cache lines.
+
+typedef struct log_record {
+    long long ticks;            // From tsc_now
+    const char *fmt;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned char types[LOG_MAXARGS];
+    union {
+        long long i;
+        double d;
+        const void *p;
+        int str;
+    } args[LOG_MAXARGS];
+    char strs[LOG_STRSIZE];
+} log_record;
+
+// One thread's records. "head" (records ever logged) is only changed by
+// the thread, and "tail" (records ever taken) only by the writer. The
+// thread keeps its own copy of "tail", and only reads the writer's (whose
+// cache line it shares) when the ring looks half full.
+
+typedef struct log_ring {
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int cached_tail;
+    unsigned int tail __attribute__((aligned(64)));
+    int closed;                 // Its thread has exited
+    struct log_ring *next;
+    log_record records[LOG_RING];
+} log_ring;
+
+int log_level = LOG_INFO;
+
+static char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+
+static FILE *log_out;           // NULL until logger_start
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring *rings;
+static log_ring *spare_rings;   // Rings kept for threads to come
+static int nspare;
+static int spare_max;           // Most rings kept (see logger_reserve)
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread log_ring *my_ring;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_record batch[LOG_BATCH];
+static log_record *sorted[LOG_BATCH];
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static int writer_idle;
+
+static long long written;
+static long long dropped;
+
+/************************************************************************
+ * ring_close is the destructor for a thread's ring: it tells the writer
+ * the ring can be freed once it is empty.
+ */
+static void ring_close(void *data) {
+    log_ring *ring = data;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create() {
+    pthread_key_create(&ring_key, ring_close);
+}
+
+/************************************************************************
+ * ring_get returns the calling thread's ring, making it if need be.
+ */
+static log_ring *ring_get() {
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&ring_once, ring_key_create);
+    pthread_mutex_lock(&rings_lock);
+    log_ring *ring = spare_rings;
+    if (ring != NULL) {
+        spare_rings = ring->next;
+        nspare--;
+        ring->closed = 0;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if ((ring == NULL) && ((ring = calloc(1, sizeof(log_ring))) == NULL)) {
+        perror("logger");
+        exit(1);
+    }
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    my_ring = ring;
+    return ring;
+}
+
+/************************************************************************
+ * logger_write adds a message at level "level" with format "fmt" and the
+ * "nargs" arguments in "args" to the calling thread's ring. This is what
+ * LOG calls (once it has checked the level).
+ */
+void logger_write(int level, const char *fmt, int nargs, const log_arg *args) {
+    log_ring *ring = ring_get();
+    unsigned int head = ring->head;
+    if (head - ring->cached_tail >= LOG_RING / 2) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->cached_tail >= LOG_RING) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    log_record *rec = &ring->records[head % LOG_RING];
+    rec->ticks = tsc_now();
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->nargs = (nargs < LOG_MAXARGS) ? nargs : LOG_MAXARGS;
+
+    // Each string is cut short to fit, and once the space is used up the
+    // rest get the last byte (which then always ends a string).
+    int used = 0;
+    for (int i = 0; i < rec->nargs; i++) {
+        rec->types[i] = args[i].type;
+        switch (args[i].type) {
+        case LOG_ARG_INT:
+            rec->args[i].i = args[i].v.i;
+            break;
+        case LOG_ARG_DOUBLE:
+            rec->args[i].d = args[i].v.d;
+            break;
+        case LOG_ARG_PTR:
+            rec->args[i].p = args[i].v.p;
+            break;
+        case LOG_ARG_STR: {
+            if (used >= LOG_STRSIZE) {
+                rec->args[i].str = LOG_STRSIZE - 1;
+                break;
+            }
+            const char *s = (args[i].v.s != NULL) ? args[i].v.s : "(null)";
+            size_t len = strnlen(s, LOG_STRSIZE - 1 - used);
+            memcpy(rec->strs + used, s, len);
+            rec->strs[used + len] = '\0';
+            rec->args[i].str = used;
+            used += len + 1;
+            break;
+        }
+        }
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // Wake the writer (once) as the ring reaches half full
+    if ((head + 1 - ring->cached_tail == LOG_RING / 2) && __atomic_load_n(&writer_idle, __ATOMIC_RELAXED))
+        pthread_cond_signal(&writer_wake);
+}
+
+/************************************************************************
+ * format_record writes message "rec" as a line on "out": the time, the
+ * level, and the message formatted with its arguments.
+ */
+static void format_record(FILE *out, log_record *rec) {
+    long long ns = tsc_to_ns(rec->ticks);
+    time_t secs = ns / 1000000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    fprintf(out, "%02d:%02d:%02d.%06lld %-5s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (ns % 1000000000) / 1000, level_names[rec->level]);
+
+    int next = 0;
+    for (const char *cp = rec->fmt; *cp != '\0'; cp++) {
+        if (*cp != '%') {
+            putc_unlocked(*cp, out);
+            continue;
+        }
+        if (cp[1] == '%') {
+            putc_unlocked('%', out);
+            cp++;
+            continue;
+        }
+
+        // Take the conversion apart, and put it back together with the
+        // length the captured argument has
+        const char *start = cp++;
+        cp += strspn(cp, "-+ #0");
+        cp += strspn(cp, "0123456789.");
+        size_t prefix = cp - start;
+        cp += strspn(cp, "hlLqjzt");
+        char conv = *cp;
+        if ((conv == '\0') || (prefix > 16) || (next >= rec->nargs)) {
+            fwrite(start, 1, cp - start + (conv != '\0'), out);
+            if (conv == '\0')
+                break;
+            continue;
+        }
+
+        char spec[24];
+        memcpy(spec, start, prefix);
+        int type = rec->types[next];
+        long long i = (type == LOG_ARG_DOUBLE) ? (long long)rec->args[next].d : rec->args[next].i;
+        double d = (type == LOG_ARG_DOUBLE) ? rec->args[next].d : (double)rec->args[next].i;
+        if (strchr("diouxX", conv) != NULL) {
+            sprintf(spec + prefix, "ll%c", conv);
+            fprintf(out, spec, i);
+        } else if (strchr("feEgGaA", conv) != NULL) {
+            sprintf(spec + prefix, "%c", conv);
+            fprintf(out, spec, d);
+        } else if (conv == 'c') {
+            sprintf(spec + prefix, "c");
+            fprintf(out, spec, (int)i);
+        } else if (conv == 's') {
+            sprintf(spec + prefix, "s");
+            fprintf(out, spec, (type == LOG_ARG_STR) ? rec->strs + rec->args[next].str : "?");
+        } else if (conv == 'p') {
+            sprintf(spec + prefix, "p");
+            fprintf(out, spec, rec->args[next].p);
+        } else {
+            fwrite(start, 1, cp - start + 1, out);
+        }
+        next++;
+    }
+    putc_unlocked('\n', out);
+}
+
+/************************************************************************
+ * compare_records orders records by time (for qsort), keeping records
+ * with the same time in the order they were taken.
+ */
+static int compare_records(const void *a, const void *b) {
+    const log_record *ra = *(log_record * const *)a;
+    const log_record *rb = *(log_record * const *)b;
+    if (ra->ticks != rb->ticks)
+        return (ra->ticks < rb->ticks) ? -1 : 1;
+    return (ra < rb) ? -1 : (ra > rb);
+}
+
+/************************************************************************
+ * logger_drain takes everything (up to LOG_BATCH records) from all the
+ * rings, frees (or keeps as spares) the rings of threads that have exited,
+ * and writes the messages out in time order. Returns the number of messages written.
+ */
+static int logger_drain() {
+    pthread_mutex_lock(&drain_lock);
+    int count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    log_ring **prev = &rings;
+    while (*prev != NULL) {
+        log_ring *ring = *prev;
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = ring->tail;
+        while ((tail != head) && (count < LOG_BATCH)) {
+            batch[count] = ring->records[tail % LOG_RING];
+            sorted[count] = &batch[count];
+            count++;
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (closed && (tail == head)) {
+            *prev = ring->next;
+            if (nspare < spare_max) {
+                ring->next = spare_rings;
+                spare_rings = ring;
+                nspare++;
+            } else {
+                free(ring);
+            }
+        } else {
+            prev = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (count > 0) {
+        tsc_calibrate();
+        qsort(sorted, count, sizeof(log_record *), compare_records);
+        flockfile(log_out);
+        for (int i = 0; i < count; i++)
+            format_record(log_out, sorted[i]);
+        fflush_unlocked(log_out);
+        funlockfile(log_out);
+        __atomic_add_fetch(&written, count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+/************************************************************************
+ * logger_run is the writer thread.
+ */
+static void *logger_run(void *arg) {
+    while (1) {
+        if (logger_drain() > 0)
+            continue;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_IDLE_MS * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&writer_lock);
+        __atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+        pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+        __atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * logger_start starts the writer thread, writing the messages to "out".
+ * Until it is called, messages are kept (as far as the rings allow) but
+ * not written. What is left is written out when the program exits.
+ */
+void logger_start(FILE *out) {
+    tsc_init();
+    log_out = out;
+    atexit(logger_flush);
+
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "logger", logger_run, NULL);
+    pthread_detach(tid);
+}
+
+/************************************************************************
+ * logger_reserve makes rings for "n" threads ahead of time (touching
+ * every page, so they are in memory before they are needed), and keeps
+ * up to "n" rings of threads that exit for new threads to use.
+ */
+void logger_reserve(int n) {
+    pthread_mutex_lock(&rings_lock);
+    spare_max = n;
+    while (nspare < n) {
+        log_ring *ring = malloc(sizeof(log_ring));
+        if (ring == NULL) {
+            perror("logger_reserve");
+            exit(1);
+        }
+        memset(ring, 0, sizeof(log_ring));
+        ring->next = spare_rings;
+        spare_rings = ring;
+        nspare++;
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/************************************************************************
+ * logger_flush writes out every message logged so far, before the
+ * program exits.
+ */
+void logger_flush() {
+    if (log_out == NULL)
+        return;
+    while (logger_drain() > 0)
+        ;
+}
+
+/************************************************************************
+ * logger_parse_level returns the level called "name" (like "info"), or
+ * -1 if there isn't one.
+ */
+int logger_parse_level(const char *name) {
+    for (int level = LOG_DEBUG; level <= LOG_OFF; level++) {
+        if (strcasecmp(name, level_names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * logger_stats writes the logger statistics (for the STATS command) as
+ * " name=value" pairs.
+ */
+void logger_stats(FILE *out) {
+    fprintf(out, " log_written=%lld log_dropped=%lld",
+            __atomic_load_n(&written, __ATOMIC_RELAXED),
+            __atomic_load_n(&dropped, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,109 @@
+// Prototypes, constants and macros for the asynchronous logger
+
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <stdio.h>
+
+// Log levels. A message is kept only if its level is at least log_level,
+// and LOG_OFF (as log_level) drops everything.
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_OFF 4
+
+// Records in each thread's ring. A thread that logs faster than the
+// writer drains its ring loses the messages that don't fit (and they are
+// counted, see logger_stats).
+
+#define LOG_RING 256
+
+// Arguments a message can have, and the bytes of string arguments kept
+// with it (longer strings are cut short).
+
+#define LOG_MAXARGS 6
+#define LOG_STRSIZE 56
+
+// How long (ms) the writer sleeps when there is nothing to write
+
+#define LOG_IDLE_MS 10
+
+// An argument, captured as it was when the message was logged
+
+#define LOG_ARG_INT 0
+#define LOG_ARG_DOUBLE 1
+#define LOG_ARG_STR 2
+#define LOG_ARG_PTR 3
+
+typedef struct log_arg {
+    int type;
+    union {
+        long long i;
+        double d;
+        const char *s;
+        const void *p;
+    } v;
+} log_arg;
+
+extern int log_level;
+
+// LOG(level, fmt, ...) logs a printf-style message. "fmt" must be a string
+// literal (only the pointer is kept, and it is formatted later by the
+// writer thread), and the arguments must be integers, doubles, strings or
+// pointers, at most LOG_MAXARGS of them; "*" widths aren't supported. The
+// dead printf call is only there so the compiler checks the format.
+
+#define LOG(level, fmt, ...)                                                \
+    do {                                                                    \
+        if ((level) >= log_level)                                           \
+            logger_write((level), (fmt), LOG_COUNT(__VA_ARGS__),            \
+                         (log_arg[]){ LOG_MAP(__VA_ARGS__) });              \
+        if (0)                                                              \
+            printf((fmt), ##__VA_ARGS__);                                   \
+    } while (0)
+
+#define LOG_ARG(x) _Generic((x),                                            \
+    char *: logger_arg_str, const char *: logger_arg_str,                   \
+    float: logger_arg_double, double: logger_arg_double,                    \
+    void *: logger_arg_ptr, const void *: logger_arg_ptr,                   \
+    default: logger_arg_int)(x)
+
+#define LOG_COUNT(...) LOG_COUNT_(_, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_COUNT_(_, a, b, c, d, e, f, n, ...) n
+#define LOG_MAP(...) LOG_MAP_N(LOG_COUNT(__VA_ARGS__), ##__VA_ARGS__)
+#define LOG_MAP_N(n, ...) LOG_MAP_N_(n, ##__VA_ARGS__)
+#define LOG_MAP_N_(n, ...) LOG_MAP_##n(__VA_ARGS__)
+#define LOG_MAP_0()
+#define LOG_MAP_1(a) LOG_ARG(a)
+#define LOG_MAP_2(a, ...) LOG_ARG(a), LOG_MAP_1(__VA_ARGS__)
+#define LOG_MAP_3(a, ...) LOG_ARG(a), LOG_MAP_2(__VA_ARGS__)
+#define LOG_MAP_4(a, ...) LOG_ARG(a), LOG_MAP_3(__VA_ARGS__)
+#define LOG_MAP_5(a, ...) LOG_ARG(a), LOG_MAP_4(__VA_ARGS__)
+#define LOG_MAP_6(a, ...) LOG_ARG(a), LOG_MAP_5(__VA_ARGS__)
+
+static inline log_arg logger_arg_int(long long i) {
+    return (log_arg){ .type = LOG_ARG_INT, .v.i = i };
+}
+
+static inline log_arg logger_arg_double(double d) {
+    return (log_arg){ .type = LOG_ARG_DOUBLE, .v.d = d };
+}
+
+static inline log_arg logger_arg_str(const char *s) {
+    return (log_arg){ .type = LOG_ARG_STR, .v.s = s };
+}
+
+static inline log_arg logger_arg_ptr(const void *p) {
+    return (log_arg){ .type = LOG_ARG_PTR, .v.p = p };
+}
+
+void logger_start(FILE *out);
+int logger_parse_level(const char *name);
+void logger_write(int level, const char *fmt, int nargs, const log_arg *args);
+void logger_reserve(int n);
+void logger_flush();
+void logger_stats(FILE *out);
+
+#endif  // _LOGGER_H
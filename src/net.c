@@ -0,0 +1,178 @@
+// Module for the networking helpers shared by the server and its tools:
+// setting up a listening socket, and connecting to a server, over TCP or
+// (for clients on the same machine) a Unix socket.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net.h"
+
+/************************************************************************
+ * create_listener sets up a TCP socket listening on port "service" on
+ * all local addresses. Returns the socket, or -1 on failure.
+ */
+int create_listener(char *service) {
+    int sock_fd;
+    if ((sock_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Avoid time delay in reusing port - important for debugging, but
+    // probably not used in a production server.
+
+    int optval = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+
+    // Replies go out a line at a time, and with Nagle's algorithm the
+    // replies to pipelined commands after the first would wait for the
+    // client's (delayed) ACK. Accepted sockets inherit this.
+
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    // First, use getaddrinfo() to fill in address struct for later bind
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = 0;
+
+    struct addrinfo *result;
+    int rval;
+    if ((rval=getaddrinfo(NULL, service, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+        close(sock_fd);
+        return -1;
+    }
+
+    // Assign a name/addr to the socket - just blindly grabs first result
+    // off linked list, but really should be exactly one struct returned.
+
+    int bret = bind(sock_fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    result = NULL;  // Not really necessary, but ensures no use-after-free
+
+    if (bret < 0) {
+        perror("bind");
+        close(sock_fd);
+        return -1;
+    }
+
+    // Finally, set up listener connection queue
+    int lret = listen(sock_fd, 128);
+    if (lret < 0) {
+        perror("listen");
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+/************************************************************************
+ * connect_to opens a TCP connection to "host" on port "service", with
+ * Nagle's algorithm turned off since all our messages are small. Returns
+ * the socket, or -1 on failure.
+ */
+int connect_to(char *host, char *service) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result;
+    int rval;
+    if ((rval=getaddrinfo(host, service, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+        return -1;
+    }
+
+    int sock_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock_fd < 0) {
+        perror("socket");
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    if (connect(sock_fd, result->ai_addr, result->ai_addrlen) < 0) {
+        perror("connect");
+        close(sock_fd);
+        freeaddrinfo(result);
+        return -1;
+    }
+    freeaddrinfo(result);
+
+    int optval = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    return sock_fd;
+}
+
+/************************************************************************
+ * local_address fills in the address of the Unix socket at "path".
+ * Returns 0, or -1 if the path is too long.
+ */
+static int local_address(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/************************************************************************
+ * create_local_listener sets up a Unix socket listening at "path" (which
+ * is replaced if it exists), for clients on the same machine. Returns the
+ * socket, or -1 on failure.
+ */
+int create_local_listener(char *path) {
+    struct sockaddr_un addr;
+    if (local_address(&addr, path) < 0)
+        return -1;
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if ((bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(sock_fd, 128) < 0)) {
+        perror(path);
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+/************************************************************************
+ * connect_local connects to the Unix socket at "path". Returns the
+ * socket, or -1 on failure.
+ */
+int connect_local(char *path) {
+    struct sockaddr_un addr;
+    if (local_address(&addr, path) < 0)
+        return -1;
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
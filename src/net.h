@@ -0,0 +1,11 @@
+// Prototypes for the networking helpers
+
+#ifndef _NET_H
+#define _NET_H
+
+int create_listener(char *service);
+int connect_to(char *host, char *service);
+int create_local_listener(char *path);
+int connect_local(char *path);
+
+#endif  // _NET_H
@@ -0,0 +1,416 @@
+// Module for observers: connections that don't fly, but watch the taxi
+// queues change, as a stream of lines
+//
+//    EVENT TAXI airport flightid category      flight joined the queue
+//    EVENT TAKEOFF airport flightid category   flight cleared for takeoff
+//    EVENT INAIR airport flightid category     flight took off
+//    EVENT REMOVE airport flightid category    flight left without flying
+//    EVENT LOST count                          events this observer missed
+//
+// There can be hundreds of observers, so an event is formatted once, into
+// a reference-counted buffer that goes into a ring of recent events. Each
+// observer just has a position in the ring. One fan-out thread sends every
+// observer what it hasn't seen yet, straight from the shared buffers (many
+// events per system call), without ever blocking on a slow observer: it
+// moves on, and tries that observer again later. An observer that falls
+// more than OBSERVE_RING events behind skips ahead to the oldest event
+// still kept, and is told how many it lost.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "observe.h"
+#include "alist.h"
+#include "topology.h"
+#include "wake.h"
+
+// An event, shared by every observer sending it
+
+typedef struct event_msg {
+    int refs;
+    int airport;            // Index of the airport it happened at
+    int len;
+    char text[];
+} event_msg;
+
+// What the fan-out thread knows about an observer
+
+typedef struct observer {
+    airplane *plane;
+    int fd;
+    int airport;            // Only send this airport's events (-1 = all)
+    char filter[AIRPORT_MAXCODE+1];
+    long long next;         // Next event (ring sequence number) to send
+    event_msg *partial;     // Event part way through being sent
+    int partial_off;
+    char notice[32];        // EVENT LOST line part way through being sent
+    int notice_len;
+    int notice_off;
+    int dead;               // Sending failed -- wait for it to disconnect
+} observer;
+
+static event_msg *ring[OBSERVE_RING];
+static long long ring_head;         // Events ever published
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_grown = PTHREAD_COND_INITIALIZER;
+
+static alist observers;
+static int nobservers;              // So events are free with no observers
+static long long events_lost;       // By all observers
+static pthread_mutex_t observers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fanout_once = PTHREAD_ONCE_INIT;
+
+static const char *event_names[] = { "TAXI", "REMOVE", "TAKEOFF", "INAIR" };
+
+/************************************************************************
+ * event_release drops a reference to an event, freeing it with the last.
+ */
+static void event_release(event_msg *msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(msg);
+}
+
+/************************************************************************
+ * observe_event publishes a queue change (QUEUE_EV_*) at airport "ap" to
+ * the observers. It is called from the queue's notify function, with the
+ * queue mutex held, so events come out in the order they happened.
+ */
+void observe_event(airport *ap, int event, queue_entry *entry) {
+    if (__atomic_load_n(&nobservers, __ATOMIC_RELAXED) == 0)
+        return;
+
+    char text[80];
+    int len = snprintf(text, sizeof(text), "EVENT %s %s %s %c\n", event_names[event],
+                       ap->code, entry->id, wake_letter(entry->category));
+    event_msg *msg = malloc(sizeof(event_msg) + len);
+    if (msg == NULL) {
+        perror("observe_event");
+        exit(1);
+    }
+    msg->refs = 1;  // The ring's
+    msg->airport = ap->index;
+    msg->len = len;
+    memcpy(msg->text, text, len);
+
+    pthread_mutex_lock(&ring_lock);
+    int slot = ring_head % OBSERVE_RING;
+    event_msg *old = ring[slot];
+    ring[slot] = msg;
+    ring_head++;
+    pthread_cond_signal(&ring_grown);
+    pthread_mutex_unlock(&ring_lock);
+
+    if (old != NULL)
+        event_release(old);
+}
+
+/************************************************************************
+ * send_some sends as much of the "len" bytes at "buf" as the observer's
+ * socket will take right now. Returns how many it sent, or -1 if the
+ * observer is gone.
+ */
+static int send_some(observer *obs, char *buf, int len) {
+    ssize_t sent = send(obs->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent >= 0)
+        return sent;
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        return 0;
+    obs->dead = 1;
+    return -1;
+}
+
+/************************************************************************
+ * observer_finish_line sends the rest of the line observer "obs" is part
+ * way through (if any), so lines are never split. Returns 1 if it is
+ * done, or 0 if the observer couldn't take it all (or is gone).
+ */
+static int observer_finish_line(observer *obs) {
+    if (obs->partial != NULL) {
+        int sent = send_some(obs, obs->partial->text + obs->partial_off,
+                             obs->partial->len - obs->partial_off);
+        if (sent < 0)
+            return 0;
+        obs->partial_off += sent;
+        if (obs->partial_off < obs->partial->len)
+            return 0;
+        event_release(obs->partial);
+        obs->partial = NULL;
+    }
+    if (obs->notice_off < obs->notice_len) {
+        int sent = send_some(obs, obs->notice + obs->notice_off, obs->notice_len - obs->notice_off);
+        if (sent < 0)
+            return 0;
+        obs->notice_off += sent;
+        if (obs->notice_off < obs->notice_len)
+            return 0;
+    }
+    return 1;
+}
+
+/************************************************************************
+ * observer_flush sends observer "obs" everything it hasn't seen yet, or as
+ * much as it will take. Returns 1 if it is caught up, or 0 if it couldn't
+ * take any more (or is gone). Must be called with observers_lock held.
+ */
+static int observer_flush(observer *obs) {
+    event_msg *batch[OBSERVE_BATCH];
+    long long seqs[OBSERVE_BATCH];
+    struct iovec iov[OBSERVE_BATCH];
+
+    while (!obs->dead) {
+        if (!observer_finish_line(obs))
+            return 0;
+
+        int n = 0;
+        pthread_mutex_lock(&ring_lock);
+        if (ring_head - obs->next > OBSERVE_RING) {
+            long long lost = ring_head - OBSERVE_RING - obs->next;
+            obs->next = ring_head - OBSERVE_RING;
+            pthread_mutex_unlock(&ring_lock);
+            events_lost += lost;
+            obs->notice_len = sprintf(obs->notice, "EVENT LOST %lld\n", lost);
+            obs->notice_off = 0;
+            continue;
+        }
+        long long scanned = obs->next;
+        while ((scanned < ring_head) && (n < OBSERVE_BATCH)) {
+            event_msg *msg = ring[scanned % OBSERVE_RING];
+            if ((obs->airport < 0) || (msg->airport == obs->airport)) {
+                __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+                batch[n] = msg;
+                seqs[n] = scanned;
+                iov[n].iov_base = msg->text;
+                iov[n].iov_len = msg->len;
+                n++;
+            }
+            scanned++;
+        }
+        pthread_mutex_unlock(&ring_lock);
+        if (n == 0) {
+            obs->next = scanned;
+            return 1;
+        }
+
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n;
+        ssize_t sent = sendmsg(obs->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if ((sent < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            obs->dead = 1;
+        if (sent < 0)
+            sent = 0;
+
+        // Work out how far it got: whole events, then maybe part of one
+        int i = 0;
+        while ((i < n) && (sent >= batch[i]->len)) {
+            sent -= batch[i]->len;
+            event_release(batch[i]);
+            i++;
+        }
+        if (i == n) {
+            obs->next = scanned;
+            continue;
+        }
+        obs->next = seqs[i];
+        if (sent > 0) {
+            obs->partial = batch[i];
+            obs->partial_off = sent;
+            obs->next = seqs[i] + 1;
+            i++;
+        }
+        for (; i < n; i++)
+            event_release(batch[i]);
+        return 0;
+    }
+    return 0;
+}
+
+/************************************************************************
+ * fanout_thread sends new events to every observer, and keeps trying the
+ * ones that couldn't take everything.
+ */
+static void *fanout_thread(void *arg) {
+    long long seen = 0;
+    int behind = 0;
+    while (1) {
+        pthread_mutex_lock(&ring_lock);
+        if (!behind) {
+            while (ring_head == seen)
+                pthread_cond_wait(&ring_grown, &ring_lock);
+        } else if (ring_head == seen) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += OBSERVE_RETRY_MS * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&ring_grown, &ring_lock, &deadline);
+        }
+        seen = ring_head;
+        pthread_mutex_unlock(&ring_lock);
+
+        behind = 0;
+        pthread_mutex_lock(&observers_lock);
+        for (int i = 0; i < observers.in_use; i++) {
+            observer *obs = observers.data[i];
+            if (!obs->dead && !observer_flush(obs))
+                behind = !obs->dead;
+        }
+        pthread_mutex_unlock(&observers_lock);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * observer_free frees an observer (for the observers list).
+ */
+static void observer_free(void *data) {
+    observer *obs = data;
+    if (obs->partial != NULL)
+        event_release(obs->partial);
+    free(obs);
+}
+
+/************************************************************************
+ * fanout_start sets up the observers list and starts the fan-out thread,
+ * the first time anyone observes.
+ */
+static void fanout_start() {
+    alist_init(&observers, observer_free);
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "observe", fanout_thread, NULL);
+    pthread_detach(tid);
+}
+
+/************************************************************************
+ * observer_index returns the position of "plane" in the observers list,
+ * or -1 if it isn't observing. Must be called with observers_lock held.
+ */
+static int observer_index(airplane *plane) {
+    for (int i = 0; i < observers.in_use; i++) {
+        if (((observer *)observers.data[i])->plane == plane)
+            return i;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * observe_add makes connection "plane" an observer of the events at the
+ * airport with code "filter" (or every airport, if it is NULL or "*"),
+ * starting with the next event. An observer calling it again just
+ * changes what it observes. Returns 0, or -1 if there is no airport
+ * "filter" (only REG opens airports).
+ */
+int observe_add(airplane *plane, char *filter) {
+    int index = -1;
+    if ((filter == NULL) || (strcmp(filter, "*") == 0)) {
+        filter = "*";
+    } else {
+        airport *ap = airport_find(filter);
+        if (ap == NULL)
+            return -1;
+        index = ap->index;
+    }
+    pthread_once(&fanout_once, fanout_start);
+
+    pthread_mutex_lock(&observers_lock);
+    int pos = observer_index(plane);
+    observer *obs;
+    if (pos >= 0) {
+        obs = observers.data[pos];
+    } else {
+        obs = calloc(1, sizeof(observer));
+        if (obs == NULL) {
+            perror("observe_add");
+            exit(1);
+        }
+        obs->plane = plane;
+        obs->fd = fileno(plane->fp_send);
+        pthread_mutex_lock(&ring_lock);
+        obs->next = ring_head;
+        pthread_mutex_unlock(&ring_lock);
+        alist_add(&observers, obs);
+        __atomic_add_fetch(&nobservers, 1, __ATOMIC_RELAXED);
+    }
+    obs->airport = index;
+    strcpy(obs->filter, filter);
+    pthread_mutex_unlock(&observers_lock);
+    return 0;
+}
+
+/************************************************************************
+ * observe_filter copies what observer "plane" observes (an airport code,
+ * or "*" for every airport) to "to".
+ */
+void observe_filter(airplane *plane, char *to) {
+    strcpy(to, "*");
+    if (__atomic_load_n(&nobservers, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&observers_lock);
+    int pos = observer_index(plane);
+    if (pos >= 0)
+        strcpy(to, ((observer *)observers.data[pos])->filter);
+    pthread_mutex_unlock(&observers_lock);
+}
+
+/************************************************************************
+ * observe_finish tries (for up to a tenth of a second) to finish sending
+ * any event that observer "plane" is part way through, so that its
+ * connection can be handed to another server at a line boundary.
+ */
+void observe_finish(airplane *plane) {
+    for (int tries = 0; tries < 100; tries++) {
+        if (__atomic_load_n(&nobservers, __ATOMIC_RELAXED) == 0)
+            return;
+        pthread_mutex_lock(&observers_lock);
+        int pos = observer_index(plane);
+        int done = 1;
+        if (pos >= 0) {
+            observer *obs = observers.data[pos];
+            done = observer_finish_line(obs) || obs->dead;
+        }
+        pthread_mutex_unlock(&observers_lock);
+        if (done)
+            return;
+        usleep(1000);
+    }
+}
+
+/************************************************************************
+ * observe_remove stops sending events to "plane", which is disconnecting.
+ * Once it returns, nothing will be sent on the connection.
+ */
+void observe_remove(airplane *plane) {
+    if (__atomic_load_n(&nobservers, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&observers_lock);
+    int pos = observer_index(plane);
+    if (pos >= 0) {
+        alist_remove(&observers, pos);
+        __atomic_sub_fetch(&nobservers, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&observers_lock);
+}
+
+/************************************************************************
+ * observe_stats writes the observer statistics (for the STATS command) as
+ * " name=value" pairs.
+ */
+void observe_stats(FILE *out) {
+    pthread_mutex_lock(&ring_lock);
+    long long events = ring_head;
+    pthread_mutex_unlock(&ring_lock);
+    pthread_mutex_lock(&observers_lock);
+    fprintf(out, " observers=%d observer_events=%lld observer_lost=%lld", nobservers, events, events_lost);
+    pthread_mutex_unlock(&observers_lock);
+}
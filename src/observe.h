@@ -0,0 +1,32 @@
+// Prototypes for the observer module
+
+#ifndef _OBSERVE_H
+#define _OBSERVE_H
+
+#include <stdio.h>
+
+#include "airplane.h"
+#include "airport.h"
+
+// How many recent events are kept for observers. An observer that falls
+// further behind than this loses the events it missed (and is told how
+// many with an "EVENT LOST" line).
+
+#define OBSERVE_RING 4096
+
+// Most events sent to one observer in one system call
+
+#define OBSERVE_BATCH 64
+
+// How often observers that couldn't take any more are tried again (ms)
+
+#define OBSERVE_RETRY_MS 20
+
+void observe_event(airport *ap, int event, queue_entry *entry);
+int observe_add(airplane *plane, char *filter);
+void observe_filter(airplane *plane, char *to);
+void observe_finish(airplane *plane);
+void observe_remove(airplane *plane);
+void observe_stats(FILE *out);
+
+#endif  // _OBSERVE_H
@@ -0,0 +1,186 @@
+// Module for preallocation, which makes everything the server will need
+// for a given number of planes when it starts, instead of as connections
+// and commands first need it.
+
+// Without it, memory is asked for as it is needed: an airplane struct and
+// its stream buffers when a plane connects, registry and queue room as
+// flights arrive, a buffer for every REQAHEAD reply, and so on. Each of
+// those is an allocator call, and the first use of new memory is a page
+// fault, all of which land on requests.
+//
+// prealloc_start (from the server's -P option) sizes the pools from a
+// number of planes instead. The sessions (see prealloc.h), which hold a
+// connection's airplane struct, stream buffers, line buffer and room for
+// the flights ahead of it, are made in one block, which is mapped in and
+// locked in memory straight away; connections take a session when they
+// are accepted and give it back when they close. Every airport reserves
+// room in its registry and taxi queue for that many planes when it is
+// opened (see airport_get), and the logger makes that many threads' rings.
+// Locking needs the privilege (or RLIMIT_MEMLOCK) for it; without it the
+// memory is only touched, so it is at least there to start with.
+//
+// Once a plane's airport is open, its commands then don't ask the heap for
+// anything, which "make ALLOCS=1" can check (see allocs.h). Connections
+// beyond the number of sessions still work, with memory of their own.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "prealloc.h"
+#include "logger.h"
+
+static int planes;                // 0 if preallocation is off
+static int depth;
+static session *free_sessions;
+static int nfree;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long missed;          // Connections that found no session
+static long long locked;          // Bytes locked in memory
+static long long touched;         // Bytes that couldn't be, but were touched
+
+/************************************************************************
+ * prealloc_start makes the sessions and sets the pool sizes from "spec",
+ * which is "planes" or "planes:depth" (depth being how far back in a
+ * queue REQAHEAD can be answered from a session's own room, and
+ * PREALLOC_DEPTH if it isn't given). Returns 0, or -1 if "spec" isn't
+ * valid.
+ */
+int prealloc_start(char *spec) {
+    char *end;
+    long n = strtol(spec, &end, 10);
+    long d = PREALLOC_DEPTH;
+    if (*end == ':')
+        d = strtol(end + 1, &end, 10);
+    if ((*end != '\0') || (n <= 0) || (d < 0))
+        return -1;
+    planes = n;
+    depth = d;
+
+    // The buffers come first, so that they start on a page, and then the
+    // sessions (on a cache line)
+    size_t ahead_size = (size_t)depth * (PLANE_MAXID + 1);
+    size_t each = (2 * PREALLOC_BUFSIZE + ahead_size + 63) / 64 * 64;
+    size_t len = planes * (each + sizeof(session));
+    char *block = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (block == MAP_FAILED) {
+        perror("prealloc_start");
+        exit(1);
+    }
+    prealloc_lock(block, len);
+
+    session *sessions = (session *)(block + planes * each);
+    for (int i = planes - 1; i >= 0; i--) {
+        session *ses = &sessions[i];
+        char *bufs = block + i * each;
+        ses->send_buf = bufs;
+        ses->recv_buf = bufs + PREALLOC_BUFSIZE;
+        ses->ahead = (char (*)[PLANE_MAXID+1])(bufs + 2 * PREALLOC_BUFSIZE);
+        ses->ahead_max = depth;
+
+        // Separate, since getline may have to make it bigger
+        if ((ses->line = malloc(PREALLOC_LINE)) == NULL) {
+            perror("prealloc_start");
+            exit(1);
+        }
+        ses->line_size = PREALLOC_LINE;
+        memset(ses->line, 0, PREALLOC_LINE);
+        prealloc_lock(ses->line, PREALLOC_LINE);
+
+        ses->next_free = free_sessions;
+        free_sessions = ses;
+    }
+    nfree = planes;
+
+    logger_reserve(planes);
+    LOG(LOG_INFO, "Preallocated %d sessions (%lld KB locked)", planes, locked / 1024);
+    return 0;
+}
+
+/************************************************************************
+ * prealloc_planes returns the number of planes the pools are sized for
+ * (0 if preallocation is off), and prealloc_depth how far back in a queue
+ * the sessions have room for.
+ */
+int prealloc_planes() {
+    return planes;
+}
+
+int prealloc_depth() {
+    return depth;
+}
+
+/************************************************************************
+ * prealloc_session takes a session from the pool for a new connection.
+ * Returns NULL if preallocation is off or every session is in use.
+ */
+session *prealloc_session() {
+    if (planes == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    session *ses = free_sessions;
+    if (ses != NULL) {
+        free_sessions = ses->next_free;
+        nfree--;
+    } else {
+        missed++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return ses;
+}
+
+/************************************************************************
+ * prealloc_release gives session "ses" back to the pool, once its
+ * connection has closed (and its plane has been destroyed).
+ */
+void prealloc_release(session *ses) {
+    pthread_mutex_lock(&pool_lock);
+    ses->next_free = free_sessions;
+    free_sessions = ses;
+    nfree++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/************************************************************************
+ * prealloc_lock locks the "len" bytes at "addr" in memory, or if that
+ * isn't allowed, touches every page of them so that they are at least
+ * there to start with. Nothing else may be using the memory yet.
+ */
+void prealloc_lock(void *addr, size_t len) {
+    static int warned;
+
+    if (len == 0)
+        return;
+    if (mlock(addr, len) == 0) {
+        __atomic_add_fetch(&locked, len, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+        LOG(LOG_WARN, "Can't lock preallocated memory (%s), only touching it", strerror(errno));
+
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char *bytes = addr;
+    for (size_t i = 0; i < len; i += page)
+        bytes[i] = bytes[i];
+    bytes[len - 1] = bytes[len - 1];
+    __atomic_add_fetch(&touched, len, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * prealloc_stats writes the preallocation statistics (for the STATS
+ * command) as " name=value" pairs.
+ */
+void prealloc_stats(FILE *out) {
+    pthread_mutex_lock(&pool_lock);
+    fprintf(out, " sessions_free=%d sessions_missed=%lld", nfree, missed);
+    pthread_mutex_unlock(&pool_lock);
+    fprintf(out, " locked_kb=%lld touched_kb=%lld",
+            __atomic_load_n(&locked, __ATOMIC_RELAXED) / 1024,
+            __atomic_load_n(&touched, __ATOMIC_RELAXED) / 1024);
+}
@@ -0,0 +1,47 @@
+// Types and prototypes for the preallocation module
+
+#ifndef _PREALLOC_H
+#define _PREALLOC_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "airplane.h"
+
+// Size of each session's send and receive stream buffers, and of its line
+// buffer to start with (getline makes it bigger if a line needs it)
+
+#define PREALLOC_BUFSIZE 8192
+#define PREALLOC_LINE 1024
+
+// How far back in a queue a REQAHEAD can be answered from a session's own
+// room, unless the server is told otherwise
+
+#define PREALLOC_DEPTH 256
+
+// Everything a connection needs, made up front by prealloc_start so that
+// accepting a connection and handling its commands doesn't have to ask
+// the heap for anything. The connection's airplane struct is "plane", and
+// it points back here.
+
+typedef struct session {
+    airplane plane;
+    char *send_buf;               // PREALLOC_BUFSIZE bytes for fp_send
+    char *recv_buf;               // PREALLOC_BUFSIZE bytes for fp_recv
+    char *line;                   // The line (or frame) buffer, from malloc
+    size_t line_size;
+    char (*ahead)[PLANE_MAXID+1]; // Room for the ids of the flights ahead
+    int ahead_max;                // How many ids there is room for
+    struct binconn *bin;          // Binary protocol state, kept for reuse
+    struct session *next_free;
+} session;
+
+int prealloc_start(char *spec);
+int prealloc_planes();
+int prealloc_depth();
+session *prealloc_session();
+void prealloc_release(session *ses);
+void prealloc_lock(void *addr, size_t len);
+void prealloc_stats(FILE *out);
+
+#endif  // _PREALLOC_H
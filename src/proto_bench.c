@@ -0,0 +1,283 @@
+// Benchmark comparing the text and binary protocols, and the transports.
+
+// This connects to a running server and has a number of planes (one
+// connection and thread each) register, request to taxi, and then keep
+// asking for their position and the flights ahead, sending the commands
+// in batches and reading all the replies to a batch before sending the
+// next one. It does this once with the text protocol and once with the
+// binary protocol, over TCP and (given the server's local socket with -u)
+// over the local socket and over shared-memory rings, and reports the
+// commands per second for each. Each run uses its own airport, so they
+// don't see each other's planes.
+//
+// Usage: proto_bench [-h host] [-p port] [-u path] [-c connections] [-n commands] [-b batch]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "binproto.h"
+#include "airport.h"
+#include "net.h"
+#include "shmring.h"
+
+// How a connection reaches the server
+
+enum { BENCH_TCP, BENCH_UNIX, BENCH_SHM };
+
+static char *transport_names[] = {"tcp", "unix", "shm"};
+
+static char *host = "localhost";
+static char *port = "8080";
+static char *local_path = NULL;
+static long commands = 200000;   // Per connection
+static int batch = 64;
+
+// What each connection's thread does, and how it went
+
+typedef struct bench_conn {
+    pthread_t tid;
+    int index;
+    int transport;
+    int binary;
+    char airport[AIRPORT_MAXCODE+1];
+    long replies;
+    int failed;
+} bench_conn;
+
+/************************************************************************
+ * now_ms returns the current time in milliseconds.
+ */
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/************************************************************************
+ * put_frame adds a binary request frame with code "code", argument "arg"
+ * and "len" bytes of "payload" at "to", and returns the end of it.
+ */
+static char *put_frame(char *to, int code, int arg, char *payload, size_t len) {
+    to[0] = len >> 8;
+    to[1] = len;
+    to[2] = code;
+    to[3] = arg;
+    memcpy(to + BIN_HEADER, payload, len);
+    return to + BIN_HEADER + len;
+}
+
+/************************************************************************
+ * read_reply reads from "in" up to and including the next reply (OK or
+ * ERR), skipping anything else the server sends (like TAKEOFF, or NAME
+ * frames). Returns 0, or -1 if the connection failed.
+ */
+static int read_reply(FILE *in, int binary) {
+    if (!binary) {
+        static __thread char *line;
+        static __thread size_t size;
+        while (getline(&line, &size, in) >= 0) {
+            if ((strncmp(line, "OK", 2) == 0) || (strncmp(line, "ERR", 3) == 0))
+                return 0;
+        }
+        return -1;
+    }
+
+    unsigned char header[BIN_HEADER];
+    char payload[BIN_MAXPAYLOAD];
+    while (fread(header, 1, BIN_HEADER, in) == BIN_HEADER) {
+        size_t len = (header[0] << 8) | header[1];
+        if (fread(payload, 1, len, in) != len)
+            return -1;
+        if ((header[2] == BIN_OK) || (header[2] == BIN_ERR))
+            return 0;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * open_conn connects "bc" to the server over its transport, setting "*in"
+ * and "*out" to streams for reading the replies and sending commands.
+ * Returns 0, or -1 on failure.
+ */
+static int open_conn(bench_conn *bc, FILE **in, FILE **out) {
+    if (bc->transport == BENCH_SHM)
+        return shmring_connect(local_path, in, out);
+
+    int fd = (bc->transport == BENCH_UNIX) ? connect_local(local_path) : connect_to(host, port);
+    if (fd < 0)
+        return -1;
+    int out_fd = dup(fd);
+    *in = fdopen(fd, "r");
+    *out = (out_fd < 0) ? NULL : fdopen(out_fd, "w");
+    if ((*in == NULL) || (*out == NULL)) {
+        perror("open_conn");
+        exit(1);
+    }
+    return 0;
+}
+
+/************************************************************************
+ * send_cmds sends the "len" bytes at "data" to the server on "out".
+ * Returns 0, or -1 on failure.
+ */
+static int send_cmds(FILE *out, char *data, size_t len) {
+    if ((fwrite(data, 1, len, out) != len) || (fflush(out) != 0))
+        return -1;
+    return 0;
+}
+
+/************************************************************************
+ * run_conn is the thread for one connection.
+ */
+static void *run_conn(void *arg) {
+    bench_conn *bc = arg;
+    FILE *in, *out;
+    if (open_conn(bc, &in, &out) < 0) {
+        bc->failed = 1;
+        return NULL;
+    }
+
+    char id[PLANE_MAXID+1];
+    snprintf(id, sizeof(id), "pb%d%c%c%d", (int)getpid() % 100000,
+             transport_names[bc->transport][0], bc->binary ? 'b' : 't', bc->index);
+
+    // The commands to set up, and a batch of alternating REQPOS and
+    // REQAHEAD to send over and over
+    char setup[256];
+    char *cmds = malloc(batch * (BIN_HEADER + 10));
+    if (cmds == NULL) {
+        perror("run_conn");
+        exit(1);
+    }
+    char *setup_end = setup;
+    char *cmds_end = cmds;
+    if (bc->binary) {
+        char reg[AIRPORT_MAXCODE + PLANE_MAXID];
+        memset(reg, 0, AIRPORT_MAXCODE);
+        strncpy(reg, bc->airport, AIRPORT_MAXCODE);
+        memcpy(reg + AIRPORT_MAXCODE, id, strlen(id));
+        setup_end += sprintf(setup_end, "BINARY\n");
+        setup_end = put_frame(setup_end, BIN_REG, 'M', reg, AIRPORT_MAXCODE + strlen(id));
+        setup_end = put_frame(setup_end, BIN_REQTAXI, 0, NULL, 0);
+        for (int i = 0; i < batch; i++)
+            cmds_end = put_frame(cmds_end, (i % 2 == 0) ? BIN_REQPOS : BIN_REQAHEAD, 0, NULL, 0);
+    } else {
+        setup_end += sprintf(setup_end, "REG %s %s\nREQTAXI\n", bc->airport, id);
+        for (int i = 0; i < batch; i++)
+            cmds_end += sprintf(cmds_end, (i % 2 == 0) ? "REQPOS\n" : "REQAHEAD\n");
+    }
+
+    // The OK to BINARY is the only text reply on a binary connection
+    if ((send_cmds(out, setup, setup_end - setup) < 0) ||
+        (bc->binary && (read_reply(in, 0) < 0)) ||
+        (read_reply(in, bc->binary) < 0) || (read_reply(in, bc->binary) < 0))
+        bc->failed = 1;
+
+    for (long sent = 0; (sent < commands) && !bc->failed; sent += batch) {
+        if (send_cmds(out, cmds, cmds_end - cmds) < 0) {
+            bc->failed = 1;
+            break;
+        }
+        for (int i = 0; i < batch; i++) {
+            if (read_reply(in, bc->binary) < 0) {
+                bc->failed = 1;
+                break;
+            }
+            bc->replies++;
+        }
+    }
+
+    if (bc->binary) {
+        char bye[BIN_HEADER];
+        put_frame(bye, BIN_BYE, 0, NULL, 0);
+        if (send_cmds(out, bye, BIN_HEADER) < 0)
+            bc->failed = 1;
+    } else if (send_cmds(out, "BYE\n", 4) < 0) {
+        bc->failed = 1;
+    }
+    free(cmds);
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+/************************************************************************
+ * run_bench runs "nconns" connections over "transport" using the binary
+ * protocol (if "binary" is true) or the text one, and returns the
+ * commands per second.
+ */
+static double run_bench(int nconns, int transport, int binary) {
+    bench_conn *conns = calloc(nconns, sizeof(bench_conn));
+    if (conns == NULL) {
+        perror("run_bench");
+        exit(1);
+    }
+    long long start = now_ms();
+    for (int i = 0; i < nconns; i++) {
+        conns[i].index = i;
+        conns[i].transport = transport;
+        conns[i].binary = binary;
+        snprintf(conns[i].airport, sizeof(conns[i].airport), "PB%c%c",
+                 transport_names[transport][0] - 'a' + 'A', binary ? 'B' : 'T');
+        pthread_create(&conns[i].tid, NULL, run_conn, &conns[i]);
+    }
+    long replies = 0;
+    int failed = 0;
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(conns[i].tid, NULL);
+        replies += conns[i].replies;
+        failed += conns[i].failed;
+    }
+    long long elapsed = now_ms() - start;
+    free(conns);
+
+    double rate = (elapsed > 0) ? replies * 1000.0 / elapsed : 0.0;
+    printf("%-4s %-6s  %ld commands in %lld ms: %.0f commands/s", transport_names[transport],
+           binary ? "binary" : "text", replies, elapsed, rate);
+    if (failed > 0)
+        printf(" (%d connections failed)", failed);
+    printf("\n");
+    return rate;
+}
+
+int main(int argc, char *argv[]) {
+    int nconns = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:c:n:b:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'u': local_path = optarg; break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'n': commands = atol(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-u path] [-c connections] [-n commands] [-b batch]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if ((nconns < 1) || (batch < 1) || (batch > 4096)) {
+        fprintf(stderr, "%s: need at least one connection, and a batch of 1 to 4096\n", argv[0]);
+        exit(1);
+    }
+
+    printf("%d connections, %ld commands each, in batches of %d\n", nconns, commands, batch);
+    int ntransports = (local_path != NULL) ? 3 : 1;
+    double tcp_text = 0.0;
+    for (int t = 0; t < ntransports; t++) {
+        double text = run_bench(nconns, t, 0);
+        double binary = run_bench(nconns, t, 1);
+        if (t == BENCH_TCP)
+            tcp_text = text;
+        if (text > 0)
+            printf("%s binary/text: %.2fx\n", transport_names[t], binary / text);
+        if ((t != BENCH_TCP) && (tcp_text > 0))
+            printf("%s/tcp text: %.2fx\n", transport_names[t], text / tcp_text);
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Module to keep the shared-memory departure board (see board.c) up to
+// date with the server's airports.
+
+// Changes only mark their airport as changed, which is cheap enough to do
+// while holding the queue and airplane list locks. A separate thread then
+// copies each changed airport (taking its locks briefly, like STATS does)
+// and writes it to the board. Changes that come in while the thread is
+// busy are coalesced into one write.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "publish.h"
+#include "board.h"
+#include "topology.h"
+#include "vclock.h"
+#include "wake.h"
+
+static board *the_board;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publish_wanted = PTHREAD_COND_INITIALIZER;
+static char changed[AIRPORT_MAX];   // Airports to write out again
+static int any_changed;
+
+/************************************************************************
+ * publish_copy copies airport "ap" into board section "to".
+ */
+static void publish_copy(airport *ap, board_airport *to) {
+    strcpy(to->code, ap->code);
+
+    pthread_rwlock_rdlock(&ap->planes.lock);
+    to->nplanes = ap->planes.planes.in_use;
+    for (int i = 0; (i < to->nplanes) && (i < BOARD_PLANES); i++) {
+        airplane *plane = ap->planes.planes.data[i];
+        strcpy(to->planes[i].id, plane->id);
+        to->planes[i].category = wake_letter(plane->category);
+        to->planes[i].state = plane->state;
+    }
+    pthread_rwlock_unlock(&ap->planes.lock);
+
+    pthread_mutex_lock(&ap->queue.mutex);
+    to->nqueued = ap->queue.count;
+    queue_entry *entry = ap->queue.head;
+    for (int i = 0; (i < to->nqueued) && (i < BOARD_QUEUE); i++, entry = entry->next) {
+        strcpy(to->queue[i].id, entry->id);
+        to->queue[i].category = wake_letter(entry->category);
+        to->queue[i].state = (entry == ap->queue.cleared) ? PLANE_CLEAR : PLANE_TAXIING;
+    }
+    to->cleared = (ap->queue.cleared != NULL);
+    to->last_category = (ap->queue.last_category < 0) ? 0 : wake_letter(ap->queue.last_category);
+    to->last_departure_ms = ap->queue.last_departure;
+    pthread_mutex_unlock(&ap->queue.mutex);
+
+    to->updated_ms = vclock_now_ms();
+}
+
+/************************************************************************
+ * publish_thread writes changed airports to the board.
+ */
+static void *publish_thread(void *arg) {
+    board_airport *staging = malloc(sizeof(board_airport));
+    char todo[AIRPORT_MAX];
+    if (staging == NULL) {
+        perror("publish_thread");
+        exit(1);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&publish_lock);
+        while (!any_changed)
+            pthread_cond_wait(&publish_wanted, &publish_lock);
+        memcpy(todo, changed, sizeof(todo));
+        memset(changed, 0, sizeof(changed));
+        any_changed = 0;
+        pthread_mutex_unlock(&publish_lock);
+
+        for (int i = 0; i < AIRPORT_MAX; i++) {
+            if (todo[i]) {
+                publish_copy(airports_get(i), staging);
+                board_write(the_board, i, staging);
+            }
+        }
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * publish_start creates the departure board file at "path" and starts
+ * keeping it up to date. Returns 0, or -1 on failure.
+ */
+int publish_start(char *path) {
+    board *b = board_create(path);
+    if (b == NULL)
+        return -1;
+
+    pthread_t tid;
+    pthread_mutex_lock(&publish_lock);
+    the_board = b;
+    for (int i = 0; i < airports_count(); i++)
+        changed[i] = any_changed = 1;
+    pthread_mutex_unlock(&publish_lock);
+    topology_create(&tid, TOPO_BACKGROUND, -1, "board", publish_thread, NULL);
+    pthread_detach(tid);
+    return 0;
+}
+
+/************************************************************************
+ * publish_changed marks airport "ap" as needing to be written to the
+ * board again (if there is a board).
+ */
+void publish_changed(airport *ap) {
+    if (the_board == NULL)
+        return;
+    pthread_mutex_lock(&publish_lock);
+    changed[ap->index] = 1;
+    if (!any_changed) {
+        any_changed = 1;
+        pthread_cond_signal(&publish_wanted);
+    }
+    pthread_mutex_unlock(&publish_lock);
+}
@@ -0,0 +1,11 @@
+// Prototypes for the module that publishes the departure board
+
+#ifndef _PUBLISH_H
+#define _PUBLISH_H
+
+#include "airport.h"
+
+int publish_start(char *path);
+void publish_changed(airport *ap);
+
+#endif  // _PUBLISH_H
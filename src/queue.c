@@ -2,246 +2,740 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
-#include "alist.h"
 #include "airplanelist.h"
 #include "airs_protocol.h"
 #include "airplane.h"
+#include "allocs.h"
+#include "wake.h"
+#include "vclock.h"
+#include "logger.h"
+#include "prealloc.h"
+#include "topology.h"
+#include "trace.h"
+#include "queue.h"
 
+/***************************************************************************
+ * queue_lock takes the queue mutex (timing the wait, for the tracer).
+ */
+static void queue_lock(queue *q) {
+    TRACE_BEGIN(wait);
+    pthread_mutex_lock(&q->mutex);
+    TRACE_END(wait, "queue lock");
+}
 
-static alist queue;
+/***************************************************************************
+ * queue_find returns the entry for flight plane_id, or NULL if it isn't in
+ * the queue, and sets "*position" (if not NULL) to its position. Must be
+ * called with the queue mutex held.
+ */
+static queue_entry *queue_find(queue *q, char* plane_id, int *position) {
+    int i = 0;
+    for (queue_entry *entry = q->head; entry != NULL; entry = entry->next, i++) {
+        if (strcmp(plane_id, entry->id) == 0) {
+            if (position != NULL) {
+                *position = i;
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
 
-//create a lock for airplane list
-pthread_rwlock_t queue_lock;
-pthread_t qtid[10];
-pthread_mutex_t queue_mutex;
-pthread_cond_t queue_not_empty;
-pthread_cond_t in_air_command;
+/***************************************************************************
+ * queue_nth returns the entry at position "index", or NULL if there isn't
+ * one. Must be called with the queue mutex held.
+ */
+static queue_entry *queue_nth(queue *q, int index) {
+    if (index < 0) {
+        return NULL;
+    }
+    queue_entry *entry = q->head;
+    for (int i = 0; (i < index) && (entry != NULL); i++) {
+        entry = entry->next;
+    }
+    return entry;
+}
 
 /***************************************************************************
- * airplanelist_init initializes an array list to empty and with the default
- * capacity and initilizes th thread.
+ * eta_after returns the ETA (clock ms) of a flight of wake category
+ * "category" behind flight "prev", or at the front of the queue if "prev"
+ * is NULL (when the runway is free). Must be called with the queue mutex
+ * held.
  */
-void queue_free(void *item) {
-    //free(item);
+static long long eta_after(queue *q, queue_entry *prev, int category) {
+    if (prev != NULL) {
+        return q->eta_base + prev->eta + q->roll_ms + wake_separation_ms(prev->category, category);
+    }
+    long long ready = q->last_departure + wake_separation_ms(q->last_category, category);
+    long long now = vclock_now_ms();
+    return (ready > now) ? ready : now;
 }
 
-void* process_queue(void*) {
-    while (1) {
-        
-        pthread_mutex_lock(&queue_mutex);
+/***************************************************************************
+ * eta_set sets the ETA of "entry" to "eta" (clock ms), and moves the ETA
+ * of every flight behind it by the same amount. It walks whichever side
+ * of "entry" is shorter: the flights behind it, or (moving the base
+ * instead) the ones in front of it. Must be called with the queue mutex
+ * held.
+ */
+static void eta_set(queue *q, queue_entry *entry, long long eta) {
+    long long delta = eta - (q->eta_base + entry->eta);
+    if (delta == 0) {
+        return;
+    }
+    queue_entry *before = entry->prev;
+    queue_entry *after = entry->next;
+    while ((before != NULL) && (after != NULL)) {
+        before = before->prev;
+        after = after->next;
+    }
+    if (after == NULL) {
+        for (queue_entry *moved = entry; moved != NULL; moved = moved->next) {
+            moved->eta += delta;
+        }
+    } else {
+        q->eta_base += delta;
+        for (queue_entry *kept = entry->prev; kept != NULL; kept = kept->prev) {
+            kept->eta -= delta;
+        }
+    }
+}
+
+/***************************************************************************
+ * eta_refresh works out the ETAs of the flights that were behind flights
+ * that have left (see queue_unlink) again, behind their new neighbours,
+ * moving the flights behind each of them by the same amount. This is one
+ * pass over the queue however many flights left, and nothing if none did.
+ * Must be called with the queue mutex held, before any ETA is used.
+ */
+static void eta_refresh(queue *q) {
+    if (!q->eta_stale) {
+        return;
+    }
+    long long moved = 0;
+    for (queue_entry *entry = q->head; entry != NULL; entry = entry->next) {
+        entry->eta += moved;
+        if (entry->eta_stale) {
+            long long eta = eta_after(q, entry->prev, entry->category) - q->eta_base;
+            moved += eta - entry->eta;
+            entry->eta = eta;
+            entry->eta_stale = 0;
+        }
+    }
+    q->eta_stale = 0;
+}
+
+/***************************************************************************
+ * queue_unlink takes "entry" out of the queue and frees it (or keeps it
+ * for reuse, if the queue has reserved entries). If it was holding the
+ * runway, the runway is released, and its plane (if it still has one) is
+ * told it is no longer queued. The flights behind it move up, but their
+ * ETAs are only marked stale, for eta_refresh, so that this takes constant
+ * time however deep the queue is. Must be called with the queue mutex
+ * held.
+ */
+static void queue_unlink(queue *q, queue_entry *entry) {
+    queue_entry *next = entry->next;
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        q->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        q->tail = entry->prev;
+    }
+    q->count--;
+    if (entry == q->cleared) {
+        q->cleared = NULL;
+    }
+    if (entry->plane != NULL) {
+        entry->plane->queued = NULL;
+    }
+    if (q->reserved > 0) {
+        entry->next = q->spare;
+        q->spare = entry;
+    } else {
+        q->entry_free(entry);
+    }
+    if (next != NULL) {
+        next->eta_stale = 1;
+        q->eta_stale = 1;
+    }
+}
+
+/***************************************************************************
+ * queue_notify tells the queue's watcher (if it has one) about a change.
+ * Must be called with the queue mutex held, so that changes are reported
+ * in the order they happen.
+ */
+static void queue_notify(queue *q, int event, queue_entry *entry) {
+    if (q->notify != NULL) {
+        q->notify(q, event, entry, q->notify_arg);
+    }
+}
+
+/***************************************************************************
+ * queue_pick asks the wake sequencer which queued flight should take the
+ * runway next. Must be called with the queue mutex held.
+ */
+static int queue_pick(queue *q) {
+    int cats[WAKE_WINDOW];
+    int overtaken[WAKE_WINDOW];
+    int n = 0;
+    for (queue_entry *entry = q->head; (entry != NULL) && (n < WAKE_WINDOW); entry = entry->next) {
+        cats[n] = entry->category;
+        overtaken[n] = entry->overtaken;
+        n++;
+    }
+    return wake_pick(q->last_category, cats, overtaken, n);
+}
+
+/***************************************************************************
+ * queue_move_front moves "entry" to the front of the queue, so that
+ * position 1 is always the flight cleared for takeoff, and counts one more
+ * overtake for every flight it passed. Must be called with the queue
+ * mutex held.
+ */
+static void queue_move_front(queue *q, queue_entry *entry) {
+    if (entry == q->head) {
+        return;
+    }
+    for (queue_entry *passed = entry->prev; passed != NULL; passed = passed->prev) {
+        passed->overtaken++;
+    }
+
+    entry->prev->next = entry->next;
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        q->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = q->head;
+    q->head->prev = entry;
+    q->head = entry;
+}
+
+/***************************************************************************
+ * queue_clear_flight gives the runway to "entry" (at the front of the
+ * queue, where queue_move_front puts it), as of now. Its ETA becomes now,
+ * and the flights it passed, and the one that was behind it, get new
+ * ETAs behind their new neighbours (the flights further back move with
+ * the last of them). Must be called with the queue mutex held.
+ */
+static void queue_clear_flight(queue *q, queue_entry *entry) {
+    eta_refresh(q);
+    queue_entry *behind = entry->next;
+    queue_move_front(q, entry);
+    q->cleared = entry;
 
-        while (queue.in_use == 0) {
-            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+    eta_set(q, entry, vclock_now_ms());
+    for (queue_entry *moved = entry->next; moved != NULL; moved = moved->next) {
+        eta_set(q, moved, eta_after(q, moved->prev, moved->category));
+        if (moved == behind) {
+            break;
         }
+    }
+}
 
+/***************************************************************************
+ * queue_dispatch_locked is one step of the runway scheduler. If the runway
+ * is free and there is a flight in the queue, it picks the next flight
+ * with the wake sequencer, and if the separation required behind the
+ * previous departure has passed, clears that flight for takeoff. It
+ * returns the clock time (ms) at which it should be called again, or -1
+ * if nothing can happen until the queue or runway changes. Must be called
+ * with the queue mutex held.
+ */
+static long long queue_dispatch_locked(queue *q) {
+    while (!q->held && (q->cleared == NULL) && (q->head != NULL)) {
+        queue_entry *next = queue_nth(q, queue_pick(q));
+        long long ready = q->last_departure + wake_separation_ms(q->last_category, next->category);
+        if (vclock_now_ms() < ready) {
+            return ready;
+        }
 
-        char* plane_id = alist_get(&queue, 0);
-        
-        if (strcmp(plane_id, alist_get(&queue, 0))){
-             continue;
+        // How far off the ETA given when it joined the queue was
+        long long err = vclock_now_ms() - next->eta_promised;
+        if (err < 0) {
+            err = -err;
         }
+        q->eta_checked++;
+        q->eta_err_total += err;
+        if (err > q->eta_err_max) {
+            q->eta_err_max = err;
+        }
+
+        // A plane takes its entry out before it goes, so this is still here
+        airplane* plane = next->plane;
+        queue_clear_flight(q, next);
+        queue_notify(q, QUEUE_EV_CLEARED, next);
 
-        airplane* plane = queue_to_airplanelist(plane_id);
         // Send response back to client
         plane->state = PLANE_CLEAR;
-        printf("Clearing flight %s\n", plane_id);
+        LOG(LOG_INFO, "Clearing flight %s (%c)", next->id, wake_letter(next->category));
         send_takeoff(plane);
+    }
+    return -1;
+}
+
+/***************************************************************************
+ * queue_dispatch runs one step of the runway scheduler, for callers (like
+ * the simulator) that drive the runway without the manager thread.
+ */
+long long queue_dispatch(queue *q) {
+    queue_lock(q);
+    long long next = queue_dispatch_locked(q);
+    pthread_mutex_unlock(&q->mutex);
+    return next;
+}
+
+/***************************************************************************
+ * process_queue is the runway manager thread for queue "arg". It runs the
+ * scheduler, and then sleeps on the queue's condition variable until
+ * either something changes or the separation it is waiting for has passed.
+ */
+void* process_queue(void* arg) {
+    queue *q = arg;
+    TRACE_NAME("runway");
+    queue_lock(q);
+    while (1) {
+        TRACE_BEGIN(dispatch);
+        ALLOCS_BEGIN();
+        long long ready = queue_dispatch_locked(q);
+        ALLOCS_END();
+        TRACE_END(dispatch, "runway dispatch");
 
-        while (plane->state != PLANE_INAIR) {
-            pthread_cond_wait(&in_air_command, &queue_mutex);
+        TRACE_BEGIN(wait);
+        if (ready < 0) {
+            pthread_cond_wait(&q->changed, &q->mutex);
+        } else {
+            // Flights may join or leave while we wait, so pick again after
+            struct timespec deadline;
+            deadline.tv_sec = ready / 1000;
+            deadline.tv_nsec = (ready % 1000) * 1000000;
+            pthread_cond_timedwait(&q->changed, &q->mutex, &deadline);
         }
-        
-        plane->state = PLANE_DONE;
-        alist_remove(&queue, 0);
-        pthread_mutex_unlock(&queue_mutex);
-        sleep(4); 
+        TRACE_END(wait, "runway wait");
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * queue_init initializes a taxi queue to empty, with entries freed by
+ * "data_free". The runway manager thread is started separately by
+ * queue_start_runway.
+ */
+void queue_init(queue *q, void (*data_free)(void *data)) {
+    pthread_mutex_init(&q->mutex, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    q->head = NULL;
+    q->tail = NULL;
+    q->count = 0;
+    q->entry_free = data_free;
+    q->notify = NULL;
+    q->notify_arg = NULL;
+    q->cleared = NULL;
+    q->last_category = -1;
+    q->last_departure = vclock_now_ms();
+    q->held = 0;
+    q->eta_base = 0;
+    q->eta_stale = 0;
+    q->roll_ms = ETA_ROLL_START_MS;
+    q->eta_checked = 0;
+    q->eta_err_total = 0;
+    q->eta_err_max = 0;
+    q->spare = NULL;
+    q->block = NULL;
+    q->reserved = 0;
+}
+
+/***************************************************************************
+ * queue_set_notify sets a function to be called (with the queue mutex
+ * held) every time a flight joins, leaves, is cleared or departs.
+ */
+void queue_set_notify(queue *q, queue_notify_fn notify, void *arg) {
+    queue_lock(q);
+    q->notify = notify;
+    q->notify_arg = arg;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/***************************************************************************
+ * queue_start_runway starts the runway manager thread for the queue, as
+ * runway thread number "index" (see topology.c), called "name".
+ */
+void queue_start_runway(queue *q, int index, const char *name) {
+    topology_create(&q->tid, TOPO_RUNWAY, index, name, process_queue, q);
+}
+
+/***************************************************************************
+ * queue_reserve makes "count" entries for the queue ahead of time, and
+ * locks them in memory (see prealloc_lock). From then on, entries that
+ * leave the queue are kept for the flights that join it next, so the
+ * queue only asks for memory if it grows longer than it has ever been.
+ */
+void queue_reserve(queue *q, int count) {
+    queue_entry *block = calloc(count, sizeof(queue_entry));
+    if (block == NULL) {
+        perror("queue_reserve");
+        exit(1);
+    }
+    prealloc_lock(block, count * sizeof(queue_entry));
 
+    queue_lock(q);
+    for (int i = count - 1; i >= 0; i--) {
+        block[i].next = q->spare;
+        q->spare = &block[i];
     }
+    q->block = block;
+    q->reserved = count;
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_init initializes an array list to empty and with the default
- * capacity and initilizes th thread.
+ * queue_free frees a queue entry.
  */
-void queue_init(void (*data_free)(void *data)) {
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_cond_init(&queue_not_empty, NULL);
-    alist_init(&queue, queue_free);
-    //init the lock
-    pthread_rwlock_init(&(queue_lock), NULL);
-    pthread_create(&qtid[0], NULL, process_queue, NULL); 
+void queue_free(void *item) {
+    free(item);
 }
 
 /***************************************************************************
- * airplanelist_clear resets the size of the array list to 0 
- * (empties the alist).
+ * queue_clear takes every flight out of the queue.
  */
-void queue_clear() {
-    alist_clear(&queue);
+void queue_clear(queue *q) {
+    queue_lock(q);
+    while (q->head != NULL) {
+        queue_notify(q, QUEUE_EV_REMOVED, q->head);
+        queue_unlink(q, q->head);
+    }
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_is_empty returns true if and only if the list of airplanes 
- * is empty.
+ * queue_is_empty returns true if and only if the queue is empty.
  */
-int queue_is_empty() {
-    return alist_is_empty(&queue);
+int queue_is_empty(queue *q) {
+    return q->count == 0;
 }
 
 /***************************************************************************
- * airplanelist_size returns the size of the array list
+ * queue_size returns the size of the queue
  */
-int queue_size() {
-    int size = alist_size(&queue);
-    return size;
+int queue_size(queue *q) {
+    return q->count;
 }
 
 /***************************************************************************
- * airplanelist_get returns the value at array index "index", or NULL if 
+ * queue_get returns the flight id at queue index "index", or NULL if
  * this is an invalid index.
  */
-char* queue_get(int index) {
-    pthread_rwlock_wrlock(&(queue_lock));
-    char *retval = alist_get(&queue, index);
-    pthread_rwlock_unlock(&(queue_lock));
-    return retval;
+char* queue_get(queue *q, int index) {
+    queue_lock(q);
+    queue_entry *entry = queue_nth(q, index);
+    pthread_mutex_unlock(&q->mutex);
+    return (entry == NULL) ? NULL : entry->id;
 }
 
 /***************************************************************************
- * airplanelist_add appends a new value to the end of the array list.
+ * queue_add appends flight "plane" with wake category "category" to the
+ * end of the queue. If the plane is already queued, nothing happens: its
+ * entry is the only one that may point at it, since that is the one it
+ * takes out when it leaves.
  */
-void queue_add(char* val) {
-    pthread_rwlock_wrlock(&(queue_lock));
-    alist_add(&queue, val);
-    pthread_rwlock_unlock(&(queue_lock));
+void queue_add(queue *q, airplane* plane, int category) {
+    queue_lock(q);
+    if (plane->queued != NULL) {
+        pthread_mutex_unlock(&q->mutex);
+        return;
+    }
+    queue_entry *entry = q->spare;
+    if (entry != NULL) {
+        q->spare = entry->next;
+    } else if ((entry = malloc(sizeof(queue_entry))) == NULL) {
+        perror("queue_add");
+        exit(1);
+    }
+    strncpy(entry->id, plane->id, PLANE_MAXID);
+    entry->id[PLANE_MAXID] = '\0';
+    entry->category = category;
+    entry->overtaken = 0;
+    entry->plane = plane;
+    entry->next = NULL;
+    entry->eta_stale = 0;
+    eta_refresh(q);
+    entry->eta = eta_after(q, q->tail, category) - q->eta_base;
+    entry->eta_promised = q->eta_base + entry->eta;
+    entry->prev = q->tail;
+    if (q->tail != NULL) {
+        q->tail->next = entry;
+    } else {
+        q->head = entry;
+    }
+    q->tail = entry;
+    q->count++;
+    plane->queued = entry;
+    queue_notify(q, QUEUE_EV_ADDED, entry);
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_set sets the index "index" airplane to value "newval". If the
- * index/position doesn't exist in the list, then nothing happens (the
+ * queue_set changes the flight id at index "index" to "newval". If the
+ * index/position doesn't exist in the queue, then nothing happens (the
  * request is ignored).
  */
-void queue_set(int index, char* newval) {
-    pthread_rwlock_wrlock(&(queue_lock));
-    alist_set(&queue, index, newval);
-    pthread_rwlock_unlock(&(queue_lock));
+void queue_set(queue *q, int index, char* newval) {
+    queue_lock(q);
+    queue_entry *entry = queue_nth(q, index);
+    if (entry != NULL) {
+        strncpy(entry->id, newval, PLANE_MAXID);
+        entry->id[PLANE_MAXID] = '\0';
+    }
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_remove take the element at index "index" out of the list
- * (decreasing list size by 1). If the index/position doesn't exist in
- * the list, then nothing happens.
+ * queue_remove takes flight "plane_id" out of the queue (decreasing queue
+ * size by 1). If it was holding the runway, the runway is released. If the
+ * flight isn't in the queue, then nothing happens.
  */
-void queue_remove(char* plane_id) {
-    int index = -1;
-    for (size_t i = 0; i < queue.in_use; i++) {
-        char* comapare_airplane_id = queue_get(i);
-        if (strcmp(plane_id, comapare_airplane_id) == 0) {
-            index = i;
-        }
+void queue_remove(queue *q, char* plane_id) {
+    queue_lock(q);
+    queue_entry *entry = queue_find(q, plane_id, NULL);
+    if (entry != NULL) {
+        queue_notify(q, QUEUE_EV_REMOVED, entry);
+        queue_unlink(q, entry);
+        pthread_cond_signal(&q->changed);
     }
-    if (index <= -1) {
-        return;
-    }
-    
-    pthread_rwlock_wrlock(&(queue_lock));
-    alist_remove(&queue, index);
-    pthread_rwlock_unlock(&(queue_lock));
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_destroy destroys the current array list, freeing up all memory
- * and resources.
+ * queue_leave takes "plane" out of the queue, like queue_remove, but goes
+ * straight to its entry instead of looking for its id. This is how a plane
+ * that disconnects leaves. If it isn't queued, nothing happens.
  */
-void queue_destroy() {
-    alist_destroy(&queue);
-    pthread_rwlock_destroy(&queue_lock);
-    pthread_cond_destroy(&queue_not_empty);
-    pthread_cond_destroy(&in_air_command);
+void queue_leave(queue *q, airplane* plane) {
+    queue_lock(q);
+    queue_entry *entry = plane->queued;
+    if (entry != NULL) {
+        queue_notify(q, QUEUE_EV_REMOVED, entry);
+        queue_unlink(q, entry);
+        pthread_cond_signal(&q->changed);
+    }
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplanelist_destroy destroys the current array list, freeing up all memory
+ * queue_destroy destroys the current queue, freeing up all memory
  * and resources.
  */
-int queue_position(char* plane_id) {
-    int position = 0;
-    for (size_t i = 0; i < queue.in_use; i++) {
-        char* compare_id = queue_get(i);
-        int compared_value = strcmp(plane_id, compare_id);
-        if (compared_value == 0) {
-            position = i;
+void queue_destroy(queue *q) {
+    while (q->head != NULL) {
+        queue_unlink(q, q->head);
+    }
+    while (q->spare != NULL) {
+        queue_entry *entry = q->spare;
+        q->spare = entry->next;
+        if ((entry < q->block) || (entry >= q->block + q->reserved)) {
+            q->entry_free(entry);
         }
-        
     }
-    return position; 
+    free(q->block);
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->mutex);
 }
 
-
+/***************************************************************************
+ * queue_position returns the (0-based) position of flight "plane_id" in
+ * the queue, or 0 if it isn't in the queue.
+ */
+int queue_position(queue *q, char* plane_id) {
+    int position = 0;
+    queue_lock(q);
+    queue_find(q, plane_id, &position);
+    pthread_mutex_unlock(&q->mutex);
+    return position;
+}
 
 /***************************************************************************
- * airplanelist_print prints out list of airplanes in the order they were
- * registered. Used for debugging the program.
+ * queue_print prints out the queue in takeoff order. Used for debugging
+ * the program.
  */
-void queue_print() {
+void queue_print(queue *q) {
     printf("Current Queue\n");
-    //pthread_rwlock_wrlock(&(airplanelist_lock));
-    for (size_t i = 0; i < queue.in_use; i++) {
-        char* plane_id = queue_get(i);
-        
-        printf("%ld. %s\n", (i+1), plane_id);
+    queue_lock(q);
+    int i = 0;
+    for (queue_entry *entry = q->head; entry != NULL; entry = entry->next) {
+        printf("%d. %s (%c)\n", ++i, entry->id, wake_letter(entry->category));
     }
-    //pthread_rwlock_unlock(&(airplanelist_lock));
+    pthread_mutex_unlock(&q->mutex);
 }
 
 /***************************************************************************
- * airplane_exist will return true the airplane id that is trying to be 
- * registered already exist in the list of airplanes
+ * queue_exist will return true if flight "plane_id" is in the queue
  */
-int queue_exist(char* plane_id) {
-    int already_exist = 0;
-    for (size_t i = 0; i < queue.in_use; i++) {
-        char* compare_id = queue_get(i);
-        int compared_value = strcmp(plane_id, compare_id);
-        if (compared_value == 0) {
-            already_exist = 1;
-            return already_exist;
-        }
-    }
+int queue_exist(queue *q, char* plane_id) {
+    queue_lock(q);
+    int already_exist = (queue_find(q, plane_id, NULL) != NULL);
+    pthread_mutex_unlock(&q->mutex);
     return already_exist;
-    
 }
 
-void queue_reqtaxi(airplane* plane) {
-    queue_add(plane->id);
-    pthread_cond_signal(&queue_not_empty);
+void queue_reqtaxi(queue *q, airplane* plane) {
+    queue_add(q, plane, plane->category);
+}
+
+void queue_getahead(queue *q, airplane* plane) {
+    queue_lock(q);
+    int position = 0;
+    queue_find(q, plane->id, &position);
+
+    // A preallocated session has room for the ids, unless there are a lot
+    session *ses = plane->session;
+    char (*ids)[PLANE_MAXID+1];
+    if ((ses != NULL) && (position <= ses->ahead_max)) {
+        ids = ses->ahead;
+    } else if ((ids = malloc((PLANE_MAXID + 1) * position + 1)) == NULL) {
+        pthread_mutex_unlock(&q->mutex);
+        perror("queue_getahead");
+        exit(1);
+    }
+    queue_entry *entry = q->head;
+    for (int i = 0; i < position; i++, entry = entry->next) {
+        strcpy(ids[i], entry->id);
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    send_ok_flights(plane, ids, position);
+    if ((ses == NULL) || (ids != ses->ahead)) {
+        free(ids);
+    }
+}
+
+/***************************************************************************
+ * queue_eta returns how long (ms) until "plane" is expected to be cleared
+ * for takeoff (0 if it is overdue), or -1 if it isn't in the queue. This
+ * only reads the ETA that the queue keeps for it (once any stale ETAs
+ * have been worked out again, if the runway hasn't done that yet).
+ */
+long long queue_eta(queue *q, airplane* plane) {
+    long long wait = -1;
+    queue_lock(q);
+    eta_refresh(q);
+    if (plane->queued != NULL) {
+        wait = q->eta_base + plane->queued->eta - vclock_now_ms();
+        if (wait < 0) {
+            wait = 0;
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return wait;
 }
 
-void queue_getahead(airplane* plane) {
-    char* message = "OK ";
-    char *list = malloc((PLANE_MAXID + 3) * queue_position(plane->id));
-    strcat(list, message);
+/***************************************************************************
+ * queue_eta_stats gives how many flights have been cleared (in
+ * "*checked"), and the total and largest difference (ms) between when
+ * they were cleared and the ETA they were given when they joined the
+ * queue.
+ */
+void queue_eta_stats(queue *q, long long *checked, long long *err_total, long long *err_max) {
+    queue_lock(q);
+    *checked = q->eta_checked;
+    *err_total = q->eta_err_total;
+    *err_max = q->eta_err_max;
+    pthread_mutex_unlock(&q->mutex);
+}
 
-    int position = queue_position(plane->id);
-    for (size_t i = 0; i < position; i++) {
-        char* plane_id = queue_get(i);
-        strcat(list, plane_id);
-        if (i < (position - 1)) {
-            strcat(list, ", ");
+/***************************************************************************
+ * queue_departed records that the flight with queue entry "entry" (wake
+ * category "category") has taken off: it leaves the queue (if "entry"
+ * isn't NULL) and frees the runway if it was holding it, and the
+ * separation behind it starts counting from now. How long it took since
+ * it was cleared goes into the expected roll time. Must be called with
+ * the queue mutex held.
+ */
+static void queue_departed(queue *q, queue_entry *entry, int category) {
+    q->last_category = category;
+    q->last_departure = vclock_now_ms();
+    if (entry != NULL) {
+        if (entry == q->cleared) {
+            long long roll = q->last_departure - (q->eta_base + entry->eta);
+            q->roll_ms += (roll - q->roll_ms) / ETA_ROLL_WEIGHT;
         }
-        
+        queue_notify(q, QUEUE_EV_DEPARTED, entry);
+        queue_unlink(q, entry);
+    }
+    pthread_cond_signal(&q->changed);
+}
+
+/***************************************************************************
+ * queue_mark_cleared makes flight "plane_id" the one holding the runway,
+ * without telling the plane. This is for rebuilding a queue from another
+ * server's state (which already sent the TAKEOFF).
+ */
+void queue_mark_cleared(queue *q, char* plane_id) {
+    queue_lock(q);
+    queue_entry *entry = queue_find(q, plane_id, NULL);
+    if (entry != NULL) {
+        queue_clear_flight(q, entry);
+        queue_notify(q, QUEUE_EV_CLEARED, q->cleared);
+        pthread_cond_signal(&q->changed);
     }
-    
-    fprintf(plane->fp_send, "%s\n", list);
-    free(list);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/***************************************************************************
+ * queue_mark_departed records a takeoff reported to another server
+ * "ago_ms" milliseconds ago, in the same way as queue_inair but without
+ * any plane to talk to.
+ */
+void queue_mark_departed(queue *q, char* plane_id, int category, long long ago_ms) {
+    queue_lock(q);
+    queue_departed(q, queue_find(q, plane_id, NULL), category);
+    q->last_departure -= ago_ms;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/***************************************************************************
+ * queue_hold stops the runway from clearing any more flights (if "held" is
+ * true) or lets it carry on (if false). A flight that is already cleared
+ * can still take off.
+ */
+void queue_hold(queue *q, int held) {
+    queue_lock(q);
+    q->held = held;
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->mutex);
 }
 
-void queue_inair(airplane* plane) {
+/***************************************************************************
+ * queue_inair handles a cleared flight reporting that it has taken off: it
+ * leaves the queue and frees the runway, and the separation behind it
+ * starts counting from now.
+ */
+void queue_inair(queue *q, airplane* plane) {
     send_ok(plane);
-    printf("Client %ld disconnected. \n", plane->tid);
+    LOG(LOG_INFO, "Client %ld disconnected.", plane->tid);
+
+    queue_lock(q);
     plane->state = PLANE_INAIR;
-    fprintf(plane->fp_send, "NOTICE Disconnecting from ground control - please connect to air control\n");
-    printf("Flight %s is in the air -- waiting 4 seconds\n", plane->id);
-    pthread_cond_signal(&in_air_command);
-}
\ No newline at end of file
+    queue_departed(q, plane->queued, plane->category);
+    pthread_mutex_unlock(&q->mutex);
+
+    send_notice(plane, "Disconnecting from ground control - please connect to air control");
+    LOG(LOG_INFO, "Flight %s (%c) is in the air", plane->id, wake_letter(plane->category));
+    plane->state = PLANE_DONE;
+}
@@ -4,30 +4,119 @@
 #include <pthread.h>
 
 #include "airplane.h"
+#include "airplanelist.h"
 #include "airs_protocol.h"
 #include "alist.h"
 
 #define DEF_CAPACITY 10
 
+// The time (ms) a cleared flight is expected to take to report INAIR,
+// before any flight has, and how much of the difference each departure
+// moves the estimate by (1/ETA_ROLL_WEIGHT)
 
+#define ETA_ROLL_START_MS 1000
+#define ETA_ROLL_WEIGHT 8
 
-void queue_init(void (*data_free)(void *data));
+// Each flight in the taxi queue keeps a copy of its id, its wake category,
+// how many later flights the sequencer has let go ahead of it, and the
+// airplane it belongs to. The airplane points back at its entry (see
+// airplane.h), and both pointers only change with the queue mutex held,
+// so a plane that disconnects can leave without its entry being searched
+// for. The entries are a doubly-linked list in takeoff order, so that any
+// of them can be taken out in constant time.
+//
+// Each flight also has an estimated time of clearance (its ETA), which is
+// kept up to date as the queue changes rather than worked out when it is
+// asked for. A flight's ETA is the one before it plus the expected roll
+// time and the wake separation between them (the first one goes as soon
+// as the separation behind the last departure has passed). So that a
+// change near the front doesn't have to touch every flight behind it, the
+// ETAs are stored relative to the queue's "eta_base", and moving every
+// flight from some point on moves the base instead when that is less
+// work. A flight leaving doesn't move anything: the flight behind it is
+// marked "eta_stale", and the stale ETAs are worked out in one pass the
+// next time an ETA is needed (a flight joining, being cleared or asking
+// for its ETA). Leaving stays constant time, and however many flights
+// leave in between cost one pass between them.
+
+typedef struct queue_entry {
+    char id[PLANE_MAXID+1];
+    int category;
+    int overtaken;
+    long long eta;              // ETA (clock ms), less the queue's eta_base
+    long long eta_promised;     // ETA (clock ms) when it joined the queue
+    int eta_stale;              // The flight in front of it left
+    airplane *plane;
+    struct queue_entry *prev;
+    struct queue_entry *next;
+} queue_entry;
+
+// Changes reported to a queue's notify function
+
+#define QUEUE_EV_ADDED 0      // Flight joined the queue (REQTAXI)
+#define QUEUE_EV_REMOVED 1    // Flight left without taking off
+#define QUEUE_EV_CLEARED 2    // Flight cleared for takeoff
+#define QUEUE_EV_DEPARTED 3   // Flight reported INAIR
+
+struct queue;
+typedef void (*queue_notify_fn)(struct queue *q, int event, queue_entry *entry, void *arg);
+
+// A taxi queue and the runway it feeds. "mutex" protects the entries and
+// the runway state, and "changed" is signalled whenever either of them
+// changes, which is what the runway thread waits on.
+
+typedef struct queue {
+    queue_entry *head;          // First flight in takeoff order (or NULL)
+    queue_entry *tail;
+    int count;                  // Flights in the queue
+    void (*entry_free)(void *entry);
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    queue_entry *cleared;       // Flight holding the runway, or NULL
+    int last_category;          // Category of last departure (-1 = none)
+    long long last_departure;   // When it reported INAIR (ms)
+    int held;                   // No clearances while set (queue_hold)
+    pthread_t tid;              // Runway manager thread
+    queue_notify_fn notify;     // Called on every change (or NULL)
+    void *notify_arg;
+    long long eta_base;         // Added to every flight's eta
+    int eta_stale;              // Some flight's eta is stale
+    long long roll_ms;          // Expected time from clearance to INAIR
+    long long eta_checked;      // Flights cleared with a promised ETA
+    long long eta_err_total;    // Sum of how far off those were (ms)
+    long long eta_err_max;
+    queue_entry *spare;         // Entries kept for reuse (see queue_reserve)
+    queue_entry *block;         // The entries queue_reserve made (or NULL)
+    int reserved;               // How many there are
+} queue;
+
+void queue_init(queue *q, void (*data_free)(void *data));
+void queue_set_notify(queue *q, queue_notify_fn notify, void *arg);
+void queue_start_runway(queue *q, int index, const char *name);
+long long queue_dispatch(queue *q);
+void queue_reserve(queue *q, int count);
 void queue_free(void *queue_item);
-void queue_clear();
-int queue_is_empty();
-int queue_size();
-char* queue_get(int index);
-void queue_add(char* val);
-void queue_set(int index, char* newval);
-void queue_remove(char* plane_id);
-void queue_destroy();
-int queue_position(char* plane_id);
-void queue_print();
-int queue_exist(char* plane_id);
-void queue_reqtaxi(airplane* plane);
-void queue_getahead(airplane* plane);
-void queue_inair(airplane* plane);
-
-
-
-#endif
\ No newline at end of file
+void queue_clear(queue *q);
+int queue_is_empty(queue *q);
+int queue_size(queue *q);
+char* queue_get(queue *q, int index);
+void queue_add(queue *q, airplane* plane, int category);
+void queue_set(queue *q, int index, char* newval);
+void queue_remove(queue *q, char* plane_id);
+void queue_leave(queue *q, airplane* plane);
+void queue_destroy(queue *q);
+int queue_position(queue *q, char* plane_id);
+void queue_print(queue *q);
+int queue_exist(queue *q, char* plane_id);
+void queue_reqtaxi(queue *q, airplane* plane);
+void queue_getahead(queue *q, airplane* plane);
+long long queue_eta(queue *q, airplane* plane);
+void queue_eta_stats(queue *q, long long *checked, long long *err_total, long long *err_max);
+void queue_inair(queue *q, airplane* plane);
+void queue_mark_cleared(queue *q, char* plane_id);
+void queue_mark_departed(queue *q, char* plane_id, int category, long long ago_ms);
+void queue_hold(queue *q, int held);
+
+
+
+#endif
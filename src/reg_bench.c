@@ -0,0 +1,159 @@
+// Benchmark for the airplane registry.
+
+// This registers a large number of flights in one airplanelist (a million
+// by default), the way the server does, and then measures lookups by
+// flight id and full scans of the list. For comparison it does the same
+// lookups and scans the way the registry used to: going through the array
+// of pointers and reading each plane's own struct. The planes are
+// registered in a different order from the one they were allocated in, as
+// they would be in a server that has been running for a while, so that
+// following the pointers doesn't just walk through memory in order.
+//
+// Usage: reg_bench [-n flights] [-l lookups] [-s scans]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "airplane.h"
+#include "airplanelist.h"
+
+static airplanelist list;
+static char (*ids)[PLANE_MAXID+1];
+static int nflights = 1000000;
+
+/************************************************************************
+ * now_ns returns the current time in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/************************************************************************
+ * pointer_index finds flight "id" the old way, comparing the id in every
+ * plane's struct in turn, and returns its index (or -1).
+ */
+static int pointer_index(char *id) {
+    for (int i = 0; i < list.planes.in_use; i++) {
+        airplane *plane = list.planes.data[i];
+        if (strcmp(id, plane->id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * pointer_detached looks for a detached plane the old way, and returns
+ * its index (or -1).
+ */
+static int pointer_detached() {
+    for (int i = 0; i < list.planes.in_use; i++) {
+        if (airplane_detached(list.planes.data[i]))
+            return i;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * report prints "count" operations of kind "what" done in "ns"
+ * nanoseconds, as a rate in "per" units (for scans, flights looked at).
+ */
+static void report(char *what, long count, long long ns, char *per) {
+    printf("%-26s %12.0f %s/s  (%.2f ns each)\n", what,
+           (double)count * 1e9 / ns, per, (double)ns / count);
+}
+
+/************************************************************************
+ * register_all makes and registers every flight, in shuffled order.
+ */
+static void register_all() {
+    airplane **planes = malloc(nflights * sizeof(airplane *));
+    ids = malloc(nflights * sizeof(*ids));
+    if ((planes == NULL) || (ids == NULL)) {
+        perror("reg_bench");
+        exit(1);
+    }
+    for (int i = 0; i < nflights; i++) {
+        planes[i] = malloc(sizeof(airplane));
+        if (planes[i] == NULL) {
+            perror("reg_bench");
+            exit(1);
+        }
+        // Not detached, but with no files that need closing
+        airplane_init(planes[i], stdout, NULL);
+        snprintf(ids[i], sizeof(ids[i]), "RB%d", i);
+    }
+    for (int i = nflights - 1; i > 0; i--) {
+        int j = random() % (i + 1);
+        airplane *plane = planes[i];
+        planes[i] = planes[j];
+        planes[j] = plane;
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < nflights; i++)
+        airplanelist_register(&list, planes[i], ids[i]);
+    report("register", nflights, now_ns() - start, "flights");
+    free(planes);
+}
+
+int main(int argc, char *argv[]) {
+    long lookups = 1000000;
+    int scans = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+        switch (opt) {
+        case 'n': nflights = atoi(optarg); break;
+        case 'l': lookups = atol(optarg); break;
+        case 's': scans = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n flights] [-l lookups] [-s scans]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if ((nflights < 1) || (lookups < 1) || (scans < 1)) {
+        fprintf(stderr, "%s: need at least one flight, lookup and scan\n", argv[0]);
+        exit(1);
+    }
+
+    srandom(1);
+    airplanelist_init(&list, free);
+    printf("%d flights\n", nflights);
+    register_all();
+
+    long found = 0;
+    long long start = now_ns();
+    for (long i = 0; i < lookups; i++)
+        found += (airplanelist_find(&list, ids[random() % nflights]) != NULL);
+    report("lookup (hash index)", lookups, now_ns() - start, "lookups");
+
+    // Each of these reads half the list on average, so do far fewer
+    long slow_lookups = (lookups / 1000 < 100) ? 100 : lookups / 1000;
+    start = now_ns();
+    for (long i = 0; i < slow_lookups; i++)
+        found += (pointer_index(ids[random() % nflights]) >= 0);
+    report("lookup (pointer scan)", slow_lookups, now_ns() - start, "lookups");
+
+    // Nothing is detached, so each of these looks at every flight
+    start = now_ns();
+    for (int i = 0; i < scans; i++)
+        found += (airplanelist_take_detached(&list) != NULL);
+    report("scan (registry arrays)", (long)scans * nflights, now_ns() - start, "flights");
+
+    start = now_ns();
+    for (int i = 0; i < scans; i++)
+        found += (pointer_detached() >= 0);
+    report("scan (pointer chase)", (long)scans * nflights, now_ns() - start, "flights");
+
+    if (found != lookups + slow_lookups) {
+        fprintf(stderr, "%s: %ld lookups failed\n", argv[0], lookups + slow_lookups - found);
+        exit(1);
+    }
+    airplanelist_destroy(&list);
+    free(ids);
+    return 0;
+}
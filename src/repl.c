@@ -0,0 +1,494 @@
+// Module for primary/backup replication of the server's state.
+
+// A primary server keeps a log of every change to its airports (planes
+// registering and leaving, flights joining and leaving queues, clearances
+// and departures), as one line of text per change:
+//
+//    R airport flightid category     plane registered
+//    U airport flightid              plane left
+//    T airport flightid category     flight joined the taxi queue
+//    Q airport flightid              flight left the queue
+//    C airport flightid              flight cleared for takeoff
+//    D airport flightid category     flight took off
+//
+// (a snapshot's "D" record is for the last departure, and also gives how
+// many ms ago it was, so the wake separation carries over).
+//
+// Standbys connect to the primary's replication port, get a snapshot of
+// the current state (in the same format), and then get the log streamed
+// to them. The primary doesn't wait for standbys: whatever has been
+// logged since the last batch is sent in one write, followed by a
+// heartbeat line "H seq time", and the standby answers each heartbeat
+// with "ACK seq time" once it has applied everything before it. The
+// difference between the primary's latest record and the last one a
+// standby acknowledged is the replication lag (reported by STATS).
+//
+// Applying a record is idempotent, so the snapshot doesn't have to line up
+// exactly with the start of the log -- the log is replayed from just
+// before the snapshot was taken. When the primary goes away (its
+// connection closes, or nothing arrives for REPL_TIMEOUT_MS), the standby
+// starts its runways and begins serving. Planes from the old primary are
+// kept "detached" until they reconnect and register again with the same
+// flight id at the same airport, which puts them back where they were.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "repl.h"
+#include "airport.h"
+#include "logger.h"
+#include "net.h"
+#include "topology.h"
+#include "vclock.h"
+#include "wake.h"
+
+// What the primary knows about each connected standby
+
+typedef struct standby {
+    int fd;
+    FILE *fp_send;
+    FILE *fp_recv;
+    long long sent;         // Log offset (bytes) shipped so far
+    long long acked_seq;    // Last record the standby has applied
+    long long lag_ms;       // Time from shipping to applied, last batch
+    pthread_t ship_tid;
+    pthread_t ack_tid;
+} standby;
+
+static int primary;                 // True if changes are being logged
+static char *log_buf;               // Ring buffer of the last changes
+static long long log_head;          // Bytes ever written to the log
+static long long log_seq;           // Records ever written to the log
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_grown;
+static standby *standbys[REPL_MAX_STANDBYS];
+static long long standbys_dropped;  // Dropped for falling too far behind
+static int listen_fd;
+
+static int standby_mode;            // True while following a primary
+static long long applied_seq;       // Last record applied (standby side)
+
+/************************************************************************
+ * repl_log adds a change to the log, if this server is a primary. The
+ * line (formatted like printf) must end in a newline.
+ */
+void repl_log(const char *fmt, ...) {
+    if (!primary)
+        return;
+
+    char line[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if ((len <= 0) || (len >= (int)sizeof(line)))
+        return;
+
+    pthread_mutex_lock(&repl_lock);
+    int start = log_head % REPL_LOG_SIZE;
+    int first = (len < REPL_LOG_SIZE - start) ? len : REPL_LOG_SIZE - start;
+    memcpy(log_buf + start, line, first);
+    memcpy(log_buf, line + first, len - first);
+    log_head += len;
+    log_seq++;
+    pthread_cond_broadcast(&log_grown);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+/************************************************************************
+ * repl_snapshot writes the state of every airport to "out", as log
+ * records.
+ */
+void repl_snapshot(FILE *out) {
+    for (int i = 0; i < airports_count(); i++) {
+        airport *ap = airports_get(i);
+
+        pthread_rwlock_rdlock(&ap->planes.lock);
+        for (int j = 0; j < ap->planes.planes.in_use; j++) {
+            airplane *plane = ap->planes.planes.data[j];
+            fprintf(out, "R %s %s %c\n", ap->code, plane->id, wake_letter(plane->category));
+        }
+        pthread_rwlock_unlock(&ap->planes.lock);
+
+        pthread_mutex_lock(&ap->queue.mutex);
+        if (ap->queue.last_category >= 0)
+            fprintf(out, "D %s - %c %lld\n", ap->code, wake_letter(ap->queue.last_category),
+                    vclock_now_ms() - ap->queue.last_departure);
+        for (queue_entry *entry = ap->queue.head; entry != NULL; entry = entry->next) {
+            fprintf(out, "T %s %s %c\n", ap->code, entry->id, wake_letter(entry->category));
+        }
+        if (ap->queue.cleared != NULL)
+            fprintf(out, "C %s %s\n", ap->code, ap->queue.cleared->id);
+        pthread_mutex_unlock(&ap->queue.mutex);
+    }
+}
+
+/************************************************************************
+ * repl_apply applies one log record to this server's state.
+ */
+void repl_apply(char *line) {
+    char op;
+    char code[AIRPORT_MAXCODE+1];
+    char id[PLANE_MAXID+1];
+    char cat[2] = "M";
+    long long ago_ms = 0;
+    if (sscanf(line, "%c %4s %20s %1s %lld", &op, code, id, cat, &ago_ms) < 3)
+        return;
+
+    airport *ap = airport_get(code);
+    if (ap == NULL)
+        return;
+    int category = wake_parse(cat);
+    if (category < 0)
+        category = WAKE_DEFAULT;
+
+    airplane *plane;
+    switch (op) {
+    case 'R':
+        airport_restore(ap, id, category);
+        break;
+    case 'U':
+        plane = airplanelist_find(&ap->planes, id);
+        if ((plane != NULL) && airplane_detached(plane))
+            airport_leave(plane);
+        break;
+    case 'T':
+        plane = airport_restore(ap, id, category);
+        if ((plane != NULL) && airplane_detached(plane))
+            plane->state = PLANE_TAXIING;
+        if ((plane != NULL) && !queue_exist(&ap->queue, id))
+            queue_add(&ap->queue, plane, category);
+        break;
+    case 'Q':
+        queue_remove(&ap->queue, id);
+        break;
+    case 'C':
+        plane = airplanelist_find(&ap->planes, id);
+        if ((plane != NULL) && airplane_detached(plane))
+            plane->state = PLANE_CLEAR;
+        queue_mark_cleared(&ap->queue, id);
+        break;
+    case 'D':
+        plane = airplanelist_find(&ap->planes, id);
+        if ((plane != NULL) && airplane_detached(plane))
+            plane->state = PLANE_INAIR;
+        queue_mark_departed(&ap->queue, id, category, ago_ms);
+        break;
+    }
+}
+
+/************************************************************************
+ * repl_ack_reader reads acknowledgements from a standby. When the standby
+ * goes away it shuts the socket down, so the shipping thread stops too.
+ */
+static void *repl_ack_reader(void *arg) {
+    standby *sb = arg;
+    char *line = NULL;
+    size_t size = 0;
+    long long seq, ms;
+    while (getline(&line, &size, sb->fp_recv) >= 0) {
+        if (sscanf(line, "ACK %lld %lld", &seq, &ms) == 2) {
+            pthread_mutex_lock(&repl_lock);
+            sb->acked_seq = seq;
+            sb->lag_ms = vclock_now_ms() - ms;
+            pthread_mutex_unlock(&repl_lock);
+        }
+    }
+    free(line);
+    shutdown(sb->fd, SHUT_RDWR);
+    return NULL;
+}
+
+/************************************************************************
+ * repl_wait_log waits (with repl_lock held) until the log has grown past
+ * "sent" or a heartbeat is due.
+ */
+static void repl_wait_log(long long sent) {
+    long long deadline_ms = vclock_now_ms() + REPL_HEARTBEAT_MS;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ms / 1000;
+    deadline.tv_nsec = (deadline_ms % 1000) * 1000000;
+    while (log_head == sent) {
+        if (pthread_cond_timedwait(&log_grown, &repl_lock, &deadline) != 0)
+            break;
+    }
+}
+
+/************************************************************************
+ * repl_ship is the thread that feeds one standby: a snapshot first, and
+ * then batches of log records (or just heartbeats) until the standby goes
+ * away or falls too far behind.
+ */
+static void *repl_ship(void *arg) {
+    standby *sb = arg;
+    char *batch = malloc(REPL_LOG_SIZE);
+    if (batch == NULL) {
+        perror("repl_ship");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&repl_lock);
+    sb->sent = log_head;
+    long long seq = log_seq;
+    pthread_mutex_unlock(&repl_lock);
+
+    fprintf(sb->fp_send, "SNAP\n");
+    repl_snapshot(sb->fp_send);
+    fprintf(sb->fp_send, "END %lld\n", seq);
+    int ok = (fflush(sb->fp_send) == 0);
+
+    while (ok) {
+        pthread_mutex_lock(&repl_lock);
+        repl_wait_log(sb->sent);
+        long long len = log_head - sb->sent;
+        if (len > REPL_LOG_SIZE) {
+            standbys_dropped++;
+            pthread_mutex_unlock(&repl_lock);
+            LOG(LOG_WARN, "Standby fell too far behind -- dropping it");
+            break;
+        }
+        int start = sb->sent % REPL_LOG_SIZE;
+        int first = (len < REPL_LOG_SIZE - start) ? len : REPL_LOG_SIZE - start;
+        memcpy(batch, log_buf + start, first);
+        memcpy(batch + first, log_buf, len - first);
+        sb->sent = log_head;
+        seq = log_seq;
+        pthread_mutex_unlock(&repl_lock);
+
+        fwrite(batch, 1, len, sb->fp_send);
+        fprintf(sb->fp_send, "H %lld %lld\n", seq, vclock_now_ms());
+        ok = (fflush(sb->fp_send) == 0);
+    }
+
+    shutdown(sb->fd, SHUT_RDWR);
+    pthread_join(sb->ack_tid, NULL);
+
+    pthread_mutex_lock(&repl_lock);
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        if (standbys[i] == sb)
+            standbys[i] = NULL;
+    }
+    pthread_mutex_unlock(&repl_lock);
+
+    LOG(LOG_INFO, "Standby disconnected");
+    fclose(sb->fp_send);
+    fclose(sb->fp_recv);
+    free(sb);
+    free(batch);
+    return NULL;
+}
+
+/************************************************************************
+ * repl_accept_standby sets up a newly connected standby and starts its
+ * threads, or turns it away if there are already REPL_MAX_STANDBYS.
+ */
+static void repl_accept_standby(int fd) {
+    standby *sb = calloc(1, sizeof(standby));
+    if (sb == NULL) {
+        perror("repl_accept_standby");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&repl_lock);
+    int slot = -1;
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        if (standbys[i] == NULL) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0)
+        standbys[slot] = sb;
+    pthread_mutex_unlock(&repl_lock);
+
+    int dup_fd = dup(fd);
+    if ((slot < 0) || (dup_fd < 0)) {
+        LOG(LOG_WARN, "Turning away standby");
+        pthread_mutex_lock(&repl_lock);
+        if (slot >= 0)
+            standbys[slot] = NULL;
+        pthread_mutex_unlock(&repl_lock);
+        if (dup_fd >= 0)
+            close(dup_fd);
+        close(fd);
+        free(sb);
+        return;
+    }
+
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    // Batches go out in one write, so the sender is fully buffered
+    sb->fd = fd;
+    sb->fp_send = fdopen(fd, "w");
+    sb->fp_recv = fdopen(dup_fd, "r");
+    setvbuf(sb->fp_send, NULL, _IOFBF, 64*1024);
+
+    topology_create(&sb->ack_tid, TOPO_BACKGROUND, -1, "repl-ack", repl_ack_reader, sb);
+    topology_create(&sb->ship_tid, TOPO_BACKGROUND, -1, "repl-ship", repl_ship, sb);
+    pthread_detach(sb->ship_tid);
+    LOG(LOG_INFO, "Standby connected");
+}
+
+/************************************************************************
+ * repl_listen is the thread that accepts standby connections.
+ */
+static void *repl_listen(void *arg) {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        repl_accept_standby(fd);
+    }
+    perror("repl accept");
+    return NULL;
+}
+
+/************************************************************************
+ * repl_start_primary starts logging changes, and listens for standbys on
+ * port "service". Returns 0, or -1 if the port can't be opened.
+ */
+int repl_start_primary(char *service) {
+    listen_fd = create_listener(service);
+    if (listen_fd < 0)
+        return -1;
+
+    log_buf = malloc(REPL_LOG_SIZE);
+    if (log_buf == NULL) {
+        perror("repl_start_primary");
+        exit(1);
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_grown, &attr);
+    pthread_condattr_destroy(&attr);
+
+    primary = 1;
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "repl-listen", repl_listen, NULL);
+    pthread_detach(tid);
+    return 0;
+}
+
+/************************************************************************
+ * repl_drop_detached is started after a takeover, and gives up on planes
+ * that haven't come back within REPL_RECONNECT_SECS.
+ */
+static void *repl_drop_detached(void *arg) {
+    sleep(REPL_RECONNECT_SECS);
+    int count = 0;
+    for (int i = 0; i < airports_count(); i++)
+        count += airport_drop_detached(airports_get(i));
+    if (count > 0)
+        LOG(LOG_INFO, "Dropped %d planes that did not reconnect", count);
+    return NULL;
+}
+
+/************************************************************************
+ * repl_standby follows the primary at "host" port "service", keeping this
+ * server's state in step with it, and returns when the primary is gone
+ * and this server has taken over (runways running). Exits if it can't
+ * get a full snapshot from the primary in the first place.
+ */
+void repl_standby(char *host, char *service) {
+    int fd = connect_to(host, service);
+    int dup_fd = (fd < 0) ? -1 : dup(fd);
+    if (dup_fd < 0) {
+        fprintf(stderr, "Could not reach primary at %s:%s\n", host, service);
+        exit(1);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = REPL_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (REPL_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    FILE *fp_recv = fdopen(fd, "r");
+    FILE *fp_send = fdopen(dup_fd, "w");
+    setvbuf(fp_send, NULL, _IOLBF, 0);
+    fprintf(fp_send, "SYNC\n");
+
+    standby_mode = 1;
+    int synced = 0;
+    char *line = NULL;
+    size_t size = 0;
+    long long seq, ms;
+    while (getline(&line, &size, fp_recv) >= 0) {
+        if (sscanf(line, "H %lld %lld", &seq, &ms) == 2) {
+            applied_seq = seq;
+            fprintf(fp_send, "ACK %lld %lld\n", seq, ms);
+        } else if (sscanf(line, "END %lld", &seq) == 1) {
+            synced = 1;
+            applied_seq = seq;
+            LOG(LOG_INFO, "Synced with primary %s:%s", host, service);
+        } else if (strncmp(line, "SNAP", 4) != 0) {
+            repl_apply(line);
+        }
+    }
+    long long lost = vclock_now_ms();
+    free(line);
+    fclose(fp_recv);
+    fclose(fp_send);
+
+    if (!synced) {
+        fprintf(stderr, "Lost primary before getting its state\n");
+        exit(1);
+    }
+
+    airports_start_runways();
+    standby_mode = 0;
+
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "repl-drop", repl_drop_detached, NULL);
+    pthread_detach(tid);
+
+    int queued = 0;
+    for (int i = 0; i < airports_count(); i++)
+        queued += queue_size(&airports_get(i)->queue);
+    LOG(LOG_WARN, "Primary lost -- took over in %lld ms with %d flights queued",
+        vclock_now_ms() - lost, queued);
+}
+
+/************************************************************************
+ * repl_stats writes the replication statistics (for the STATS command)
+ * as " name=value" pairs.
+ */
+void repl_stats(FILE *out) {
+    if (standby_mode) {
+        fprintf(out, " repl_role=standby repl_applied=%lld", applied_seq);
+        return;
+    }
+    if (!primary) {
+        fprintf(out, " repl_role=none");
+        return;
+    }
+
+    pthread_mutex_lock(&repl_lock);
+    int count = 0;
+    long long lag_records = 0;
+    long long lag_ms = 0;
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        standby *sb = standbys[i];
+        if (sb == NULL)
+            continue;
+        count++;
+        if (log_seq - sb->acked_seq > lag_records)
+            lag_records = log_seq - sb->acked_seq;
+        if (sb->lag_ms > lag_ms)
+            lag_ms = sb->lag_ms;
+    }
+    fprintf(out, " repl_role=primary repl_standbys=%d repl_seq=%lld repl_lag_records=%lld"
+            " repl_lag_ms=%lld repl_dropped=%lld",
+            count, log_seq, lag_records, lag_ms, standbys_dropped);
+    pthread_mutex_unlock(&repl_lock);
+}
@@ -0,0 +1,33 @@
+// Prototypes for the replication module
+
+#ifndef _REPL_H
+#define _REPL_H
+
+#include <stdio.h>
+
+// The primary keeps the last REPL_LOG_SIZE bytes of changes for its
+// standbys. A standby that falls further behind than that is dropped (and
+// can reconnect for a fresh snapshot), which bounds the replication lag.
+
+#define REPL_LOG_SIZE (4*1024*1024)
+#define REPL_MAX_STANDBYS 8
+
+// The primary ships at least this often (an empty batch is a heartbeat),
+// and a standby that hears nothing for REPL_TIMEOUT_MS takes over.
+
+#define REPL_HEARTBEAT_MS 100
+#define REPL_TIMEOUT_MS 500
+
+// After a takeover, planes have this long to reconnect and register
+// again before their place in the queue is given up.
+
+#define REPL_RECONNECT_SECS 30
+
+int repl_start_primary(char *service);
+void repl_standby(char *host, char *service);
+void repl_log(const char *fmt, ...);
+void repl_snapshot(FILE *out);
+void repl_apply(char *line);
+void repl_stats(FILE *out);
+
+#endif  // _REPL_H
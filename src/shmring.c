@@ -0,0 +1,492 @@
+// Module for shared-memory ring connections, for clients (like test-bench
+// simulators) running on the same machine as the server.
+
+// A client connected to the server's local (Unix) socket can send "SHM"
+// before registering. The server answers "OK" on the socket, passing along
+// with it a shared-memory segment holding two rings (one for each
+// direction) and four eventfds to sleep on (see shmring.h). From then on
+// the connection's commands and replies go through the rings, and the
+// socket is only kept to notice when either end goes away.
+//
+// On the server the rings are wrapped in stdio streams, and become the
+// plane's fp_recv and fp_send, so everything above them (docommand, the
+// binary protocol, hot restarts) works as it does for a socket. A side
+// only makes a system call when the other side is asleep waiting for it,
+// so a busy connection never enters the kernel at all.
+//
+// shmring_connect is the client's side of the same thing, for programs
+// that want to talk to the server this way.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmring.h"
+#include "net.h"
+
+// One end of a ring connection
+
+typedef struct shm_conn {
+    shm_segment *seg;
+    shm_ring *in;           // The ring this end reads
+    shm_ring *out;          // The ring this end writes
+    int in_data_efd;        // Wakes this end when "in" has data
+    int in_space_efd;       // Wakes the other end when "in" has space
+    int out_data_efd;       // Wakes the other end when "out" has data
+    int out_space_efd;      // Wakes this end when "out" has space
+    int sock;               // The Unix socket (only watched for closing)
+    int fds[SHM_NFDS];
+    int server;             // True for the server's end
+    int refs;               // Streams still open on this end
+    char *pending;          // Input to hand out before the ring's
+    size_t pending_len;
+    size_t pending_pos;
+} shm_conn;
+
+static int nconns;
+
+/************************************************************************
+ * ring_put copies as much of the "len" bytes at "buf" into ring "r" as
+ * there is room for, and returns how many it copied.
+ */
+static size_t ring_put(shm_ring *r, const char *buf, size_t len) {
+    unsigned int head = r->head;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t room = SHM_RING_SIZE - (head - tail);
+    size_t n = (len < room) ? len : room;
+    size_t off = head & (SHM_RING_SIZE - 1);
+    size_t first = (n < SHM_RING_SIZE - off) ? n : SHM_RING_SIZE - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/************************************************************************
+ * ring_get copies up to "size" bytes out of ring "r" into "buf", and
+ * returns how many it copied.
+ */
+static size_t ring_get(shm_ring *r, char *buf, size_t size) {
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = r->tail;
+    size_t n = head - tail;
+    if (n > size)
+        n = size;
+    size_t off = tail & (SHM_RING_SIZE - 1);
+    size_t first = (n < SHM_RING_SIZE - off) ? n : SHM_RING_SIZE - off;
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, n - first);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/************************************************************************
+ * ring_ready returns true if ring "r" has room (if "want_space" is true)
+ * or data (if it is false).
+ */
+static int ring_ready(shm_ring *r, int want_space) {
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return want_space ? (head - tail < SHM_RING_SIZE) : (head != tail);
+}
+
+/************************************************************************
+ * ring_wake wakes the other side through eventfd "efd", if its "waiting"
+ * flag says it is asleep.
+ */
+static void ring_wake(int *waiting, int efd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
+            perror("ring_wake");
+    }
+}
+
+/************************************************************************
+ * conn_wait sleeps until ring "r" of connection "c" is ready (see
+ * ring_ready), using the side's "waiting" flag and eventfd "efd". Returns
+ * 1 when it is worth looking at the ring again, 0 if the other end has
+ * gone away, or -1 if interrupted.
+ */
+static int conn_wait(shm_conn *c, shm_ring *r, int want_space, int *waiting, int efd) {
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring_ready(r, want_space)) {
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    struct pollfd pfd[2] = {{efd, POLLIN, 0}, {c->sock, POLLIN, 0}};
+    int result = poll(pfd, 2, -1);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    if (result < 0)
+        return -1;
+    if (pfd[0].revents & POLLIN) {
+        uint64_t count;
+        if (read(efd, &count, sizeof(count)) < 0)
+            return -1;
+    }
+    if (pfd[1].revents != 0) {
+        char junk[64];   // Nothing should come on the socket -- ignore it
+        ssize_t len = recv(c->sock, junk, sizeof(junk), MSG_DONTWAIT);
+        if ((len == 0) || ((len < 0) && (errno != EAGAIN) && (errno != EINTR)))
+            return 0;
+    }
+    return 1;
+}
+
+/************************************************************************
+ * conn_read, conn_write and conn_close are the functions for the streams
+ * on a ring connection.
+ */
+static ssize_t conn_read(void *cookie, char *buf, size_t size) {
+    shm_conn *c = cookie;
+    if (c->pending_pos < c->pending_len) {
+        size_t n = c->pending_len - c->pending_pos;
+        if (n > size)
+            n = size;
+        memcpy(buf, c->pending + c->pending_pos, n);
+        c->pending_pos += n;
+        return n;
+    }
+
+    while (1) {
+        size_t n = ring_get(c->in, buf, size);
+        if (n > 0) {
+            ring_wake(&c->in->producer_waiting, c->in_space_efd);
+            return n;
+        }
+        int result = conn_wait(c, c->in, 0, &c->in->consumer_waiting, c->in_data_efd);
+        if (result < 0)
+            return -1;
+        if (result == 0)  // Gone, but first hand out what it sent before going
+            return ring_get(c->in, buf, size);
+    }
+}
+
+static ssize_t conn_write(void *cookie, const char *buf, size_t size) {
+    shm_conn *c = cookie;
+    size_t done = 0;
+    while (done < size) {
+        size_t n = ring_put(c->out, buf + done, size - done);
+        if (n > 0) {
+            done += n;
+            ring_wake(&c->out->consumer_waiting, c->out_data_efd);
+            continue;
+        }
+        int result = conn_wait(c, c->out, 1, &c->out->producer_waiting, c->out_space_efd);
+        if ((result < 0) && (errno == EINTR))
+            continue;
+        if (result <= 0) {
+            errno = EPIPE;
+            return (done > 0) ? done : -1;
+        }
+    }
+    return size;
+}
+
+static int conn_close(void *cookie) {
+    shm_conn *c = cookie;
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return 0;
+    if (c->server)
+        __atomic_sub_fetch(&nconns, 1, __ATOMIC_RELAXED);
+    munmap(c->seg, sizeof(shm_segment));
+    for (int i = 0; i < SHM_NFDS; i++)
+        close(c->fds[i]);
+    close(c->sock);
+    free(c->pending);
+    free(c);
+    return 0;
+}
+
+/************************************************************************
+ * conn_stream opens a stream for reading (if "reading" is true) or
+ * writing on connection "c".
+ */
+static FILE *conn_stream(shm_conn *c, int reading) {
+    cookie_io_functions_t funcs = {conn_read, conn_write, NULL, conn_close};
+    FILE *fp = fopencookie(c, reading ? "r" : "w", funcs);
+    if (fp == NULL) {
+        perror("conn_stream fopencookie");
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOLBF, 0);
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+    return fp;
+}
+
+/************************************************************************
+ * conn_open makes one end (the server's if "server" is true) of a ring
+ * connection from the descriptors "fds" (see shmring.h), which it takes
+ * over along with socket "sock". Returns NULL (having closed them all) if
+ * the segment isn't a ring segment this program knows.
+ */
+static shm_conn *conn_open(int sock, int *fds, int server) {
+    shm_segment *seg = mmap(NULL, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fds[SHM_FD_SEGMENT], 0);
+    if ((seg != MAP_FAILED) && ((seg->magic != SHM_MAGIC) || (seg->version != SHM_VERSION) ||
+                                (seg->size != sizeof(shm_segment)))) {
+        munmap(seg, sizeof(shm_segment));
+        seg = MAP_FAILED;
+    }
+    shm_conn *c = (seg == MAP_FAILED) ? NULL : calloc(1, sizeof(shm_conn));
+    if (c == NULL) {
+        fprintf(stderr, "Not a usable shared-memory ring\n");
+        if (seg != MAP_FAILED)
+            munmap(seg, sizeof(shm_segment));
+        for (int i = 0; i < SHM_NFDS; i++)
+            close(fds[i]);
+        close(sock);
+        return NULL;
+    }
+
+    c->seg = seg;
+    c->sock = sock;
+    memcpy(c->fds, fds, sizeof(c->fds));
+    c->server = server;
+    if (server) {
+        c->in = &seg->to_server;
+        c->out = &seg->to_client;
+        c->in_data_efd = fds[SHM_FD_TO_SERVER_DATA];
+        c->in_space_efd = fds[SHM_FD_TO_SERVER_SPACE];
+        c->out_data_efd = fds[SHM_FD_TO_CLIENT_DATA];
+        c->out_space_efd = fds[SHM_FD_TO_CLIENT_SPACE];
+    } else {
+        c->in = &seg->to_client;
+        c->out = &seg->to_server;
+        c->in_data_efd = fds[SHM_FD_TO_CLIENT_DATA];
+        c->in_space_efd = fds[SHM_FD_TO_CLIENT_SPACE];
+        c->out_data_efd = fds[SHM_FD_TO_SERVER_DATA];
+        c->out_space_efd = fds[SHM_FD_TO_SERVER_SPACE];
+    }
+    return c;
+}
+
+/************************************************************************
+ * plane_attach switches "plane" over from its socket streams to streams
+ * on ring connection "c".
+ */
+static void plane_attach(airplane *plane, shm_conn *c) {
+    fclose(plane->fp_send);
+    fclose(plane->fp_recv);
+    plane->fp_recv = conn_stream(c, 1);
+    plane->fp_send = conn_stream(c, 0);
+    plane->shm = c;
+    __atomic_add_fetch(&nconns, 1, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * shmring_start switches "plane" (which sent a SHM command) to a new ring
+ * connection, sending it "OK" and the descriptors for it. Returns 0, or
+ * -1 (with nothing changed) if the plane isn't connected over a Unix
+ * socket or the connection can't be made.
+ */
+int shmring_start(airplane *plane) {
+    int sock = fileno(plane->fp_send);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if ((sock < 0) || (getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0) ||
+        (addr.ss_family != AF_UNIX))
+        return -1;
+
+    int fds[SHM_NFDS];
+    for (int i = 0; i < SHM_NFDS; i++)
+        fds[i] = -1;
+    shm_segment *seg = MAP_FAILED;
+    fds[SHM_FD_SEGMENT] = memfd_create("atc-ring", MFD_CLOEXEC);
+    if ((fds[SHM_FD_SEGMENT] >= 0) && (ftruncate(fds[SHM_FD_SEGMENT], sizeof(shm_segment)) == 0))
+        seg = mmap(NULL, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_FD_SEGMENT], 0);
+    int ok = (seg != MAP_FAILED);
+    for (int i = 1; i < SHM_NFDS; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC);
+        ok = ok && (fds[i] >= 0);
+    }
+    if (!ok) {
+        perror("shmring_start");
+        if (seg != MAP_FAILED)
+            munmap(seg, sizeof(shm_segment));
+        for (int i = 0; i < SHM_NFDS; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        return -1;
+    }
+    seg->magic = SHM_MAGIC;
+    seg->version = SHM_VERSION;
+    seg->size = sizeof(shm_segment);
+    munmap(seg, sizeof(shm_segment));
+
+    // The OK goes on the socket, after anything still waiting to go out
+    fflush(plane->fp_send);
+    char ok_msg[] = "OK\n";
+    struct iovec iov = {ok_msg, 3};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int keep = dup(sock);
+    if ((keep < 0) || (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)) {
+        perror("shmring_start sendmsg");
+        if (keep >= 0)
+            close(keep);
+        for (int i = 0; i < SHM_NFDS; i++)
+            close(fds[i]);
+        return -1;
+    }
+
+    shm_conn *c = conn_open(keep, fds, 1);
+    if (c == NULL)
+        return -1;
+    plane_attach(plane, c);
+    return 0;
+}
+
+/************************************************************************
+ * shmring_fds puts the descriptors of ring connection "plane" in "fds":
+ * its socket, then the ones from shmring.h. Returns how many there are.
+ * This is for handing the connection to another server.
+ */
+int shmring_fds(airplane *plane, int *fds) {
+    shm_conn *c = plane->shm;
+    fds[0] = c->sock;
+    memcpy(fds + 1, c->fds, sizeof(c->fds));
+    return SHM_NFDS + 1;
+}
+
+/************************************************************************
+ * shmring_attach switches "plane" (just made from the socket of a ring
+ * connection another server handed over) to the ring connection with
+ * descriptors "fds", taking them over. The "pending_len" bytes at
+ * "pending" (which it frees) are input the other server read but didn't
+ * act on. If the connection can't be used, the plane is disconnected.
+ */
+void shmring_attach(airplane *plane, int *fds, char *pending, size_t pending_len) {
+    shm_conn *c = conn_open(dup(fileno(plane->fp_send)), fds, 1);
+    if (c == NULL) {
+        shutdown(fileno(plane->fp_send), SHUT_RDWR);
+        free(pending);
+        return;
+    }
+    c->pending = pending;
+    c->pending_len = pending_len;
+    plane_attach(plane, c);
+}
+
+/************************************************************************
+ * shmring_pending returns how many bytes of the input given to
+ * shmring_attach (or shmring_reopen) the plane hasn't been handed yet,
+ * and where they are in "*data".
+ */
+size_t shmring_pending(airplane *plane, char **data) {
+    shm_conn *c = plane->shm;
+    *data = c->pending + c->pending_pos;
+    return c->pending_len - c->pending_pos;
+}
+
+/************************************************************************
+ * shmring_reopen gives ring connection "plane" a new input stream, which
+ * starts with the "pending_len" bytes at "pending" (which it frees), after
+ * a hot restart that didn't happen.
+ */
+void shmring_reopen(airplane *plane, char *pending, size_t pending_len) {
+    shm_conn *c = plane->shm;
+    FILE *in = conn_stream(c, 1);
+    fclose(plane->fp_recv);
+    free(c->pending);
+    c->pending = pending;
+    c->pending_len = pending_len;
+    c->pending_pos = 0;
+    plane->fp_recv = in;
+}
+
+/************************************************************************
+ * shmring_connect connects to the server's local socket at "path", and
+ * makes a ring connection with it, setting "*in" and "*out" to streams
+ * for reading what the server sends and for sending it commands. Returns
+ * 0, or -1 on failure.
+ */
+int shmring_connect(char *path, FILE **in, FILE **out) {
+    int sock = connect_local(path);
+    if (sock < 0)
+        return -1;
+    if (write(sock, "SHM\n", 4) != 4) {
+        perror("shmring_connect");
+        close(sock);
+        return -1;
+    }
+
+    int fds[SHM_NFDS];
+    char reply[256];
+    struct iovec iov = {reply, 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // The descriptors come with the first byte of the reply
+    int nfds = 0;
+    size_t len = 0;
+    if (recvmsg(sock, &msg, 0) == 1) {
+        len = 1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), ((nfds < SHM_NFDS) ? nfds : SHM_NFDS) * sizeof(int));
+        }
+    }
+    while ((len > 0) && (len < sizeof(reply) - 1) && (reply[len - 1] != '\n') &&
+           (read(sock, reply + len, 1) == 1))
+        len++;
+    reply[len] = '\0';
+
+    if ((nfds != SHM_NFDS) || (strcmp(reply, "OK\n") != 0)) {
+        fprintf(stderr, "Shared-memory connection refused: %s", (len > 0) ? reply : "no reply\n");
+        for (int i = 0; i < ((nfds < SHM_NFDS) ? nfds : SHM_NFDS); i++)
+            close(fds[i]);
+        close(sock);
+        return -1;
+    }
+
+    shm_conn *c = conn_open(sock, fds, 0);
+    if (c == NULL)
+        return -1;
+    *in = conn_stream(c, 1);
+    *out = conn_stream(c, 0);
+    return 0;
+}
+
+/************************************************************************
+ * shmring_stats writes the ring connection statistics (for the STATS
+ * command) as " name=value" pairs.
+ */
+void shmring_stats(FILE *out) {
+    fprintf(out, " shm_conns=%d", __atomic_load_n(&nconns, __ATOMIC_RELAXED));
+}
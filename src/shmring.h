@@ -0,0 +1,61 @@
+// Layout of the shared-memory ring connections, and prototypes for the
+// functions that set them up (on both the server and client side)
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#include <stdio.h>
+
+#include "airplane.h"
+
+#define SHM_MAGIC 0x52435441     // "ATCR"
+#define SHM_VERSION 1
+
+// Bytes in each direction's ring (a power of two)
+
+#define SHM_RING_SIZE 65536
+
+// One direction of a connection: a single-producer, single-consumer ring.
+// "head" and "tail" count the bytes ever written and read, and each is
+// only changed by its own side. A side that finds nothing to do sets its
+// "waiting" flag and sleeps on an eventfd, and the other side only writes
+// to that eventfd when the flag is set, so a busy connection makes no
+// system calls at all. Each side's fields have their own cache line.
+
+typedef struct shm_ring {
+    unsigned int head __attribute__((aligned(64)));
+    int producer_waiting;       // Producer is waiting for space
+    unsigned int tail __attribute__((aligned(64)));
+    int consumer_waiting;       // Consumer is waiting for data
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shm_ring;
+
+typedef struct shm_segment {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;          // Of the whole segment, in bytes
+    shm_ring to_server;
+    shm_ring to_client;
+} shm_segment;
+
+// The descriptors that come with the "OK" to a SHM command, in order: the
+// segment (a memfd), then for each ring (to the server, then to the
+// client) the eventfd that wakes its consumer and the one that wakes its
+// producer.
+
+#define SHM_FD_SEGMENT 0
+#define SHM_FD_TO_SERVER_DATA 1
+#define SHM_FD_TO_SERVER_SPACE 2
+#define SHM_FD_TO_CLIENT_DATA 3
+#define SHM_FD_TO_CLIENT_SPACE 4
+#define SHM_NFDS 5
+
+int shmring_start(airplane *plane);
+int shmring_fds(airplane *plane, int *fds);
+void shmring_attach(airplane *plane, int *fds, char *pending, size_t pending_len);
+size_t shmring_pending(airplane *plane, char **data);
+void shmring_reopen(airplane *plane, char *pending, size_t pending_len);
+int shmring_connect(char *path, FILE **in, FILE **out);
+void shmring_stats(FILE *out);
+
+#endif  // _SHMRING_H
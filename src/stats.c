@@ -0,0 +1,84 @@
+// Module for the STATS command, which reports the server's statistics to
+// a client as a single line: "OK" followed by space-separated name=value
+// pairs. Monitoring tools should ignore names they don't know, since new
+// ones get added as the server grows.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+#include "airport.h"
+#include "admit.h"
+#include "allocs.h"
+#include "binproto.h"
+#include "capture.h"
+#include "conntab.h"
+#include "fleet.h"
+#include "logger.h"
+#include "observe.h"
+#include "prealloc.h"
+#include "repl.h"
+#include "shmring.h"
+#include "topology.h"
+
+/************************************************************************
+ * stats_write writes the current statistics to "out", as "name=value"
+ * pairs.
+ */
+static void stats_write(FILE *out) {
+    int count = airports_count();
+    int planes = 0;
+    int queued = 0;
+    long long eta_checked = 0, eta_err_total = 0, eta_err_max = 0;
+    for (int i = 0; i < count; i++) {
+        airport *ap = airports_get(i);
+        planes += airplanelist_size(&ap->planes);
+        queued += queue_size(&ap->queue);
+
+        long long checked, err_total, err_max;
+        queue_eta_stats(&ap->queue, &checked, &err_total, &err_max);
+        eta_checked += checked;
+        eta_err_total += err_total;
+        if (err_max > eta_err_max)
+            eta_err_max = err_max;
+    }
+
+    fprintf(out, "airports=%d planes=%d queued=%d", count, planes, queued);
+    fprintf(out, " eta_checked=%lld eta_err_mean_ms=%lld eta_err_max_ms=%lld", eta_checked,
+            (eta_checked > 0) ? eta_err_total / eta_checked : 0, eta_err_max);
+    conntab_stats(out);
+    admit_stats(out);
+    capture_stats(out);
+    prealloc_stats(out);
+    allocs_stats(out);
+    binproto_stats(out);
+    shmring_stats(out);
+    fleet_stats(out);
+    observe_stats(out);
+    logger_stats(out);
+    topology_stats(out);
+    repl_stats(out);
+}
+
+/************************************************************************
+ * stats_send sends the current statistics to "plane".
+ */
+void stats_send(airplane *plane) {
+    if (plane->bin != NULL) {
+        char *text;
+        size_t len;
+        FILE *mem = open_memstream(&text, &len);
+        if (mem == NULL) {
+            perror("stats_send");
+            exit(1);
+        }
+        stats_write(mem);
+        fclose(mem);
+        binproto_send(plane, BIN_OK, 0, text, len);
+        free(text);
+        return;
+    }
+    fprintf(plane->fp_send, "OK ");
+    stats_write(plane->fp_send);
+    fprintf(plane->fp_send, "\n");
+}
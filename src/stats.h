@@ -0,0 +1,10 @@
+// Prototypes for the statistics module
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "airplane.h"
+
+void stats_send(airplane *plane);
+
+#endif  // _STATS_H
@@ -0,0 +1,352 @@
+// Module for the thread topology, which decides where the server's
+// threads run, at what priority and with how much stack, and keeps
+// track of the CPU time they use.
+
+// Every thread the server starts has a role (see topology.h) and is
+// started with topology_create, which gives it its role's attributes:
+// the CPUs it may run on, a real-time (SCHED_FIFO) priority if its role
+// has one, and its role's stack size. Runway threads are each pinned to
+// one CPU of their set, in turn by airport, so that a busy runway has a
+// core to itself as far as the set allows; I/O and background threads may
+// run on any CPU of theirs. By default every role has all the CPUs the
+// process started with, normal priority and the default stack, which is
+// how the server has always run its threads. "-t role=cpus:priority:stack"
+// (see topology_set) changes that for a role, so the runways can have
+// cores that connection threads never touch.
+//
+// Each thread is also on a list, with its CPU-time clock, from when it
+// starts until it exits (when its time is added to its role's total), so
+// STATS can report the CPU time of each role, and of each runway and
+// background thread by name.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "topology.h"
+#include "logger.h"
+
+// A role's attributes
+
+typedef struct topo_role {
+    cpu_set_t set;              // The CPUs its threads may run on
+    int cpus[CPU_SETSIZE];      // The same, in order
+    int ncpus;                  // 0 if its threads can run anywhere
+    int priority;               // SCHED_FIFO priority (0 for normal)
+    size_t stack;               // Stack size (0 for the default)
+    int warned;                 // Its priority has been refused
+} topo_role;
+
+// A thread the topology is keeping track of
+
+typedef struct topo_thread {
+    int role;
+    char name[16];
+    clockid_t clock;            // Its CPU-time clock
+    void *(*fn)(void *);        // What it runs, and with what
+    void *arg;
+    struct topo_thread *prev;
+    struct topo_thread *next;
+} topo_thread;
+
+static char *role_names[TOPO_NROLES] = {"io", "runway", "background"};
+
+static topo_role roles[TOPO_NROLES];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static topo_thread *threads;
+static long long exited_ns[TOPO_NROLES];    // CPU time of threads that exited
+
+/************************************************************************
+ * set_cpus sets the CPUs of "role" to "set".
+ */
+static void set_cpus(topo_role *role, cpu_set_t *set) {
+    role->set = *set;
+    role->ncpus = 0;
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, set))
+            role->cpus[role->ncpus++] = i;
+    }
+}
+
+static void thread_untrack(void *data);
+
+/************************************************************************
+ * topology_init gives every role the CPUs the process may run on (before
+ * any thread of it is pinned), for the roles that aren't given any.
+ */
+static void topology_init() {
+    pthread_key_create(&thread_key, thread_untrack);
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return;
+    for (int i = 0; i < TOPO_NROLES; i++) {
+        if (roles[i].ncpus == 0)
+            set_cpus(&roles[i], &set);
+    }
+}
+
+/************************************************************************
+ * parse_cpus reads a list of CPUs like "0-3,6" from "spec" into "set",
+ * leaving "*end" after it. Returns 0, or -1 if it isn't valid.
+ */
+static int parse_cpus(char *spec, cpu_set_t *set, char **end) {
+    CPU_ZERO(set);
+    char *cp = spec;
+    while ((*cp >= '0') && (*cp <= '9')) {
+        long first = strtol(cp, &cp, 10);
+        long last = first;
+        if (*cp == '-')
+            last = strtol(cp + 1, &cp, 10);
+        if ((last < first) || (last >= CPU_SETSIZE))
+            return -1;
+        for (long i = first; i <= last; i++)
+            CPU_SET(i, set);
+        if (*cp != ',')
+            break;
+        cp++;
+    }
+    *end = cp;
+    return 0;
+}
+
+/************************************************************************
+ * topology_set sets the attributes of a role's threads from "spec",
+ * which is "role=cpus[:priority[:stack_kb]]": the CPUs they may run on
+ * (like "0-3,6", or empty to leave them as they are), a SCHED_FIFO
+ * priority (1 to 99, or 0 for normal scheduling) and a stack size in KB
+ * (0 for the default). Must be called before any thread is started.
+ * Returns 0, or -1 if "spec" isn't valid.
+ */
+int topology_set(char *spec) {
+    char *eq = strchr(spec, '=');
+    if (eq == NULL)
+        return -1;
+    int r;
+    for (r = 0; r < TOPO_NROLES; r++) {
+        if ((strlen(role_names[r]) == (size_t)(eq - spec)) &&
+            (strncmp(spec, role_names[r], eq - spec) == 0))
+            break;
+    }
+    if (r == TOPO_NROLES)
+        return -1;
+
+    cpu_set_t set;
+    char *end;
+    long priority = 0, stack_kb = 0;
+    if (parse_cpus(eq + 1, &set, &end) < 0)
+        return -1;
+    if (*end == ':')
+        priority = strtol(end + 1, &end, 10);
+    if (*end == ':')
+        stack_kb = strtol(end + 1, &end, 10);
+    if ((*end != '\0') || (priority < 0) || (priority > sched_get_priority_max(SCHED_FIFO)) ||
+        (stack_kb < 0) || ((stack_kb > 0) && (stack_kb * 1024 < PTHREAD_STACK_MIN)))
+        return -1;
+
+    // Only CPUs the process may run on can be given
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cpu_set_t both;
+        CPU_AND(&both, &set, &allowed);
+        if (!CPU_EQUAL(&both, &set))
+            return -1;
+    }
+
+    topo_role *role = &roles[r];
+    if (CPU_COUNT(&set) > 0)
+        set_cpus(role, &set);
+    role->priority = priority;
+    role->stack = stack_kb * 1024;
+    return 0;
+}
+
+/************************************************************************
+ * topology_cpu returns the CPU that thread number "index" of "role" is
+ * pinned to, or -1 if it may run on any of its role's CPUs.
+ */
+int topology_cpu(int role, int index) {
+    pthread_once(&init_once, topology_init);
+    if ((role != TOPO_RUNWAY) || (roles[role].ncpus == 0) || (index < 0))
+        return -1;
+    return roles[role].cpus[index % roles[role].ncpus];
+}
+
+/************************************************************************
+ * thread_track puts the calling thread, described by "t", on the list.
+ */
+static void thread_track(topo_thread *t) {
+    if (t->name[0] != '\0')
+        pthread_setname_np(pthread_self(), t->name);
+    pthread_getcpuclockid(pthread_self(), &t->clock);
+    pthread_setspecific(thread_key, t);
+
+    pthread_mutex_lock(&threads_lock);
+    t->prev = NULL;
+    t->next = threads;
+    if (threads != NULL)
+        threads->prev = t;
+    threads = t;
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/************************************************************************
+ * cpu_ns returns the time (ns) on CPU-time clock "clock".
+ */
+static long long cpu_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/************************************************************************
+ * thread_untrack takes a thread that is exiting (described by "data")
+ * off the list, adding its CPU time to its role's total. It is run by
+ * the exiting thread itself, as the destructor of its key.
+ */
+static void thread_untrack(void *data) {
+    topo_thread *t = data;
+    pthread_mutex_lock(&threads_lock);
+    exited_ns[t->role] += cpu_ns(t->clock);
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        threads = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    pthread_mutex_unlock(&threads_lock);
+    free(t);
+}
+
+/************************************************************************
+ * thread_start is where every thread started by topology_create begins.
+ */
+static void *thread_start(void *data) {
+    topo_thread *t = data;
+    thread_track(t);
+    return t->fn(t->arg);
+}
+
+/************************************************************************
+ * thread_new makes the description of a thread of "role" called "name"
+ * (which may be NULL, to leave the name alone).
+ */
+static topo_thread *thread_new(int role, const char *name) {
+    topo_thread *t = calloc(1, sizeof(topo_thread));
+    if (t == NULL) {
+        perror("topology");
+        exit(1);
+    }
+    t->role = role;
+    if (name != NULL)
+        snprintf(t->name, sizeof(t->name), "%s", name);
+    return t;
+}
+
+/************************************************************************
+ * topology_create starts a thread of "role" running "fn(arg)", putting
+ * its id in "*tid", like pthread_create. "index" is which thread of its
+ * role it is (for runway threads, which are pinned in turn; -1 for the
+ * others), and "name" (if not NULL) is what to call it. If the role's
+ * real-time priority isn't allowed, the thread is started without it
+ * (with a warning, the first time). Returns 0, or an error number.
+ */
+int topology_create(pthread_t *tid, int role, int index, const char *name,
+                    void *(*fn)(void *), void *arg) {
+    pthread_once(&init_once, topology_init);
+    topo_role *r = &roles[role];
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int cpu = topology_cpu(role, index);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    } else if (r->ncpus > 0) {
+        pthread_attr_setaffinity_np(&attr, sizeof(r->set), &r->set);
+    }
+    if (r->stack > 0)
+        pthread_attr_setstacksize(&attr, r->stack);
+    if (r->priority > 0) {
+        struct sched_param param = { .sched_priority = r->priority };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    topo_thread *t = thread_new(role, name);
+    t->fn = fn;
+    t->arg = arg;
+    int err = pthread_create(tid, &attr, thread_start, t);
+    if ((err == EPERM) && (r->priority > 0)) {
+        if (!__atomic_exchange_n(&r->warned, 1, __ATOMIC_RELAXED))
+            LOG(LOG_WARN, "Can't give %s threads real-time priority, running them without",
+                role_names[role]);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(tid, &attr, thread_start, t);
+    }
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+        free(t);
+    return err;
+}
+
+/************************************************************************
+ * topology_join gives the calling thread (which wasn't started with
+ * topology_create, like the main thread) the attributes of "role", apart
+ * from its stack, and keeps track of it as one of the role's threads,
+ * called "name" (or left as it is, if that is NULL).
+ */
+void topology_join(int role, const char *name) {
+    pthread_once(&init_once, topology_init);
+    topo_role *r = &roles[role];
+
+    if (r->ncpus > 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(r->set), &r->set);
+    if (r->priority > 0) {
+        struct sched_param param = { .sched_priority = r->priority };
+        if ((pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) &&
+            !__atomic_exchange_n(&r->warned, 1, __ATOMIC_RELAXED))
+            LOG(LOG_WARN, "Can't give %s threads real-time priority, running them without",
+                role_names[role]);
+    }
+    thread_track(thread_new(role, name));
+}
+
+/************************************************************************
+ * topology_stats writes the CPU time (ms) used by each role's threads,
+ * and by each runway and background thread, and how many threads each
+ * role has, (for the STATS command) as " name=value" pairs.
+ */
+void topology_stats(FILE *out) {
+    long long role_ns[TOPO_NROLES];
+    int count[TOPO_NROLES] = {0};
+
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < TOPO_NROLES; i++)
+        role_ns[i] = exited_ns[i];
+    for (topo_thread *t = threads; t != NULL; t = t->next) {
+        long long ns = cpu_ns(t->clock);
+        role_ns[t->role] += ns;
+        count[t->role]++;
+        if ((t->role != TOPO_IO) && (t->name[0] != '\0'))
+            fprintf(out, " cpu_ms_%s=%lld", t->name, ns / 1000000);
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    for (int i = 0; i < TOPO_NROLES; i++)
+        fprintf(out, " threads_%s=%d cpu_%s_ms=%lld", role_names[i], count[i],
+                role_names[i], role_ns[i] / 1000000);
+}
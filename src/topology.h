@@ -0,0 +1,26 @@
+// Constants and prototypes for the thread topology module
+
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// The roles a thread can have. I/O threads are the accept loop and the
+// connection threads, runway threads are the airports' runway managers,
+// and background threads are everything else (the logger's writer,
+// replication, the departure board, the observers' fan-out and so on).
+
+#define TOPO_IO 0
+#define TOPO_RUNWAY 1
+#define TOPO_BACKGROUND 2
+#define TOPO_NROLES 3
+
+int topology_set(char *spec);
+int topology_cpu(int role, int index);
+int topology_create(pthread_t *tid, int role, int index, const char *name,
+                    void *(*fn)(void *), void *arg);
+void topology_join(int role, const char *name);
+void topology_stats(FILE *out);
+
+#endif  // _TOPOLOGY_H
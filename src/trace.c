@@ -0,0 +1,244 @@
+// Module for the event tracer, which records what each thread spent its
+// time on, to find out where the time goes when takeoffs are late.
+
+// The trace points (see trace.h) time things like handling a command,
+// waiting for a queue's lock, the runway's dispatching and waiting, and
+// reading from and writing to sockets. Each event is just a name and two
+// time-stamp counter readings, put in a ring that belongs to the thread
+// (so recording one takes no lock), where it stays until the ring comes
+// round again. A thread's ring is made the first time it records
+// anything, and is kept after the thread exits, until there are so many
+// rings that it has to be handed on to a new thread.
+//
+// Sending the server SIGUSR1 writes everything in the rings to a new file
+// in Chrome's trace event format, which chrome://tracing and Perfetto can
+// load. Without ATC_TRACE there are no trace points, so the rings stay
+// empty (and SIGUSR1 isn't caught).
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "logger.h"
+#include "topology.h"
+
+typedef struct trace_event {
+    const char *name;
+    long long start;
+    long long end;
+} trace_event;
+
+// One thread's events. Only the thread writes to its ring; "head" counts
+// the events ever recorded in it.
+
+typedef struct trace_ring {
+    unsigned int head;
+    int tid;
+    long long closed;           // When its thread exited (0 if it hasn't)
+    char name[TRACE_MAXNAME+1];
+    struct trace_ring *next;
+    trace_event events[TRACE_RING];
+} trace_ring;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring *my_ring;
+static int nrings;
+static long long exits;         // Threads with rings that have exited
+
+/************************************************************************
+ * ring_close is the destructor for a thread's ring: it lets the next new
+ * thread have it.
+ */
+static void ring_close(void *data) {
+    trace_ring *ring = data;
+    pthread_mutex_lock(&rings_lock);
+    ring->closed = ++exits;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_create() {
+    pthread_key_create(&ring_key, ring_close);
+}
+
+/************************************************************************
+ * ring_get returns the calling thread's ring, making one if need be (or
+ * once there are TRACE_MAXRINGS, taking over the one whose thread exited
+ * first).
+ */
+static trace_ring *ring_get() {
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_once(&ring_once, ring_key_create);
+    pthread_mutex_lock(&rings_lock);
+    trace_ring *ring = NULL;
+    if (nrings >= TRACE_MAXRINGS) {
+        for (trace_ring *r = rings; r != NULL; r = r->next) {
+            if (r->closed && ((ring == NULL) || (r->closed < ring->closed)))
+                ring = r;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring));
+        if (ring == NULL) {
+            perror("trace");
+            exit(1);
+        }
+        ring->next = rings;
+        rings = ring;
+        nrings++;
+    }
+    ring->closed = 0;
+    ring->tid = gettid();
+    ring->name[0] = '\0';
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/************************************************************************
+ * trace_record records event "name", which went from tick "start" to tick
+ * "end", for the calling thread. This is what TRACE_END calls.
+ */
+void trace_record(const char *name, long long start, long long end) {
+    trace_ring *ring = ring_get();
+    unsigned int head = ring->head;
+    trace_event *ev = &ring->events[head % TRACE_RING];
+    ev->name = name;
+    ev->start = start;
+    ev->end = end;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * trace_name_thread gives the calling thread name "name" in the trace.
+ */
+void trace_name_thread(const char *name) {
+    trace_ring *ring = ring_get();
+    pthread_mutex_lock(&rings_lock);
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    pthread_mutex_unlock(&rings_lock);
+}
+
+#ifdef ATC_TRACE
+
+static char *dump_prefix;
+static int dumps;             // Trace files written so far
+
+/************************************************************************
+ * write_ring writes the events in "ring" to "out" as trace events for
+ * process "pid", with a comma before each one unless "*first" is true.
+ * The ring's thread carries on recording while this runs, so the events
+ * it might have written over meanwhile are left out. Returns the number
+ * of events written. Must be called with rings_lock held.
+ */
+static int write_ring(FILE *out, trace_ring *ring, int pid, int *first) {
+    if (ring->name[0] != '\0') {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", *first ? "" : ",", pid, ring->tid, ring->name);
+        *first = 0;
+    }
+
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int count = (head < TRACE_RING) ? head : TRACE_RING;
+    trace_event *copy = malloc((count + 1) * sizeof(trace_event));
+    if (copy == NULL) {
+        perror("trace");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < count; i++)
+        copy[i] = ring->events[(head - count + i) % TRACE_RING];
+
+    // Whatever the thread has come round to since may have been
+    // overwritten while it was copied
+    unsigned int now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int overrun = now - head + count;
+    unsigned int skip = (overrun <= TRACE_RING) ? 0 : overrun - TRACE_RING;
+    if (skip > count)
+        skip = count;
+
+    for (unsigned int i = skip; i < count; i++) {
+        long long start = tsc_to_ns(copy[i].start);
+        long long end = tsc_to_ns(copy[i].end);
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld}", *first ? "" : ",",
+                copy[i].name, pid, ring->tid, start / 1000, start % 1000,
+                (end - start) / 1000, (end - start) % 1000);
+        *first = 0;
+    }
+    free(copy);
+    return count - skip;
+}
+
+/************************************************************************
+ * trace_dump writes every thread's events to the next trace file.
+ */
+static void trace_dump() {
+    char path[strlen(dump_prefix) + 32];
+    snprintf(path, sizeof(path), "%s-%d-%d.json", dump_prefix, (int)getpid(), ++dumps);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        LOG(LOG_ERROR, "Can't write trace %s", path);
+        return;
+    }
+
+    tsc_calibrate();
+    int count = 0;
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    pthread_mutex_lock(&rings_lock);
+    for (trace_ring *ring = rings; ring != NULL; ring = ring->next)
+        count += write_ring(out, ring, getpid(), &first);
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    LOG(LOG_INFO, "Wrote %d trace events to %s", count, path);
+}
+
+/************************************************************************
+ * trace_waiter is the thread that writes a trace file whenever the
+ * server gets SIGUSR1.
+ */
+static void *trace_waiter(void *arg) {
+    sigset_t *set = arg;
+    TRACE_NAME("trace");
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) == 0)
+            trace_dump();
+    }
+    return NULL;
+}
+
+#endif  // ATC_TRACE
+
+/************************************************************************
+ * trace_start makes SIGUSR1 write the trace to files starting with
+ * "prefix". It must be called before any other thread is started, since
+ * they all need SIGUSR1 blocked. Does nothing without ATC_TRACE.
+ */
+void trace_start(char *prefix) {
+#ifdef ATC_TRACE
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    tsc_init();
+    dump_prefix = prefix;
+    pthread_t tid;
+    topology_create(&tid, TOPO_BACKGROUND, -1, "trace", trace_waiter, &set);
+    pthread_detach(tid);
+#endif
+}
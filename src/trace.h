@@ -0,0 +1,45 @@
+// Prototypes and macros for the event tracer
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "tsc.h"
+
+// Events kept for each thread (the oldest are overwritten)
+
+#define TRACE_RING 4096
+
+// Rings kept before those of threads that have exited are reused (the
+// ones whose threads exited first go first)
+
+#define TRACE_MAXRINGS 256
+
+// Longest thread name kept
+
+#define TRACE_MAXNAME 31
+
+// The trace points are only compiled in with ATC_TRACE defined ("make
+// TRACE=1"). TRACE_BEGIN(var) starts timing into local variable "var",
+// TRACE_END(var, name) records the span since then as event "name" (a
+// string literal), and TRACE_NAME(name) names the calling thread in the
+// trace.
+
+#ifdef ATC_TRACE
+
+#define TRACE_BEGIN(var) long long var = tsc_now()
+#define TRACE_END(var, name) trace_record((name), (var), tsc_now())
+#define TRACE_NAME(name) trace_name_thread(name)
+
+#else
+
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name)
+#define TRACE_NAME(name)
+
+#endif
+
+void trace_start(char *prefix);
+void trace_record(const char *name, long long start, long long end);
+void trace_name_thread(const char *name);
+
+#endif  // _TRACE_H
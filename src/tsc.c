@@ -0,0 +1,80 @@
+// Module for turning time-stamp counter readings into the time of day.
+
+// Reading the CPU's time-stamp counter takes a few nanoseconds, against
+// about 25 for clock_gettime, so the logger and the tracer stamp their
+// records with it and leave working out what time that was until they
+// write the records out. This measures how fast the counter goes, from
+// the time tsc_init was called, so the longer the server has been
+// running the better the measurement (tsc_calibrate refines it). Where
+// there is no counter, tsc_now already gives the time of day and this
+// has nothing to do.
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsc.h"
+
+// What the time of day was at "base_ticks", and how fast the ticks go
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static long long base_ticks;
+static long long base_ns;
+static double ticks_per_ns = 1.0;
+
+/************************************************************************
+ * now_ns returns the time of day in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/************************************************************************
+ * tsc_start takes the starting point, and a first measurement of the
+ * rate (over 2 ms) for the records written before there has been time for
+ * a good one.
+ */
+static void tsc_start() {
+#ifdef TSC_AVAILABLE
+    base_ticks = tsc_now();
+    base_ns = now_ns();
+    usleep(2000);
+    tsc_calibrate();
+#endif
+}
+
+/************************************************************************
+ * tsc_init gets the module ready (only the first call does anything).
+ */
+void tsc_init() {
+    pthread_once(&init_once, tsc_start);
+}
+
+/************************************************************************
+ * tsc_calibrate measures how fast the ticks have gone since tsc_init.
+ */
+void tsc_calibrate() {
+#ifdef TSC_AVAILABLE
+    long long ticks = tsc_now();
+    long long ns = now_ns();
+    if (ns - base_ns >= 1000000) {
+        double rate = (double)(ticks - base_ticks) / (ns - base_ns);
+        __atomic_store(&ticks_per_ns, &rate, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+/************************************************************************
+ * tsc_to_ns returns the time of day (in nanoseconds) at "ticks".
+ */
+long long tsc_to_ns(long long ticks) {
+#ifdef TSC_AVAILABLE
+    double rate;
+    __atomic_load(&ticks_per_ns, &rate, __ATOMIC_RELAXED);
+    return base_ns + (long long)((ticks - base_ticks) / rate);
+#else
+    return ticks;
+#endif
+}
@@ -0,0 +1,32 @@
+// Prototypes for the time-stamp counter module, which gives the logger and
+// the tracer cheap timestamps
+
+#ifndef _TSC_H
+#define _TSC_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TSC_AVAILABLE 1
+#else
+#include <time.h>
+#endif
+
+/************************************************************************
+ * tsc_now returns the time-stamp counter, or where there isn't one, the
+ * time of day in nanoseconds. Only tsc_to_ns can make sense of it.
+ */
+static inline long long tsc_now() {
+#ifdef TSC_AVAILABLE
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void tsc_init();
+void tsc_calibrate();
+long long tsc_to_ns(long long ticks);
+
+#endif  // _TSC_H
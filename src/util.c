@@ -2,8 +2,12 @@
 // functionality for the ground control server, but are not tied to a
 // particular data type or module.
 
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#ifndef __GLIBC__
+#include <stdio_ext.h>
+#endif
 
 #include "util.h"
 
@@ -30,3 +34,20 @@ char *trim(char *line) {
 
     return line;
 }
+
+/************************************************************************
+ * stream_unread returns how many bytes input stream "fp" has read from
+ * its file but not handed out yet, and sets "data" to where they are in
+ * its buffer. stdio has no standard way to ask this: glibc's FILE fields
+ * say it, and other C libraries (like musl) have __freadptr.
+ */
+size_t stream_unread(FILE *fp, char **data) {
+#ifdef __GLIBC__
+    *data = fp->_IO_read_ptr;
+    return (fp->_IO_read_ptr < fp->_IO_read_end) ? fp->_IO_read_end - fp->_IO_read_ptr : 0;
+#else
+    size_t len = 0;
+    *data = (char *)__freadptr(fp, &len);
+    return (*data != NULL) ? len : 0;
+#endif
+}
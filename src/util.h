@@ -3,6 +3,9 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdio.h>
+
 char *trim(char *line);
+size_t stream_unread(FILE *fp, char **data);
 
 #endif  // _UTIL_H
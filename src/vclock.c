@@ -0,0 +1,52 @@
+// Module for the clock used by the runway scheduler.
+
+// Normally this is just the monotonic system clock, which is also the
+// clock the runway thread's timed waits are based on. The simulator
+// switches it to a virtual clock that only moves when it is told to, so
+// a whole day of departures can be replayed in a few seconds, and the
+// same seed always gives exactly the same run.
+
+#include <time.h>
+
+#include "vclock.h"
+
+static int use_virtual = 0;
+static long long virtual_now = 0;
+
+/************************************************************************
+ * vclock_now_ms returns the current time in milliseconds. The starting
+ * point is arbitrary, so only differences between times mean anything.
+ */
+long long vclock_now_ms() {
+    if (use_virtual)
+        return virtual_now;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/************************************************************************
+ * vclock_is_virtual returns true if the virtual clock is in use.
+ */
+int vclock_is_virtual() {
+    return use_virtual;
+}
+
+/************************************************************************
+ * vclock_use_virtual switches to the virtual clock, starting at
+ * "start_ms". This should be done before anything reads the clock.
+ */
+void vclock_use_virtual(long long start_ms) {
+    use_virtual = 1;
+    virtual_now = start_ms;
+}
+
+/************************************************************************
+ * vclock_set moves the virtual clock to "now_ms". Time never runs
+ * backwards, so earlier times are ignored.
+ */
+void vclock_set(long long now_ms) {
+    if (now_ms > virtual_now)
+        virtual_now = now_ms;
+}
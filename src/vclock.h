@@ -0,0 +1,11 @@
+// Prototypes for the server clock module
+
+#ifndef _VCLOCK_H
+#define _VCLOCK_H
+
+long long vclock_now_ms();
+int vclock_is_virtual();
+void vclock_use_virtual(long long start_ms);
+void vclock_set(long long now_ms);
+
+#endif  // _VCLOCK_H
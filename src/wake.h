@@ -0,0 +1,42 @@
+// Prototypes and constants for the wake turbulence sequencing module
+
+#ifndef _WAKE_H
+#define _WAKE_H
+
+// Wake turbulence categories, following the ICAO letters that a plane
+// can give at registration time (REG flightid [L|M|H|J]). As with the
+// plane states, the numbers are used directly as indexes into the
+// separation matrix, so they must stay 0..WAKE_NCATS-1.
+
+#define WAKE_LIGHT 0
+#define WAKE_MEDIUM 1
+#define WAKE_HEAVY 2
+#define WAKE_SUPER 3
+#define WAKE_NCATS 4
+
+// A plane that doesn't give a category is treated as medium, which
+// keeps the original fixed 4 second gap between two unknown planes.
+
+#define WAKE_DEFAULT WAKE_MEDIUM
+
+// Real-world separations are around 90 seconds, and the server uses a 4
+// second gap for that, so matrix entries (in real seconds) are scaled by
+// WAKE_BASE_MS / WAKE_BASE_SECONDS to get the server delay.
+
+#define WAKE_BASE_SECONDS 90
+#define WAKE_BASE_MS 4000
+
+// The sequencer only looks this far into the taxi queue, and a plane
+// can be overtaken by at most WAKE_MAX_SHIFT later planes, so nobody
+// waits forever behind a stream of better-matched flights.
+
+#define WAKE_WINDOW 6
+#define WAKE_MAX_SHIFT 3
+
+int wake_parse(const char *str);
+char wake_letter(int category);
+int wake_separation_seconds(int leader, int follower);
+int wake_separation_ms(int leader, int follower);
+int wake_pick(int leader, const int *cats, const int *overtaken, int n);
+
+#endif  // _WAKE_H
@@ -0,0 +1,107 @@
+// Benchmark for the wake turbulence sequencer.
+
+// This simulates a busy departure bank, where there are always more
+// planes waiting in the taxi queue than the sequencer can look at, and
+// compares the runway throughput of plain first-come-first-served order
+// with the wake sequencer. Times are in real-world seconds (not the
+// shortened server delays), so the numbers are departures per hour.
+//
+// Usage: wake_bench [flights] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wake.h"
+
+// Fleet mix for the simulation, in percent: L, M, H, J
+
+static const int fleet_mix[WAKE_NCATS] = { 10, 55, 30, 5 };
+
+/************************************************************************
+ * random_category draws a wake category from the fleet mix.
+ */
+static int random_category(unsigned int *seed) {
+    int r = rand_r(seed) % 100;
+    for (int c = 0; c < WAKE_NCATS; c++) {
+        if (r < fleet_mix[c])
+            return c;
+        r -= fleet_mix[c];
+    }
+    return WAKE_DEFAULT;
+}
+
+/************************************************************************
+ * run_sequence departs all "n" flights (given in arrival order), letting
+ * the sequencer choose when "sequenced" is true and taking them strictly
+ * in order otherwise. Returns the total runway time in seconds, and the
+ * largest number of times any flight was overtaken in *max_overtaken.
+ */
+static long run_sequence(const int *arrivals, int n, int sequenced, int *max_overtaken) {
+    int cats[WAKE_WINDOW];
+    int overtaken[WAKE_WINDOW];
+    int waiting = 0;
+    int next_arrival = 0;
+    int leader = -1;
+    long total = 0;
+
+    *max_overtaken = 0;
+    while ((next_arrival < n) || (waiting > 0)) {
+        // Keep the window full -- the queue is never short of planes
+        while ((waiting < WAKE_WINDOW) && (next_arrival < n)) {
+            cats[waiting] = arrivals[next_arrival++];
+            overtaken[waiting] = 0;
+            waiting++;
+        }
+
+        int pick = sequenced ? wake_pick(leader, cats, overtaken, waiting) : 0;
+        total += wake_separation_seconds(leader, cats[pick]);
+        leader = cats[pick];
+
+        for (int i = 0; i < pick; i++) {
+            overtaken[i]++;
+            if (overtaken[i] > *max_overtaken)
+                *max_overtaken = overtaken[i];
+        }
+        for (int i = pick; i < waiting - 1; i++) {
+            cats[i] = cats[i+1];
+            overtaken[i] = overtaken[i+1];
+        }
+        waiting--;
+    }
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    int n = (argc > 1) ? atoi(argv[1]) : 100000;
+    unsigned int seed = (argc > 2) ? (unsigned int)atoi(argv[2]) : 362;
+    if (n <= 0) {
+        fprintf(stderr, "Usage: %s [flights] [seed]\n", argv[0]);
+        exit(1);
+    }
+
+    int *arrivals = malloc(n * sizeof(int));
+    if (arrivals == NULL) {
+        perror("wake_bench");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++)
+        arrivals[i] = random_category(&seed);
+
+    int fifo_shift, seq_shift;
+    long fifo = run_sequence(arrivals, n, 0, &fifo_shift);
+    long seq = run_sequence(arrivals, n, 1, &seq_shift);
+    double fifo_rate = 3600.0 * n / fifo;
+    double seq_rate = 3600.0 * n / seq;
+
+    printf("flights:         %d (mix L/M/H/J %d/%d/%d/%d%%)\n", n,
+           fleet_mix[0], fleet_mix[1], fleet_mix[2], fleet_mix[3]);
+    printf("window / shift:  %d / %d\n", WAKE_WINDOW, WAKE_MAX_SHIFT);
+    printf("FIFO:            %ld s total, %.2f departures/hour\n", fifo, fifo_rate);
+    printf("sequenced:       %ld s total, %.2f departures/hour (max overtaken %d)\n",
+           seq, seq_rate, seq_shift);
+    printf("gain:            %+.2f departures/hour (%+.1f%%)\n",
+           seq_rate - fifo_rate, 100.0 * (seq_rate - fifo_rate) / fifo_rate);
+
+    free(arrivals);
+    return 0;
+}